@@ -2,20 +2,23 @@
 #include "board.h"
 #include "display.h"
 #include "system_info.h"
-#include "ml307_ssl_transport.h"
 #include "audio_codec.h"
 #include "mqtt_protocol.h"
 #include "websocket_protocol.h"
 #include "font_awesome_symbols.h"
 #include "iot/thing_manager.h"
+#include "memory_accounting.h"
+#include "pcm_kernels.h"
 #include "assets/lang_config.h"
 
 #include <cstring>
+#include <algorithm>
 #include <esp_log.h>
 #include <cJSON.h>
 #include <driver/gpio.h>
 #include <arpa/inet.h>
 #include <esp_app_desc.h>
+#include <cinttypes>
 
 #define TAG "Application"
 
@@ -35,8 +38,42 @@ static const char* const STATE_STRINGS[] = {
 };
 
 Application::Application() {
+#if CONFIG_USE_TRACE
+    Trace::Initialize(CONFIG_TRACE_BUFFER_EVENTS);
+#endif
     event_group_ = xEventGroupCreate();
+#if CONFIG_USE_DEDICATED_AUDIO_WORKERS
+    // Opus encode and decode run on their own workers, the background task only does housekeeping
+    background_task_ = new BackgroundTask(4096 * 2);
+    uplink_worker_ = new AudioWorker("audio_uplink", AUDIO_UPLINK_WORKER_STACK_SIZE, 2, CONFIG_AUDIO_UPLINK_WORKER_CORE);
+    downlink_worker_ = new AudioWorker("audio_downlink", AUDIO_DOWNLINK_WORKER_STACK_SIZE, 2, CONFIG_AUDIO_DOWNLINK_WORKER_CORE);
+#else
     background_task_ = new BackgroundTask(4096 * 8);
+#endif
+
+    // Wake up the main loop when the audio jobs drain, so a pending state transition can complete
+    auto on_audio_idle = [this]() {
+        if (transition_pending_ || tts_stop_pending_) {
+            xEventGroupSetBits(event_group_, STATE_TRANSITION_EVENT);
+        }
+    };
+    background_task_->OnIdle(on_audio_idle);
+#if CONFIG_USE_DEDICATED_AUDIO_WORKERS
+    uplink_worker_->OnIdle(on_audio_idle);
+    downlink_worker_->OnIdle(on_audio_idle);
+#endif
+
+    esp_timer_create_args_t transition_timer_args = {
+        .callback = [](void* arg) {
+            Application* app = (Application*)arg;
+            xEventGroupSetBits(app->event_group_, STATE_TRANSITION_EVENT);
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "transition_timer",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&transition_timer_args, &transition_timer_handle_);
 
     esp_timer_create_args_t clock_timer_args = {
         .callback = [](void* arg) {
@@ -56,9 +93,21 @@ Application::~Application() {
         esp_timer_stop(clock_timer_handle_);
         esp_timer_delete(clock_timer_handle_);
     }
+    if (transition_timer_handle_ != nullptr) {
+        esp_timer_stop(transition_timer_handle_);
+        esp_timer_delete(transition_timer_handle_);
+    }
     if (background_task_ != nullptr) {
         delete background_task_;
     }
+#if CONFIG_USE_DEDICATED_AUDIO_WORKERS
+    if (uplink_worker_ != nullptr) {
+        delete uplink_worker_;
+    }
+    if (downlink_worker_ != nullptr) {
+        delete downlink_worker_;
+    }
+#endif
     vEventGroupDelete(event_group_);
 }
 
@@ -110,11 +159,17 @@ void Application::CheckNewVersion() {
                 codec->EnableOutput(false);
                 {
                     std::lock_guard<std::mutex> lock(mutex_);
-                    audio_decode_queue_.clear();
+                    ResetPlaybackQueue();
                 }
-                background_task_->WaitForCompletion();
+                WaitForAudioJobs();
                 delete background_task_;
                 background_task_ = nullptr;
+#if CONFIG_USE_DEDICATED_AUDIO_WORKERS
+                delete uplink_worker_;
+                uplink_worker_ = nullptr;
+                delete downlink_worker_;
+                downlink_worker_ = nullptr;
+#endif
                 vTaskDelay(pdMS_TO_TICKS(1000));
 
                 ota_.StartUpgrade([display](int progress, size_t speed) {
@@ -182,10 +237,8 @@ void Application::ShowActivationCode() {
         digit_sound{'9', Lang::Sounds::P3_9}
     }};
 
-    // This sentence uses 9KB of SRAM, so we need to wait for it to finish
+    // The digits queue behind the sentence, none of them is copied to SRAM
     Alert(Lang::Strings::ACTIVATION, message.c_str(), "happy", Lang::Sounds::P3_ACTIVATION);
-    vTaskDelay(pdMS_TO_TICKS(1000));
-    background_task_->WaitForCompletion();
 
     for (const auto& digit : code) {
         auto it = std::find_if(digit_sounds.begin(), digit_sounds.end(),
@@ -220,23 +273,41 @@ void Application::PlaySound(const std::string_view& sound) {
     auto codec = Board::GetInstance().GetAudioCodec();
     codec->EnableOutput(true);
     SetDecodeSampleRate(16000);
-    const char* data = sound.data();
-    size_t size = sound.size();
-    for (const char* p = data; p < data + size; ) {
-        auto p3 = (BinaryProtocol3*)p;
-        p += sizeof(BinaryProtocol3);
-
-        auto payload_size = ntohs(p3->payload_size);
-        std::vector<uint8_t> opus;
-        opus.resize(payload_size);
-        memcpy(opus.data(), p3->payload, payload_size);
-        p += payload_size;
+    // The packets are decoded straight from the asset, OutputAudio takes them a few at a time
+    std::lock_guard<std::mutex> lock(mutex_);
+    local_sounds_.push_back(sound);
+    FeedLocalSounds();
+}
 
-        std::lock_guard<std::mutex> lock(mutex_);
-        audio_decode_queue_.emplace_back(std::move(opus));
+// Caller holds mutex_
+void Application::FeedLocalSounds() {
+    while (!local_sounds_.empty() && jitter_buffer_.size() < LOCAL_SOUND_PREFETCH_PACKETS) {
+        auto& sound = local_sounds_.front();
+        if (sound.size() < sizeof(BinaryProtocol3)) {
+            local_sounds_.pop_front();
+            continue;
+        }
+        auto p3 = (const BinaryProtocol3*)sound.data();
+        size_t payload_size = ntohs(p3->payload_size);
+        if (sound.size() < sizeof(BinaryProtocol3) + payload_size) {
+            ESP_LOGW(TAG, "Truncated sound packet, %u bytes left", sound.size());
+            local_sounds_.pop_front();
+            continue;
+        }
+        jitter_buffer_.PutLocal(AudioPacket{ {}, 0, sound.substr(sizeof(BinaryProtocol3), payload_size) });
+        sound.remove_prefix(sizeof(BinaryProtocol3) + payload_size);
+        if (sound.empty()) {
+            local_sounds_.pop_front();
+        }
     }
 }
 
+// Caller holds mutex_
+void Application::ResetPlaybackQueue() {
+    jitter_buffer_.Reset();
+    local_sounds_.clear();
+}
+
 void Application::ToggleChatState() {
     if (device_state_ == kDeviceStateActivating) {
         SetDeviceState(kDeviceStateIdle);
@@ -256,6 +327,7 @@ void Application::ToggleChatState() {
             }
 
             keep_listening_ = true;
+            listening_mode_ = kListeningModeAutoStop;
             protocol_->SendStartListening(kListeningModeAutoStop);
             SetDeviceState(kDeviceStateListening);
         });
@@ -290,12 +362,14 @@ void Application::StartListening() {
                     return;
                 }
             }
+            listening_mode_ = kListeningModeManualStop;
             protocol_->SendStartListening(kListeningModeManualStop);
             SetDeviceState(kDeviceStateListening);
         });
     } else if (device_state_ == kDeviceStateSpeaking) {
         Schedule([this]() {
             AbortSpeaking(kAbortReasonNone);
+            listening_mode_ = kListeningModeManualStop;
             protocol_->SendStartListening(kListeningModeManualStop);
             SetDeviceState(kDeviceStateListening);
         });
@@ -311,7 +385,35 @@ void Application::StopListening() {
     });
 }
 
+// The codec callbacks run in the I2S ISRs, they only wake the main loop
+IRAM_ATTR bool Application::OnAudioInputReady(void* context) {
+    auto app = (Application*)context;
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    xEventGroupSetBitsFromISR(app->event_group_, AUDIO_INPUT_READY_EVENT, &higher_priority_task_woken);
+    return higher_priority_task_woken == pdTRUE;
+}
+
+IRAM_ATTR bool Application::OnAudioOutputReady(void* context) {
+    auto app = (Application*)context;
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    xEventGroupSetBitsFromISR(app->event_group_, AUDIO_OUTPUT_READY_EVENT, &higher_priority_task_woken);
+    return higher_priority_task_woken == pdTRUE;
+}
+
+IRAM_ATTR bool Application::OnAudioOutputDrained(void* context) {
+    auto app = (Application*)context;
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    xEventGroupSetBitsFromISR(app->event_group_, STATE_TRANSITION_EVENT, &higher_priority_task_woken);
+    return higher_priority_task_woken == pdTRUE;
+}
+
 void Application::Start() {
+    {
+        // Most boards create the display and the codec lazily, charge them to the board as well
+        MemoryExternalScope memory_scope(kMemoryTagBoard);
+        Board::GetInstance().GetDisplay();
+        Board::GetInstance().GetAudioCodec();
+    }
     auto& board = Board::GetInstance();
     SetDeviceState(kDeviceStateStarting);
 
@@ -320,33 +422,36 @@ void Application::Start() {
 
     /* Setup the audio codec */
     auto codec = board.GetAudioCodec();
-    opus_decode_sample_rate_ = codec->output_sample_rate();
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(opus_decode_sample_rate_, 1);
-    opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
-    // For ML307 boards, we use complexity 5 to save bandwidth
-    // For other boards, we use complexity 3 to save CPU
-    if (board.GetBoardType() == "ml307") {
-        ESP_LOGI(TAG, "ML307 board detected, setting opus encoder complexity to 5");
-        opus_encoder_->SetComplexity(5);
-    } else {
-        ESP_LOGI(TAG, "WiFi board detected, setting opus encoder complexity to 3");
-        opus_encoder_->SetComplexity(3);
+    {
+        MemoryExternalScope memory_scope(kMemoryTagAudio);
+        opus_encoder_ = std::make_unique<OpusUplinkEncoder>(16000, 1, opus_frame_duration_ms_);
     }
-
+    // The local sounds are 16 kHz, the server rate is known when the audio channel opens
+    SetDecodeSampleRate(16000);
+    max_pending_decode_jobs_ = std::max(1, MAX_PENDING_DECODE_MS / opus_frame_duration_ms_);
+    jitter_buffer_.Configure(opus_frame_duration_ms_, CONFIG_DOWNLINK_JITTER_MIN_DELAY_MS, CONFIG_DOWNLINK_JITTER_MAX_DELAY_MS);
+    // The board sets the range, the controller moves within it as CPU and link allow
+    encoder_controller_.Configure(board.GetOpusEncoderLimits(), opus_frame_duration_ms_);
+    opus_encoder_->SetComplexity(encoder_controller_.complexity());
+    opus_encoder_->SetBitrate(encoder_controller_.bitrate());
+
+    input_buffer_.reserve(codec->input_frame_samples());
     if (codec->input_sample_rate() != 16000) {
         input_resampler_.Configure(codec->input_sample_rate(), 16000);
         reference_resampler_.Configure(codec->input_sample_rate(), 16000);
+
+        int channel_samples = codec->input_frame_samples() / codec->input_channels();
+        int resampled_samples = input_resampler_.GetOutputSamples(channel_samples);
+        input_frame_.resize(resampled_samples * codec->input_channels());
+        if (codec->input_channels() == 2) {
+            input_reference_buffer_.resize(channel_samples);
+            input_resampled_buffer_.resize(resampled_samples * 2);
+        }
     }
-    codec->OnInputReady([this, codec]() {
-        BaseType_t higher_priority_task_woken = pdFALSE;
-        xEventGroupSetBitsFromISR(event_group_, AUDIO_INPUT_READY_EVENT, &higher_priority_task_woken);
-        return higher_priority_task_woken == pdTRUE;
-    });
-    codec->OnOutputReady([this]() {
-        BaseType_t higher_priority_task_woken = pdFALSE;
-        xEventGroupSetBitsFromISR(event_group_, AUDIO_OUTPUT_READY_EVENT, &higher_priority_task_woken);
-        return higher_priority_task_woken == pdTRUE;
-    });
+    codec->OnInputReady(OnAudioInputReady, this);
+    codec->OnOutputReady(OnAudioOutputReady, this);
+    // A transition to listening waits for the speaker to play out
+    codec->OnOutputDrained(OnAudioOutputDrained, this);
     codec->Start();
 
     /* Start the main loop */
@@ -366,23 +471,34 @@ void Application::Start() {
 #else
     protocol_ = std::make_unique<MqttProtocol>();
 #endif
+    protocol_->SetPreferredFrameDuration(opus_frame_duration_ms_);
     protocol_->OnNetworkError([this](const std::string& message) {
         SetDeviceState(kDeviceStateIdle);
         Alert(Lang::Strings::ERROR, message.c_str(), "sad", Lang::Sounds::P3_EXCLAMATION);
     });
-    protocol_->OnIncomingAudio([this](std::vector<uint8_t>&& data) {
+    protocol_->OnIncomingAudio([this](std::vector<uint8_t>&& data, uint32_t sequence) {
+        int64_t receive_time = esp_timer_get_time();
+        TRACE_INSTANT(kTraceIncomingAudio, data.size(), sequence);
         std::lock_guard<std::mutex> lock(mutex_);
-        if (device_state_ == kDeviceStateSpeaking) {
-            audio_decode_queue_.emplace_back(std::move(data));
+        if (device_state_ == kDeviceStateSpeaking && !aborted_) {
+            jitter_buffer_.Put(AudioPacket{ std::move(data), receive_time }, sequence);
+            TRACE_COUNTER(kTraceDecodeQueue, jitter_buffer_.size());
         }
     });
     protocol_->OnAudioChannelOpened([this, codec, &board]() {
         board.SetPowerSaveMode(false);
         if (protocol_->server_sample_rate() != codec->output_sample_rate()) {
-            ESP_LOGW(TAG, "Server sample rate %d does not match device output sample rate %d, resampling may cause distortion",
+            ESP_LOGI(TAG, "Server sample rate %d, device output sample rate %d",
                 protocol_->server_sample_rate(), codec->output_sample_rate());
         }
         SetDecodeSampleRate(protocol_->server_sample_rate());
+        SetEncodeFrameDuration(protocol_->frame_duration());
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            jitter_buffer_.ResetStats();
+        }
+        fec_decoded_frames_ = 0;
+        plc_decoded_frames_ = 0;
         auto& thing_manager = iot::ThingManager::GetInstance();
         protocol_->SendIotDescriptors(thing_manager.GetDescriptorsJson());
         std::string states;
@@ -393,6 +509,7 @@ void Application::Start() {
     protocol_->OnAudioChannelClosed([this, &board]() {
         board.SetPowerSaveMode(true);
         Schedule([this]() {
+            PrintDownlinkSessionStats();
             auto display = Board::GetInstance().GetDisplay();
             display->SetChatMessage("system", "");
             SetDeviceState(kDeviceStateIdle);
@@ -401,11 +518,18 @@ void Application::Start() {
     protocol_->OnIncomingJson([this, display](const cJSON* root) {
         // Parse JSON data
         auto type = cJSON_GetObjectItem(root, "type");
+        int64_t received_time = esp_timer_get_time();
         if (strcmp(type->valuestring, "tts") == 0) {
             auto state = cJSON_GetObjectItem(root, "state");
             if (strcmp(state->valuestring, "start") == 0) {
-                Schedule([this]() {
-                    aborted_ = false;
+                // Before the audio of the new speech arrives on this task
+                aborted_ = false;
+                Schedule([this, received_time]() {
+#if CONFIG_USE_ON_DEVICE_ENDPOINTER
+                    RecordEndpointLatency(kLatencyEndpointTts, received_time);
+#endif
+                    tts_stop_pending_ = false;
+                    sentence_ended_ = false;
                     if (device_state_ == kDeviceStateIdle || device_state_ == kDeviceStateListening) {
                         SetDeviceState(kDeviceStateSpeaking);
                     }
@@ -413,16 +537,14 @@ void Application::Start() {
             } else if (strcmp(state->valuestring, "stop") == 0) {
                 Schedule([this]() {
                     if (device_state_ == kDeviceStateSpeaking) {
-                        background_task_->WaitForCompletion();
-                        if (keep_listening_) {
-                            protocol_->SendStartListening(kListeningModeAutoStop);
-                            SetDeviceState(kDeviceStateListening);
-                        } else {
-                            SetDeviceState(kDeviceStateIdle);
-                        }
+                        tts_stop_pending_ = true;
+                        CheckSpeakingDrained();
                     }
                 });
             } else if (strcmp(state->valuestring, "sentence_start") == 0) {
+                Schedule([this]() {
+                    sentence_ended_ = false;
+                });
                 auto text = cJSON_GetObjectItem(root, "text");
                 if (text != NULL) {
                     ESP_LOGI(TAG, "<< %s", text->valuestring);
@@ -430,12 +552,20 @@ void Application::Start() {
                         display->SetChatMessage("assistant", message.c_str());
                     });
                 }
+            } else if (strcmp(state->valuestring, "sentence_end") == 0) {
+                // The audio of the sentence has been sent, the gap before the next one is not an underrun
+                Schedule([this]() {
+                    sentence_ended_ = true;
+                });
             }
         } else if (strcmp(type->valuestring, "stt") == 0) {
             auto text = cJSON_GetObjectItem(root, "text");
             if (text != NULL) {
                 ESP_LOGI(TAG, ">> %s", text->valuestring);
-                Schedule([this, display, message = std::string(text->valuestring)]() {
+                Schedule([this, display, message = std::string(text->valuestring), received_time]() {
+#if CONFIG_USE_ON_DEVICE_ENDPOINTER
+                    RecordEndpointLatency(kLatencyEndpointStt, received_time);
+#endif
                     display->SetChatMessage("user", message.c_str());
                 });
             }
@@ -455,6 +585,12 @@ void Application::Start() {
                     thing_manager.Invoke(command);
                 }
             }
+#if CONFIG_USE_TRACE
+        } else if (strcmp(type->valuestring, "trace") == 0) {
+            // Debug command: {"type": "trace", "url": "http://..."}, without url the trace goes to the serial port
+            auto url = cJSON_GetObjectItem(root, "url");
+            Trace::DumpAsync(cJSON_IsString(url) ? url->valuestring : "");
+#endif
         }
     });
     protocol_->Start();
@@ -473,21 +609,59 @@ void Application::Start() {
         vTaskDelete(NULL);
     }, "check_new_version", 4096 * 2, this, 2, nullptr);
 
-#if CONFIG_USE_AUDIO_PROCESSOR
-    audio_processor_.Initialize(codec->input_channels(), codec->input_reference());
-    audio_processor_.OnOutput([this](std::vector<int16_t>&& data) {
-        background_task_->Schedule([this, data = std::move(data)]() mutable {
-            opus_encoder_->Encode(std::move(data), [this](std::vector<uint8_t>&& opus) {
-                Schedule([this, opus = std::move(opus)]() {
-                    protocol_->SendAudio(opus);
-                });
-            });
+#if CONFIG_USE_ON_DEVICE_ENDPOINTER
+    EndpointerConfig endpointer_config;
+    endpointer_config.min_speech_ms = CONFIG_ENDPOINTER_MIN_SPEECH_MS;
+    endpointer_config.end_silence_ms = CONFIG_ENDPOINTER_END_SILENCE_MS;
+    endpointer_config.max_utterance_ms = CONFIG_ENDPOINTER_MAX_UTTERANCE_MS;
+    endpointer_config.energy_margin_db = CONFIG_ENDPOINTER_ENERGY_MARGIN_DB;
+    endpointer_.Configure(16000, endpointer_config);
+#endif
+#if CONFIG_USE_UPLINK_VAD_GATE
+    // The wake word AFE, initialized below, also produces the uplink audio, silence is gated by its VAD
+    uplink_gate_.Configure(16000, CONFIG_UPLINK_VAD_HANGOVER_MS, CONFIG_UPLINK_VAD_LOOKBACK_MS);
+    wake_word_detect_.OnOutput([this](std::vector<int16_t>&& data, int64_t capture_time_us, bool speech) {
+        int64_t fetch_time = esp_timer_get_time();
+        AudioLatency::GetInstance().Record(kLatencyAfe, fetch_time - capture_time_us);
+#if CONFIG_USE_ON_DEVICE_ENDPOINTER
+        DetectEndOfUtterance(data, speech);
+#endif
+        uplink_gate_.Process(std::move(data), capture_time_us, speech,
+            [this, fetch_time](std::vector<int16_t>&& frame, int64_t frame_capture_time_us, bool open) {
+#if CONFIG_UPLINK_VAD_GATE_DTX
+            EncodeAndSend(std::move(frame), frame_capture_time_us, fetch_time, !open);
+#else
+            if (open) {
+                EncodeAndSend(std::move(frame), frame_capture_time_us, fetch_time);
+            } else {
+                SendSilence(frame.size());
+            }
+#endif
         });
     });
+#elif CONFIG_USE_AUDIO_PROCESSOR
+    auto on_processed_audio = [this](std::vector<int16_t>&& data, int64_t capture_time_us) {
+        int64_t fetch_time = esp_timer_get_time();
+        AudioLatency::GetInstance().Record(kLatencyAfe, fetch_time - capture_time_us);
+        EncodeAndSend(std::move(data), capture_time_us, fetch_time);
+    };
+#if CONFIG_USE_SHARED_AUDIO_FRONT_END
+    // The wake word AFE, initialized below, also produces the uplink audio
+    wake_word_detect_.OnOutput([this, on_processed_audio](std::vector<int16_t>&& data, int64_t capture_time_us, bool speech) {
+#if CONFIG_USE_ON_DEVICE_ENDPOINTER
+        DetectEndOfUtterance(data, speech);
+#endif
+        on_processed_audio(std::move(data), capture_time_us);
+    });
+#else
+    audio_processor_.Initialize(codec->input_channels(), codec->input_reference());
+    audio_processor_.OnOutput(on_processed_audio);
+#endif
 #endif
 
 #if CONFIG_USE_WAKE_WORD_DETECT
     wake_word_detect_.Initialize(codec->input_channels(), codec->input_reference());
+    wake_word_detect_.SetWakeWordFrameDuration(opus_frame_duration_ms_);
     wake_word_detect_.OnVadStateChange([this](bool speaking) {
         Schedule([this, speaking]() {
             if (device_state_ == kDeviceStateListening) {
@@ -506,6 +680,8 @@ void Application::Start() {
         Schedule([this, &wake_word]() {
             if (device_state_ == kDeviceStateIdle) {
                 SetDeviceState(kDeviceStateConnecting);
+                // Encoded with the duration of the last session. Every packet carries its own
+                // frame size, so the server decodes them even if the new hello changes it.
                 wake_word_detect_.EncodeWakeWordData();
 
                 if (!protocol_->OpenAudioChannel()) {
@@ -549,6 +725,27 @@ void Application::OnClockTimer() {
         int free_sram = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
         int min_free_sram = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
         ESP_LOGI(TAG, "Free internal: %u minimal internal: %u", free_sram, min_free_sram);
+        if (background_task_ != nullptr) {
+            background_task_->PrintStats();
+        }
+        AudioLatency::GetInstance().PrintStats();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            jitter_buffer_.PrintStats();
+        }
+#if CONFIG_USE_MEMORY_ACCOUNTING
+        MemoryAccounting::PrintStats();
+#endif
+#if CONFIG_USE_DEDICATED_AUDIO_WORKERS
+        if (uplink_worker_ != nullptr && downlink_worker_ != nullptr) {
+            uplink_worker_->PrintStats();
+            downlink_worker_->PrintStats();
+        }
+#endif
+        if (schedule_overflows_ > 0 || schedule_heap_fallbacks_ > 0) {
+            ESP_LOGW(TAG, "Main tasks overflowed: %" PRIu32 " heap allocated: %" PRIu32,
+                schedule_overflows_.load(), schedule_heap_fallbacks_.load());
+        }
 
         // If we have synchronized server time, set the status to clock "HH:MM" if the device is idle
         if (ota_.HasServerTime()) {
@@ -565,22 +762,71 @@ void Application::OnClockTimer() {
     }
 }
 
-void Application::Schedule(std::function<void()> callback) {
-    {
-        std::lock_guard<std::mutex> lock(mutex_);
-        main_tasks_.push_back(std::move(callback));
+void Application::Schedule(MainTask callback) {
+    if (!callback.is_inline()) {
+        schedule_heap_fallbacks_++;
+    }
+    // overflow_pending_ counts the tasks in the overflow list plus a producer that is pushing to
+    // the ring. Taking the count before TryPush means only one producer uses the ring at a time
+    // and none while the list is in use, so a task never overtakes one that spilled before it.
+    size_t pending = overflow_pending_.fetch_add(1);
+    if (pending == 0 && main_tasks_.TryPush(std::move(callback))) {
+        overflow_pending_--;
+    } else {
+        std::lock_guard<std::mutex> lock(overflow_mutex_);
+        overflow_tasks_.push_back(std::move(callback));
+        if (pending == 0) {
+            // The ring itself was full
+            schedule_overflows_++;
+        }
     }
     xEventGroupSetBits(event_group_, SCHEDULE_EVENT);
 }
 
+void Application::RunScheduledTasks() {
+    TRACE_SCOPE(kTraceMainTasks, main_tasks_.size());
+    MainTask task;
+    // Tasks scheduled by these land in the ring too, bound the round so they cannot starve the audio events
+    size_t count = 0;
+    while (main_tasks_.TryPop(task)) {
+        task();
+        task.Reset();
+        if (++count == MAIN_TASK_QUEUE_SIZE) {
+            xEventGroupSetBits(event_group_, SCHEDULE_EVENT);
+            return;
+        }
+    }
+
+    // The ring is empty, the overflow list only holds tasks scheduled after it was filled
+    if (overflow_pending_.load() > 0) {
+        std::list<MainTask> tasks;
+        {
+            std::lock_guard<std::mutex> lock(overflow_mutex_);
+            tasks = std::move(overflow_tasks_);
+            overflow_tasks_.clear();
+        }
+        // A ring push that was in flight while the list was filled goes first
+        while (main_tasks_.TryPop(task)) {
+            task();
+            task.Reset();
+        }
+        for (auto& task : tasks) {
+            task();
+        }
+        // Only now, so that tasks they schedule keep going to the list behind them
+        overflow_pending_ -= tasks.size();
+    }
+}
+
 // The Main Loop controls the chat state and websocket connection
 // If other tasks need to access the websocket or chat state,
 // they should use Schedule to call this function
 void Application::MainLoop() {
     while (true) {
         auto bits = xEventGroupWaitBits(event_group_,
-            SCHEDULE_EVENT | AUDIO_INPUT_READY_EVENT | AUDIO_OUTPUT_READY_EVENT,
+            SCHEDULE_EVENT | AUDIO_INPUT_READY_EVENT | AUDIO_OUTPUT_READY_EVENT | STATE_TRANSITION_EVENT,
             pdTRUE, pdFALSE, portMAX_DELAY);
+        TRACE_SCOPE(kTraceMainLoop, bits);
 
         if (bits & AUDIO_INPUT_READY_EVENT) {
             InputAudio();
@@ -589,57 +835,103 @@ void Application::MainLoop() {
             OutputAudio();
         }
         if (bits & SCHEDULE_EVENT) {
-            std::unique_lock<std::mutex> lock(mutex_);
-            std::list<std::function<void()>> tasks = std::move(main_tasks_);
-            lock.unlock();
-            for (auto& task : tasks) {
-                task();
-            }
+            RunScheduledTasks();
+        }
+        if (bits & STATE_TRANSITION_EVENT) {
+            CheckPendingTransition();
+            CheckSpeakingDrained();
         }
     }
 }
 
+// Must not run while a decode job is in flight, see CompleteStateTransition
 void Application::ResetDecoder() {
     std::lock_guard<std::mutex> lock(mutex_);
     opus_decoder_->ResetState();
-    audio_decode_queue_.clear();
     last_output_time_ = std::chrono::steady_clock::now();
 }
 
 void Application::OutputAudio() {
+    MemoryTagScope memory_tag_scope(kMemoryTagAudio);
     auto now = std::chrono::steady_clock::now();
     auto codec = Board::GetInstance().GetAudioCodec();
     const int max_silence_seconds = 10;
 
     std::unique_lock<std::mutex> lock(mutex_);
-    if (audio_decode_queue_.empty()) {
+    FeedLocalSounds();
+    if (jitter_buffer_.empty()) {
         // Disable the output if there is no audio data for a long time
         if (device_state_ == kDeviceStateIdle) {
             auto duration = std::chrono::duration_cast<std::chrono::seconds>(now - last_output_time_).count();
             if (duration > max_silence_seconds) {
                 codec->EnableOutput(false);
             }
+        } else if (device_state_ == kDeviceStateSpeaking && !tts_stop_pending_) {
+            // Everything decoded has gone to the DMA, the speaker plays silence next
+            if (IsDownlinkIdle() && codec->output_queue_empty()) {
+                if (sentence_ended_) {
+                    jitter_buffer_.Pause();
+                } else {
+                    jitter_buffer_.ReportUnderrun();
+                }
+            }
         }
+        lock.unlock();
+        CheckSpeakingDrained();
         return;
     }
 
     if (device_state_ == kDeviceStateListening) {
-        audio_decode_queue_.clear();
+        ResetPlaybackQueue();
+        return;
+    }
+
+    // Keep the packets here until the decoder has been reset for the new state,
+    // or until it catches up, so the decode lane never overflows
+    size_t pending_jobs = PendingDecodeJobs();
+    if (transition_pending_ || pending_jobs >= max_pending_decode_jobs_) {
+        return;
+    }
+    // Decode ahead until the output ring holds the target, counting the jobs in flight
+    if (codec->output_queued_ms() + (int)pending_jobs * opus_frame_duration_ms_ >= CONFIG_AUDIO_OUTPUT_AHEAD_MS) {
         return;
     }
 
+    // After "tts stop" nothing more arrives, the rest plays without waiting for the delay
+    AudioPacket packet;
+    auto result = jitter_buffer_.Get(packet, tts_stop_pending_);
+    if (result == JitterBuffer::kJitterBufferEmpty) {
+        return;
+    }
+    bool lost = result == JitterBuffer::kJitterBufferConcealment;
     last_output_time_ = now;
-    auto opus = std::move(audio_decode_queue_.front());
-    audio_decode_queue_.pop_front();
+    uint32_t generation = playback_generation_;
     lock.unlock();
 
-    background_task_->Schedule([this, codec, opus = std::move(opus)]() mutable {
-        if (aborted_) {
+    ScheduleDecode([this, codec, packet = std::move(packet), lost, generation]() mutable {
+        MemoryTagScope memory_tag_scope(kMemoryTagAudio);
+        if (generation != playback_generation_) {
             return;
         }
 
+        auto& latency = AudioLatency::GetInstance();
+        int64_t decode_start = esp_timer_get_time();
+        if (packet.receive_time_us != 0) {
+            latency.Record(kLatencyDecodeWait, decode_start - packet.receive_time_us);
+        }
+
         std::vector<int16_t> pcm;
-        if (!opus_decoder_->Decode(std::move(opus), pcm)) {
+        TRACE_BEGIN(kTraceDecode, packet.size());
+        if (lost) {
+            // The payload is the packet after the lost one, if it has arrived
+            bool fec = false;
+            if (!opus_decoder_->DecodeLost(packet.data(), packet.size(), pcm, fec)) {
+                TRACE_END(kTraceDecode, 0);
+                return;
+            }
+            (fec ? fec_decoded_frames_ : plc_decoded_frames_)++;
+        } else if (!opus_decoder_->Decode(packet.data(), packet.size(), pcm)) {
+            TRACE_END(kTraceDecode, 0);
             return;
         }
 
@@ -650,60 +942,362 @@ void Application::OutputAudio() {
             output_resampler_.Process(pcm.data(), pcm.size(), resampled.data());
             pcm = std::move(resampled);
         }
-        
-        codec->OutputData(pcm);
+
+        TRACE_END(kTraceDecode, pcm.size());
+        int64_t decoded_time = latency.Stamp(kLatencyDecode, decode_start);
+        // The frame reaches the DMA once the audio queued before it has been written
+        int64_t queued_us = (int64_t)codec->output_queued_ms() * 1000;
+        {
+            // A barge-in during the decode must not find this frame in the output afterwards
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (generation != playback_generation_) {
+                return;
+            }
+            codec->OutputData(pcm);
+        }
+        latency.Record(kLatencyOutputWrite, queued_us);
+        if (packet.receive_time_us != 0) {
+            latency.Record(kLatencyDownlinkTotal, decoded_time + queued_us - packet.receive_time_us);
+        }
+    });
+}
+
+void Application::ScheduleEncode(BackgroundJob job) {
+    // The encoder is reset when the transition completes, frames captured before that are stale
+    if (transition_pending_) {
+        return;
+    }
+#if CONFIG_USE_DEDICATED_AUDIO_WORKERS
+    uplink_worker_->Schedule(std::move(job));
+#else
+    background_task_->Schedule(std::move(job), kBackgroundTaskLaneNormal);
+#endif
+}
+
+// The frames are stamped when the encoder completes them, so the latency is that of the newest sample
+void Application::EncodeAndSend(std::vector<int16_t>&& data, int64_t capture_time_us, int64_t stamp_us, bool silent) {
+    ScheduleEncode([this, data = std::move(data), capture_time_us, stamp_us, silent]() mutable {
+        MemoryTagScope memory_tag_scope(kMemoryTagAudio);
+        TRACE_SCOPE(kTraceEncode, data.size());
+#if CONFIG_USE_UPLINK_VAD_GATE
+        if (silent != uplink_silent_) {
+            // Silence only needs the DTX frames, the controller takes over again with speech
+            uplink_silent_ = silent;
+            opus_encoder_->SetComplexity(silent ? 0 : encoder_controller_.complexity());
+        }
+#endif
+        int64_t encode_start = esp_timer_get_time();
+        bool encoded = false;
+        opus_encoder_->Encode(std::move(data), [this, capture_time_us, stamp_us, &encoded](std::vector<uint8_t>&& opus) {
+            encoded = true;
+            TRACE_INSTANT(kTraceEncodedFrame, opus.size(), 0);
+            int64_t encoded_time = AudioLatency::GetInstance().Stamp(kLatencyEncode, stamp_us);
+            Schedule([this, opus = std::move(opus), capture_time_us, encoded_time]() {
+                auto& latency = AudioLatency::GetInstance();
+                int64_t send_time = latency.Stamp(kLatencySend, encoded_time);
+                latency.Record(kLatencyUplinkTotal, send_time - capture_time_us);
+                TRACE_INSTANT(kTraceSendAudio, opus.size(), 0);
+                protocol_->SendAudio(opus);
+            });
+        });
+
+        if (encoded && !silent) {
+            encoder_controller_.OnFrameEncoded(esp_timer_get_time() - encode_start);
+            if (encoder_controller_.Update(protocol_->GetAudioLinkStats())) {
+                opus_encoder_->SetComplexity(encoder_controller_.complexity());
+                opus_encoder_->SetBitrate(encoder_controller_.bitrate());
+            }
+        }
+    });
+}
+
+#if CONFIG_USE_UPLINK_VAD_GATE
+// Replaces samples dropped by the VAD gate with one comfort noise marker per frame duration
+void Application::SendSilence(size_t samples) {
+    ScheduleEncode([this, samples]() {
+        if (!uplink_silent_) {
+            // The partial frame left in the encoder is the end of the hangover
+            uplink_silent_ = true;
+            uplink_silent_samples_ = 0;
+            opus_encoder_->ResetState();
+        }
+        uplink_silent_samples_ += samples;
+        size_t frame_samples = opus_encoder_->sample_rate() / 1000 * opus_encoder_->duration_ms();
+        while (uplink_silent_samples_ >= frame_samples) {
+            uplink_silent_samples_ -= frame_samples;
+            Schedule([this, marker = opus_encoder_->GetSilencePacket()]() {
+                TRACE_INSTANT(kTraceSendAudio, marker.size(), 0);
+                protocol_->SendAudio(marker);
+            });
+        }
     });
 }
+#endif
+
+void Application::ScheduleDecode(BackgroundJob job) {
+#if CONFIG_USE_DEDICATED_AUDIO_WORKERS
+    downlink_worker_->Schedule(std::move(job));
+#else
+    background_task_->Schedule(std::move(job), kBackgroundTaskLaneRealtime);
+#endif
+}
+
+size_t Application::PendingDecodeJobs() {
+#if CONFIG_USE_DEDICATED_AUDIO_WORKERS
+    return downlink_worker_->QueueDepth();
+#else
+    return background_task_->QueueDepth(kBackgroundTaskLaneRealtime);
+#endif
+}
+
+void Application::WaitForAudioJobs() {
+    background_task_->WaitForCompletion();
+#if CONFIG_USE_DEDICATED_AUDIO_WORKERS
+    uplink_worker_->WaitForCompletion();
+    downlink_worker_->WaitForCompletion();
+#endif
+}
+
+// Only the downlink is cancelled, the queued encode jobs carry the end of the user's speech
+// and are left to drain, the transition completes when they have
+void Application::CancelDecodeJobs() {
+    if (background_task_ == nullptr) {
+        return;
+    }
+#if CONFIG_USE_DEDICATED_AUDIO_WORKERS
+    downlink_worker_->CancelPending();
+#else
+    background_task_->CancelPending(kBackgroundTaskLaneRealtime);
+#endif
+}
+
+// The housekeeping lane of the background task does not hold up a transition
+bool Application::IsAudioIdle() {
+    if (background_task_ == nullptr) {
+        return true;
+    }
+#if CONFIG_USE_DEDICATED_AUDIO_WORKERS
+    return uplink_worker_->IsIdle() && downlink_worker_->IsIdle();
+#else
+    return background_task_->IsLaneIdle(kBackgroundTaskLaneRealtime) &&
+        background_task_->IsLaneIdle(kBackgroundTaskLaneNormal);
+#endif
+}
+
+// Loss and concealment of the audio channel session that just ended
+void Application::PrintDownlinkSessionStats() {
+    JitterBufferStats stats;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats = jitter_buffer_.GetStats();
+    }
+    if (stats.received == 0) {
+        return;
+    }
+    ESP_LOGI(TAG, "Downlink session: received %" PRIu32 " lost %" PRIu32 " late %" PRIu32 " concealed %" PRIu32 " (FEC %" PRIu32 ", PLC %" PRIu32 ") underruns %" PRIu32,
+        stats.received, stats.lost, stats.late, stats.concealed, fec_decoded_frames_.load(),
+        plc_decoded_frames_.load(), stats.underruns);
+}
+
+bool Application::IsDownlinkIdle() {
+#if CONFIG_USE_DEDICATED_AUDIO_WORKERS
+    return downlink_worker_->IsIdle();
+#else
+    return background_task_->IsLaneIdle(kBackgroundTaskLaneRealtime);
+#endif
+}
+
+// True when every queued packet has been decoded and written to the codec
+bool Application::IsPlaybackDrained() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!jitter_buffer_.empty() || !local_sounds_.empty()) {
+            return false;
+        }
+    }
+    // Decode jobs fill the output ring, check it after them
+    return IsDownlinkIdle() && Board::GetInstance().GetAudioCodec()->output_queue_empty();
+}
+
+// Runs on the main loop, completes the pending transition if the audio jobs have drained
+void Application::CheckPendingTransition() {
+    if (!transition_pending_ || !IsAudioIdle()) {
+        return;
+    }
+
+    StateTransition transition;
+    {
+        std::lock_guard<std::mutex> lock(transition_mutex_);
+        if (!transition_pending_) {
+            return;
+        }
+        if (pending_transition_.wait_output_drained && !Board::GetInstance().GetAudioCodec()->output_drained()) {
+            // Woken by the drained callback, the timer only bounds the wait
+            int64_t now = esp_timer_get_time();
+            if (now < pending_transition_.drain_deadline_us) {
+                esp_timer_stop(transition_timer_handle_);
+                esp_timer_start_once(transition_timer_handle_, pending_transition_.drain_deadline_us - now);
+                return;
+            }
+            ESP_LOGW(TAG, "Output not drained after %d ms", OUTPUT_DRAIN_TIMEOUT_MS);
+        }
+        transition = pending_transition_;
+    }
+    CompleteStateTransition(transition);
+}
+
+void Application::CompleteStateTransition(const StateTransition& transition) {
+    {
+        std::lock_guard<std::mutex> lock(transition_mutex_);
+        // Superseded by a newer SetDeviceState
+        if (transition.generation != state_generation_) {
+            return;
+        }
+        transition_pending_ = false;
+    }
+
+    auto codec = Board::GetInstance().GetAudioCodec();
+    switch (transition.state) {
+        case kDeviceStateListening:
+            ResetDecoder();
+            opus_encoder_->ResetState();
+#if CONFIG_USE_UPLINK_VAD_GATE
+            // Each turn starts with the gate open, the AFE output is stopped until StartOutput
+            uplink_gate_.Reset();
+            if (uplink_silent_) {
+                uplink_silent_ = false;
+                opus_encoder_->SetComplexity(encoder_controller_.complexity());
+            }
+#endif
+#if CONFIG_USE_ON_DEVICE_ENDPOINTER
+            // Like the gate, the endpointer is only used by the AFE task after StartOutput
+            endpointer_.Reset();
+            endpoint_time_us_ = 0;
+#endif
+#if CONFIG_USE_SHARED_AUDIO_FRONT_END
+            wake_word_detect_.StartOutput();
+#elif CONFIG_USE_AUDIO_PROCESSOR
+            audio_processor_.Start();
+#endif
+            break;
+        case kDeviceStateSpeaking:
+            ResetDecoder();
+            codec->EnableOutput(true);
+            break;
+        default:
+            break;
+    }
+    ESP_LOGI(TAG, "STATE: %s -> %s completed", STATE_STRINGS[transition.previous_state], STATE_STRINGS[transition.state]);
+}
+
+#if CONFIG_USE_ON_DEVICE_ENDPOINTER
+// Called by the AFE task for every frame while listening
+void Application::DetectEndOfUtterance(const std::vector<int16_t>& data, bool speech) {
+    if (!endpointer_.Process(data.data(), data.size(), speech)) {
+        return;
+    }
+    int64_t time_us = esp_timer_get_time();
+    uint32_t generation = state_generation_.load();
+    Schedule([this, time_us, generation]() {
+        // Only in auto stop mode, and only for the listening turn that produced the audio
+        if (device_state_ != kDeviceStateListening || listening_mode_ != kListeningModeAutoStop ||
+            generation != state_generation_) {
+            return;
+        }
+        endpoint_time_us_ = time_us;
+        endpoint_stt_recorded_ = false;
+#if !CONFIG_ENDPOINTER_SHADOW_MODE
+        protocol_->SendStopListening();
+        SetDeviceState(kDeviceStateIdle);
+#endif
+    });
+}
+
+// The server reports the end of the turn with "stt", then "tts start"
+void Application::RecordEndpointLatency(AudioLatencyStage stage, int64_t received_time_us) {
+    if (endpoint_time_us_ == 0) {
+        return;
+    }
+    int64_t latency_us = received_time_us - endpoint_time_us_;
+    if (stage == kLatencyEndpointStt) {
+        if (endpoint_stt_recorded_) {
+            return;
+        }
+        endpoint_stt_recorded_ = true;
+    } else {
+        endpoint_time_us_ = 0;
+    }
+    AudioLatency::GetInstance().Record(stage, latency_us);
+    ESP_LOGI(TAG, "End of utterance -> %s: %lld ms", AudioLatency::StageName(stage), latency_us / 1000);
+}
+
+#endif
+// Leave the speaking state after "tts stop" once the remaining audio has been played
+void Application::CheckSpeakingDrained() {
+    if (!tts_stop_pending_ || transition_pending_ || !IsPlaybackDrained()) {
+        return;
+    }
+    tts_stop_pending_ = false;
+    if (device_state_ != kDeviceStateSpeaking) {
+        return;
+    }
+    if (keep_listening_) {
+        listening_mode_ = kListeningModeAutoStop;
+        protocol_->SendStartListening(kListeningModeAutoStop);
+        SetDeviceState(kDeviceStateListening);
+    } else {
+        SetDeviceState(kDeviceStateIdle);
+    }
+}
 
 void Application::InputAudio() {
+    MemoryTagScope memory_tag_scope(kMemoryTagAudio);
     auto codec = Board::GetInstance().GetAudioCodec();
-    std::vector<int16_t> data;
-    if (!codec->InputData(data)) {
+    auto& latency = AudioLatency::GetInstance();
+    int64_t read_start = esp_timer_get_time();
+    TRACE_BEGIN(kTraceAudioInput, 0);
+    bool success = codec->InputData(input_buffer_);
+    TRACE_END(kTraceAudioInput, input_buffer_.size());
+    if (!success) {
         return;
     }
+    int64_t capture_time = latency.Stamp(kLatencyInputRead, read_start);
 
+    auto frame = &input_buffer_;
     if (codec->input_sample_rate() != 16000) {
         if (codec->input_channels() == 2) {
-            auto mic_channel = std::vector<int16_t>(data.size() / 2);
-            auto reference_channel = std::vector<int16_t>(data.size() / 2);
-            for (size_t i = 0, j = 0; i < mic_channel.size(); ++i, j += 2) {
-                mic_channel[i] = data[j];
-                reference_channel[i] = data[j + 1];
-            }
-            auto resampled_mic = std::vector<int16_t>(input_resampler_.GetOutputSamples(mic_channel.size()));
-            auto resampled_reference = std::vector<int16_t>(reference_resampler_.GetOutputSamples(reference_channel.size()));
-            input_resampler_.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
-            reference_resampler_.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
-            data.resize(resampled_mic.size() + resampled_reference.size());
-            for (size_t i = 0, j = 0; i < resampled_mic.size(); ++i, j += 2) {
-                data[j] = resampled_mic[i];
-                data[j + 1] = resampled_reference[i];
-            }
+            // Deinterleave in place, the mic channel is compacted into the front of the buffer
+            size_t samples = input_buffer_.size() / 2;
+            PcmDeinterleave(input_buffer_.data(), input_buffer_.data(), input_reference_buffer_.data(), samples);
+            size_t resampled_samples = input_resampled_buffer_.size() / 2;
+            auto resampled_mic = input_resampled_buffer_.data();
+            auto resampled_reference = resampled_mic + resampled_samples;
+            input_resampler_.Process(input_buffer_.data(), samples, resampled_mic);
+            reference_resampler_.Process(input_reference_buffer_.data(), samples, resampled_reference);
+            PcmInterleave(resampled_mic, resampled_reference, input_frame_.data(), resampled_samples);
         } else {
-            auto resampled = std::vector<int16_t>(input_resampler_.GetOutputSamples(data.size()));
-            input_resampler_.Process(data.data(), data.size(), resampled.data());
-            data = std::move(resampled);
+            input_resampler_.Process(input_buffer_.data(), input_buffer_.size(), input_frame_.data());
         }
+        frame = &input_frame_;
     }
+    auto& data = *frame;
+    latency.Stamp(kLatencyInputResample, capture_time);
 
 #if CONFIG_USE_WAKE_WORD_DETECT
-    if (wake_word_detect_.IsDetectionRunning()) {
-        wake_word_detect_.Feed(data);
+    if (wake_word_detect_.IsRunning()) {
+        wake_word_detect_.Feed(data, capture_time);
     }
 #endif
 #if CONFIG_USE_AUDIO_PROCESSOR
+#if !CONFIG_USE_SHARED_AUDIO_FRONT_END
     if (audio_processor_.IsRunning()) {
-        audio_processor_.Input(data);
+        audio_processor_.Input(data, capture_time);
     }
+#endif
 #else
     if (device_state_ == kDeviceStateListening) {
-        background_task_->Schedule([this, data = std::move(data)]() mutable {
-            opus_encoder_->Encode(std::move(data), [this](std::vector<uint8_t>&& opus) {
-                Schedule([this, opus = std::move(opus)]() {
-                    protocol_->SendAudio(opus);
-                });
-            });
-        });
+        // The encode job owns its frame, this copy is the only allocation left on the input path
+        EncodeAndSend(std::vector<int16_t>(data), capture_time, capture_time);
     }
 #endif
 }
@@ -711,9 +1305,28 @@ void Application::InputAudio() {
 void Application::AbortSpeaking(AbortReason reason) {
     ESP_LOGI(TAG, "Abort speaking");
     aborted_ = true;
+    FlushPlayback();
     protocol_->SendAbortSpeaking(reason);
 }
 
+// Barge-in: the speech is dropped wherever it is, the buffered packets, the queued decode
+// jobs, the decoded audio and the DMA buffers. Packets still in flight are dropped on arrival
+// until the next "tts start".
+void Application::FlushPlayback() {
+    auto codec = Board::GetInstance().GetAudioCodec();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        playback_generation_++;
+        ResetPlaybackQueue();
+        codec->FlushOutput();
+    }
+    CancelDecodeJobs();
+    // Queued behind the job that may still be running, the next speech starts from a clean state
+    ScheduleDecode([this]() {
+        opus_decoder_->ResetState();
+    });
+}
+
 void Application::SetDeviceState(DeviceState state) {
     if (device_state_ == state) {
         return;
@@ -722,12 +1335,15 @@ void Application::SetDeviceState(DeviceState state) {
     clock_ticks_ = 0;
     auto previous_state = device_state_;
     device_state_ = state;
+    tts_stop_pending_ = false;
     ESP_LOGI(TAG, "STATE: %s", STATE_STRINGS[device_state_]);
-    // The state is changed, wait for all background tasks to finish
-    background_task_->WaitForCompletion();
+    TRACE_INSTANT(kTraceStateChange, previous_state, state);
+    // The queued playback belongs to the previous state, the running job finishes on its own
+    // and the audio part of the transition completes in CheckPendingTransition, once the
+    // uplink has sent what was captured before the change
+    CancelDecodeJobs();
 
     auto& board = Board::GetInstance();
-    auto codec = board.GetAudioCodec();
     auto display = board.GetDisplay();
     auto led = board.GetLed();
     led->OnStateChanged();
@@ -736,7 +1352,9 @@ void Application::SetDeviceState(DeviceState state) {
         case kDeviceStateIdle:
             display->SetStatus(Lang::Strings::STANDBY);
             display->SetEmotion("neutral");
-#if CONFIG_USE_AUDIO_PROCESSOR
+#if CONFIG_USE_SHARED_AUDIO_FRONT_END
+            wake_word_detect_.StopOutput();
+#elif CONFIG_USE_AUDIO_PROCESSOR
             audio_processor_.Stop();
 #endif
             break;
@@ -748,22 +1366,22 @@ void Application::SetDeviceState(DeviceState state) {
         case kDeviceStateListening:
             display->SetStatus(Lang::Strings::LISTENING);
             display->SetEmotion("neutral");
-            ResetDecoder();
-            opus_encoder_->ResetState();
-#if CONFIG_USE_AUDIO_PROCESSOR
-            audio_processor_.Start();
-#endif
-            UpdateIotStates();
-            if (previous_state == kDeviceStateSpeaking) {
-                // FIXME: Wait for the speaker to empty the buffer
-                vTaskDelay(pdMS_TO_TICKS(120));
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ResetPlaybackQueue();
             }
+            board.GetAudioCodec()->ClearOutput();
+            UpdateIotStates();
             break;
         case kDeviceStateSpeaking:
             display->SetStatus(Lang::Strings::SPEAKING);
-            ResetDecoder();
-            codec->EnableOutput(true);
-#if CONFIG_USE_AUDIO_PROCESSOR
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ResetPlaybackQueue();
+            }
+#if CONFIG_USE_SHARED_AUDIO_FRONT_END
+            wake_word_detect_.StopOutput();
+#elif CONFIG_USE_AUDIO_PROCESSOR
             audio_processor_.Stop();
 #endif
             break;
@@ -771,24 +1389,76 @@ void Application::SetDeviceState(DeviceState state) {
             // Do nothing
             break;
     }
+
+    {
+        std::lock_guard<std::mutex> lock(transition_mutex_);
+        pending_transition_.generation = ++state_generation_;
+        pending_transition_.previous_state = previous_state;
+        pending_transition_.state = state;
+        // Do not open the microphone while the speaker is still playing the tail, nor later
+        // than the last sample, the first words would be lost
+        pending_transition_.wait_output_drained = state == kDeviceStateListening && previous_state == kDeviceStateSpeaking;
+        pending_transition_.drain_deadline_us = esp_timer_get_time() + OUTPUT_DRAIN_TIMEOUT_MS * 1000;
+        transition_pending_ = true;
+    }
+    xEventGroupSetBits(event_group_, STATE_TRANSITION_EVENT);
 }
 
+// Opus decodes any stream at these rates, whatever rate it was encoded at
+static bool IsOpusDecodeRate(int sample_rate) {
+    return sample_rate == 8000 || sample_rate == 12000 || sample_rate == 16000 ||
+        sample_rate == 24000 || sample_rate == 48000;
+}
+
+// sample_rate is the rate of the stream. It only matters when the codec runs at a rate Opus
+// cannot decode to, e.g. 44.1 kHz, then the stream is decoded at its own rate and resampled.
 void Application::SetDecodeSampleRate(int sample_rate) {
-    if (opus_decode_sample_rate_ == sample_rate) {
+    auto codec = Board::GetInstance().GetAudioCodec();
+    int decode_sample_rate = IsOpusDecodeRate(codec->output_sample_rate()) ? codec->output_sample_rate() : sample_rate;
+    if (opus_decode_sample_rate_ == decode_sample_rate) {
         return;
     }
 
-    opus_decode_sample_rate_ = sample_rate;
-    opus_decoder_.reset();
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(opus_decode_sample_rate_, 1);
+    opus_decode_sample_rate_ = decode_sample_rate;
+    {
+        MemoryExternalScope memory_scope(kMemoryTagAudio);
+        opus_decoder_.reset();
+        opus_decoder_ = std::make_unique<OpusDownlinkDecoder>(opus_decode_sample_rate_, 1);
+    }
 
-    auto codec = Board::GetInstance().GetAudioCodec();
     if (opus_decode_sample_rate_ != codec->output_sample_rate()) {
         ESP_LOGI(TAG, "Resampling audio from %d to %d", opus_decode_sample_rate_, codec->output_sample_rate());
         output_resampler_.Configure(opus_decode_sample_rate_, codec->output_sample_rate());
     }
 }
 
+// Called when the audio channel opens, the encoder is idle until the listening state starts
+void Application::SetEncodeFrameDuration(int duration_ms) {
+    if (opus_frame_duration_ms_ == duration_ms) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "Opus frame duration changed from %d to %d ms", opus_frame_duration_ms_, duration_ms);
+    opus_frame_duration_ms_ = duration_ms;
+    {
+        // libopus allocates with malloc, only the heap snapshot sees it
+        MemoryExternalScope memory_scope(kMemoryTagAudio);
+        opus_encoder_.reset();
+        opus_encoder_ = std::make_unique<OpusUplinkEncoder>(16000, 1, opus_frame_duration_ms_);
+        opus_encoder_->SetComplexity(encoder_controller_.complexity());
+        opus_encoder_->SetBitrate(encoder_controller_.bitrate());
+    }
+    encoder_controller_.SetFrameDuration(opus_frame_duration_ms_);
+
+#if CONFIG_USE_WAKE_WORD_DETECT
+    wake_word_detect_.SetWakeWordFrameDuration(opus_frame_duration_ms_);
+#endif
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_pending_decode_jobs_ = std::max(1, MAX_PENDING_DECODE_MS / opus_frame_duration_ms_);
+    jitter_buffer_.SetFrameDuration(opus_frame_duration_ms_);
+}
+
 void Application::UpdateIotStates() {
     auto& thing_manager = iot::ThingManager::GetInstance();
     std::string states;
@@ -5,29 +5,53 @@
 #include <freertos/event_groups.h>
 #include <freertos/task.h>
 #include <esp_timer.h>
+#include <esp_attr.h>
 
 #include <string>
 #include <mutex>
 #include <list>
+#include <deque>
+#include <atomic>
 
-#include <opus_encoder.h>
-#include <opus_decoder.h>
+#if CONFIG_AUDIO_RESAMPLER_POLYPHASE_LOW || CONFIG_AUDIO_RESAMPLER_POLYPHASE_HIGH
+#include "polyphase_resampler.h"
+using AudioResampler = PolyphaseResampler;
+#else
 #include <opus_resampler.h>
+using AudioResampler = OpusResampler;
+#endif
 
 #include "protocol.h"
 #include "ota.h"
 #include "background_task.h"
+#include "task_queue.h"
+#include "audio_latency.h"
+#include "jitter_buffer.h"
+#include "opus_uplink_encoder.h"
+#include "opus_downlink_decoder.h"
+#include "opus_encoder_controller.h"
+#include "trace.h"
+#if CONFIG_USE_DEDICATED_AUDIO_WORKERS
+#include "audio_worker.h"
+#endif
 
 #if CONFIG_USE_WAKE_WORD_DETECT
 #include "wake_word_detect.h"
 #endif
-#if CONFIG_USE_AUDIO_PROCESSOR
+#if CONFIG_USE_AUDIO_PROCESSOR && !CONFIG_USE_SHARED_AUDIO_FRONT_END
 #include "audio_processor.h"
 #endif
+#if CONFIG_USE_UPLINK_VAD_GATE
+#include "uplink_vad_gate.h"
+#endif
+#if CONFIG_USE_ON_DEVICE_ENDPOINTER
+#include "endpointer.h"
+#endif
 
 #define SCHEDULE_EVENT (1 << 0)
 #define AUDIO_INPUT_READY_EVENT (1 << 1)
 #define AUDIO_OUTPUT_READY_EVENT (1 << 2)
+#define STATE_TRANSITION_EVENT (1 << 3)
 
 enum DeviceState {
     kDeviceStateUnknown,
@@ -42,7 +66,27 @@ enum DeviceState {
     kDeviceStateFatalError
 };
 
-#define OPUS_FRAME_DURATION_MS 60
+// Captures up to 32 bytes (e.g. this + std::string) are stored without heap allocation
+#define MAIN_TASK_INLINE_SIZE 32
+#define MAIN_TASK_QUEUE_SIZE 32
+
+// Audio allowed in the decode lane before OutputAudio stops pulling packets, in frames of
+// the negotiated duration but at least one (two 60 ms frames)
+#define MAX_PENDING_DECODE_MS 120
+
+// The uplink runs opus_encode, which needed the whole 32 KB stack of the background task
+// before, decoding needs less. Check the "stack used" of the worker stats before changing
+// them, both are taken from PSRAM when CONFIG_SPIRAM_ALLOW_STACK_EXTERNAL_MEMORY is set.
+#define AUDIO_UPLINK_WORKER_STACK_SIZE (4096 * 8)
+#define AUDIO_DOWNLINK_WORKER_STACK_SIZE (4096 * 6)
+
+// Upper bound on the wait for the speaker to play out before the microphone is opened again
+#define OUTPUT_DRAIN_TIMEOUT_MS 500
+
+// Packets of a local sound moved to the jitter buffer at a time, the rest stays in flash
+#define LOCAL_SOUND_PREFETCH_PACKETS 2
+
+using MainTask = InlineTask<MAIN_TASK_INLINE_SIZE>;
 
 class Application {
 public:
@@ -57,7 +101,7 @@ public:
     void Start();
     DeviceState GetDeviceState() const { return device_state_; }
     bool IsVoiceDetected() const { return voice_detected_; }
-    void Schedule(std::function<void()> callback);
+    void Schedule(MainTask callback);
     void SetDeviceState(DeviceState state);
     void Alert(const char* status, const char* message, const char* emotion = "", const std::string_view& sound = "");
     void DismissAlert();
@@ -75,42 +119,131 @@ private:
     Application();
     ~Application();
 
+    IRAM_ATTR static bool OnAudioInputReady(void* context);
+    IRAM_ATTR static bool OnAudioOutputReady(void* context);
+    IRAM_ATTR static bool OnAudioOutputDrained(void* context);
+
 #if CONFIG_USE_WAKE_WORD_DETECT
     WakeWordDetect wake_word_detect_;
 #endif
-#if CONFIG_USE_AUDIO_PROCESSOR
+#if CONFIG_USE_AUDIO_PROCESSOR && !CONFIG_USE_SHARED_AUDIO_FRONT_END
     AudioProcessor audio_processor_;
 #endif
     Ota ota_;
     std::mutex mutex_;
-    std::list<std::function<void()>> main_tasks_;
+    MpscQueue<MainTask, MAIN_TASK_QUEUE_SIZE> main_tasks_;
+    // Tasks that did not fit in the ring, rarely used, and the tasks scheduled while it is in use
+    std::mutex overflow_mutex_;
+    std::list<MainTask> overflow_tasks_;
+    // Tasks in overflow_tasks_ plus the producer pushing to the ring, see Schedule
+    std::atomic<size_t> overflow_pending_{0};
+    std::atomic<uint32_t> schedule_overflows_{0};
+    std::atomic<uint32_t> schedule_heap_fallbacks_{0};
     std::unique_ptr<Protocol> protocol_;
     EventGroupHandle_t event_group_ = nullptr;
     esp_timer_handle_t clock_timer_handle_ = nullptr;
     volatile DeviceState device_state_ = kDeviceStateUnknown;
     bool keep_listening_ = false;
-    bool aborted_ = false;
+    ListeningMode listening_mode_ = kListeningModeAutoStop;
+    // Set by AbortSpeaking, the downlink audio is dropped until the next "tts start"
+    std::atomic<bool> aborted_{false};
     bool voice_detected_ = false;
     int clock_ticks_ = 0;
 
+    // State changes return immediately, the audio part completes on the main loop once
+    // the encode / decode jobs of the previous state are gone
+    struct StateTransition {
+        uint32_t generation = 0;
+        DeviceState previous_state = kDeviceStateUnknown;
+        DeviceState state = kDeviceStateUnknown;
+        bool wait_output_drained = false;
+        int64_t drain_deadline_us = 0;
+    };
+    std::mutex transition_mutex_;
+    StateTransition pending_transition_;
+    std::atomic<uint32_t> state_generation_{0};
+    // Bumped by a barge-in under mutex_, decode jobs of an older generation are dropped
+    std::atomic<uint32_t> playback_generation_{0};
+    std::atomic<bool> transition_pending_{false};
+    // Set by "tts stop", the state changes when the remaining audio has been played
+    std::atomic<bool> tts_stop_pending_{false};
+    // Between "sentence_end" and the next "sentence_start" the downlink pauses on purpose,
+    // an empty jitter buffer is not an underrun then. Main task only.
+    bool sentence_ended_ = false;
+    esp_timer_handle_t transition_timer_handle_ = nullptr;
+
     // Audio encode / decode
     BackgroundTask* background_task_ = nullptr;
+#if CONFIG_USE_DEDICATED_AUDIO_WORKERS
+    AudioWorker* uplink_worker_ = nullptr;
+    AudioWorker* downlink_worker_ = nullptr;
+#endif
     std::chrono::steady_clock::time_point last_output_time_;
-    std::list<std::vector<uint8_t>> audio_decode_queue_;
-
-    std::unique_ptr<OpusEncoderWrapper> opus_encoder_;
-    std::unique_ptr<OpusDecoderWrapper> opus_decoder_;
+    JitterBuffer jitter_buffer_;
+    // P3 sounds still to be played, the unplayed part of each, guarded by mutex_
+    std::deque<std::string_view> local_sounds_;
+
+    std::unique_ptr<OpusUplinkEncoder> opus_encoder_;
+    OpusEncoderController encoder_controller_;
+#if CONFIG_USE_UPLINK_VAD_GATE
+    UplinkVadGate uplink_gate_;
+    // Owned by the encode jobs
+    bool uplink_silent_ = false;
+    size_t uplink_silent_samples_ = 0;
+#endif
+#if CONFIG_USE_ON_DEVICE_ENDPOINTER
+    Endpointer endpointer_;
+    // When the end of utterance was detected, 0 once the server has answered, main task only
+    int64_t endpoint_time_us_ = 0;
+    bool endpoint_stt_recorded_ = false;
+#endif
+    std::unique_ptr<OpusDownlinkDecoder> opus_decoder_;
+    // Lost downlink packets of the current session, filled in by the decode jobs
+    std::atomic<uint32_t> fec_decoded_frames_{0};
+    std::atomic<uint32_t> plc_decoded_frames_{0};
 
     int opus_decode_sample_rate_ = -1;
-    OpusResampler input_resampler_;
-    OpusResampler reference_resampler_;
-    OpusResampler output_resampler_;
+    int opus_frame_duration_ms_ = CONFIG_OPUS_FRAME_DURATION_MS;
+    size_t max_pending_decode_jobs_ = 1;
+    AudioResampler input_resampler_;
+    AudioResampler reference_resampler_;
+    // Reused by InputAudio for every frame so the input path does not allocate, sized in Start
+    std::vector<int16_t> input_buffer_;
+    std::vector<int16_t> input_reference_buffer_;
+    std::vector<int16_t> input_resampled_buffer_;
+    std::vector<int16_t> input_frame_;
+    AudioResampler output_resampler_;
 
     void MainLoop();
+    void RunScheduledTasks();
     void InputAudio();
     void OutputAudio();
+    void ScheduleEncode(BackgroundJob job);
+    void EncodeAndSend(std::vector<int16_t>&& data, int64_t capture_time_us, int64_t stamp_us, bool silent = false);
+#if CONFIG_USE_UPLINK_VAD_GATE
+    void SendSilence(size_t samples);
+#endif
+#if CONFIG_USE_ON_DEVICE_ENDPOINTER
+    void DetectEndOfUtterance(const std::vector<int16_t>& data, bool speech);
+    void RecordEndpointLatency(AudioLatencyStage stage, int64_t received_time_us);
+#endif
+    void ScheduleDecode(BackgroundJob job);
+    size_t PendingDecodeJobs();
+    void WaitForAudioJobs();
+    void CancelDecodeJobs();
+    bool IsAudioIdle();
+    void PrintDownlinkSessionStats();
+    bool IsDownlinkIdle();
+    bool IsPlaybackDrained();
+    void FeedLocalSounds();
+    void ResetPlaybackQueue();
+    void CheckPendingTransition();
+    void CompleteStateTransition(const StateTransition& transition);
+    void CheckSpeakingDrained();
     void ResetDecoder();
+    void FlushPlayback();
     void SetDecodeSampleRate(int sample_rate);
+    void SetEncodeFrameDuration(int duration_ms);
     void CheckNewVersion();
     void ShowActivationCode();
     void OnClockTimer();
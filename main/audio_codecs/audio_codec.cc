@@ -1,36 +1,268 @@
 #include "audio_codec.h"
 #include "board.h"
 #include "settings.h"
+#include "trace.h"
+#include "audio_latency.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <cstring>
 #include <driver/i2s_common.h>
+#include <cinttypes>
 
 #define TAG "AudioCodec"
 
 AudioCodec::AudioCodec() {
+    output_event_group_ = xEventGroupCreate();
+    xEventGroupSetBits(output_event_group_, AUDIO_CODEC_OUTPUT_DRAINED_EVENT);
 }
 
 AudioCodec::~AudioCodec() {
+    if (output_task_ != nullptr) {
+        vTaskDelete(output_task_);
+    }
+    vEventGroupDelete(output_event_group_);
+}
+
+void AudioCodec::OnInputReady(bool (*callback)(void* context), void* context) {
+    on_input_ready_ = { callback, context };
 }
 
-void AudioCodec::OnInputReady(std::function<bool()> callback) {
-    on_input_ready_ = callback;
+void AudioCodec::OnOutputReady(bool (*callback)(void* context), void* context) {
+    on_output_ready_ = { callback, context };
 }
 
-void AudioCodec::OnOutputReady(std::function<bool()> callback) {
-    on_output_ready_ = callback;
+void AudioCodec::OnOutputDrained(bool (*callback)(void* context), void* context) {
+    on_output_drained_ = { callback, context };
 }
 
 void AudioCodec::OutputData(std::vector<int16_t>& data) {
-    Write(data.data(), data.size());
+    if (output_task_ == nullptr) {
+        SetOutputWriting(true);
+        WriteOutput(data.data(), data.size());
+        SetOutputWriting(false);
+        return;
+    }
+    size_t queued = output_ring_.Write(data.data(), data.size());
+    if (queued < data.size()) {
+        output_dropped_samples_ += data.size() - queued;
+        ESP_LOGW(TAG, "Output ring full, dropped %u samples (%" PRIu32 " in total)", data.size() - queued, output_dropped_samples_);
+    }
+    // After the ring write: on_sent reads the ring under the same lock, so it either saw the
+    // ring empty before this and is overruled here, or sees the samples
+    portENTER_CRITICAL(&output_lock_);
+    output_drained_ = false;
+    portEXIT_CRITICAL(&output_lock_);
+    xTaskNotifyGive(output_task_);
 }
 
-bool AudioCodec::InputData(std::vector<int16_t>& data) {
-    int duration = 30;
-    int input_frame_size = input_sample_rate_ / 1000 * duration * input_channels_;
+bool AudioCodec::output_drained() {
+    portENTER_CRITICAL(&output_lock_);
+    bool drained = output_drained_;
+    portEXIT_CRITICAL(&output_lock_);
+    return drained;
+}
+
+// The event only wakes the waiter, the ISR sets it through the timer task and it may arrive
+// after new output, the flag decides
+bool AudioCodec::WaitForOutputDrained(int timeout_ms) {
+    TickType_t start = xTaskGetTickCount();
+    TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+    while (!output_drained()) {
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= timeout) {
+            return false;
+        }
+        xEventGroupWaitBits(output_event_group_, AUDIO_CODEC_OUTPUT_DRAINED_EVENT, pdTRUE, pdTRUE, timeout - elapsed);
+    }
+    return true;
+}
+
+// Counts the frames before writing them, on_sent may report them sent before Write returns
+void AudioCodec::WriteOutput(const int16_t* data, int samples) {
+    portENTER_CRITICAL(&output_lock_);
+    output_written_frames_ += samples / output_channels_;
+    output_drained_ = false;
+    portEXIT_CRITICAL(&output_lock_);
+    TRACE_SCOPE(kTraceOutputWrite, samples);
+    Write(data, samples);
+}
+
+void AudioCodec::SetOutputWriting(bool writing) {
+    portENTER_CRITICAL(&output_lock_);
+    output_writing_ = writing;
+    portEXIT_CRITICAL(&output_lock_);
+}
+
+void AudioCodec::DiscardOutputFrames() {
+    portENTER_CRITICAL(&output_lock_);
+    output_sent_frames_ = output_written_frames_;
+    output_played_frames_ = output_written_frames_;
+    output_drained_ = true;
+    portEXIT_CRITICAL(&output_lock_);
+    xEventGroupSetBits(output_event_group_, AUDIO_CODEC_OUTPUT_DRAINED_EVENT);
+    if (on_output_drained_.function != nullptr) {
+        on_output_drained_.function(on_output_drained_.context);
+    }
+}
 
-    data.resize(input_frame_size);
+// Called for every DMA buffer sent, returns true when the output has just drained
+IRAM_ATTR bool AudioCodec::UpdateOutputPlayed(int frames) {
+    bool drained = false;
+    portENTER_CRITICAL_SAFE(&output_lock_);
+    // Read under the lock, an OutputData in between would otherwise be overwritten below
+    bool ring_empty = output_ring_.size() == 0;
+    output_played_frames_ = output_sent_frames_;
+    uint32_t pending = output_written_frames_ - output_sent_frames_;
+    output_sent_frames_ += pending < (uint32_t)frames ? pending : (uint32_t)frames;
+    if (!output_drained_ && !output_writing_ && ring_empty && output_played_frames_ == output_written_frames_) {
+        output_drained_ = true;
+        drained = true;
+    }
+    portEXIT_CRITICAL_SAFE(&output_lock_);
+    return drained;
+}
+
+void AudioCodec::ClearOutput() {
+    output_ring_.Clear();
+}
+
+void AudioCodec::FlushOutput() {
+    if (output_task_ == nullptr) {
+        return;
+    }
+    flush_request_us_ = esp_timer_get_time();
+    xTaskNotifyGive(output_task_);
+}
+
+void AudioCodec::ClearOutputBuffers() {
+    if (tx_handle_ == nullptr) {
+        return;
+    }
+    // Zero is silence in every sample format, preload it until the DMA buffers are full
+    static const uint8_t zeros[256] = {};
+    ESP_ERROR_CHECK_WITHOUT_ABORT(i2s_channel_disable(tx_handle_));
+    size_t loaded;
+    do {
+        loaded = 0;
+        if (i2s_channel_preload_data(tx_handle_, zeros, sizeof(zeros), &loaded) != ESP_OK) {
+            break;
+        }
+    } while (loaded == sizeof(zeros));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(i2s_channel_enable(tx_handle_));
+}
+
+void AudioCodec::StartOutputTask() {
+    if (output_task_ != nullptr) {
+        return;
+    }
+    size_t capacity = (size_t)output_sample_rate_ * (CONFIG_AUDIO_OUTPUT_AHEAD_MS + AUDIO_CODEC_OUTPUT_MAX_PACKET_MS) / 1000;
+    if (!output_ring_.Configure(capacity)) {
+        ESP_LOGE(TAG, "Failed to allocate the output ring, writing directly");
+        return;
+    }
+    // Above the decode workers, a late refill is an audible gap
+    xTaskCreate([](void* arg) {
+        auto codec = (AudioCodec*)arg;
+        codec->OutputTask();
+    }, "audio_output", AUDIO_CODEC_OUTPUT_TASK_STACK_SIZE, this, 4, &output_task_);
+}
+
+void AudioCodec::NotifyOutputSent(int frames) {
+    if (UpdateOutputPlayed(frames)) {
+        xEventGroupSetBits(output_event_group_, AUDIO_CODEC_OUTPUT_DRAINED_EVENT);
+        if (on_output_drained_.function != nullptr) {
+            on_output_drained_.function(on_output_drained_.context);
+        }
+    }
+    if (output_task_ != nullptr && output_enabled_) {
+        xTaskNotifyGive(output_task_);
+    }
+}
+
+// Runs on the output task, so nothing is written to the DMA while it is cleared
+void AudioCodec::CompleteFlush(int64_t request_us, std::vector<int16_t>& chunk) {
+#if CONFIG_BARGE_IN_FADE_OUT
+    // The fade continues the audio already in the DMA buffers, the speaker stops without a click
+    std::vector<int16_t> fade(output_sample_rate_ / 1000 * CONFIG_BARGE_IN_FADE_MS);
+    size_t samples = output_ring_.Read(fade.data(), fade.size());
+    for (size_t i = 0; i < samples; i++) {
+        fade[i] = (int32_t)fade[i] * (int32_t)(samples - i) / (int32_t)samples;
+    }
+    output_ring_.Clear();
+    output_ring_.Read(chunk.data(), 0);
+    if (!output_enabled_) {
+        return;
+    }
+    if (samples > 0) {
+        WriteOutput(fade.data(), samples);
+    }
+    // Silent once the fade has played. The output task must not wait for that, new output
+    // may already be queued behind the fade, CheckFadeOut records the latency later.
+    portENTER_CRITICAL(&output_lock_);
+    fade_end_frames_ = output_written_frames_;
+    portEXIT_CRITICAL(&output_lock_);
+    fade_request_us_ = request_us;
+    CheckFadeOut();
+#else
+    output_ring_.Clear();
+    output_ring_.Read(chunk.data(), 0);
+    if (!output_enabled_) {
+        return;
+    }
+    ClearOutputBuffers();
+    DiscardOutputFrames();
+    RecordFlushLatency(request_us);
+#endif
+}
+
+void AudioCodec::RecordFlushLatency(int64_t request_us) {
+    int64_t latency_us = esp_timer_get_time() - request_us;
+    AudioLatency::GetInstance().Record(kLatencyAbortSilence, latency_us);
+    ESP_LOGI(TAG, "Output flushed, silent %lld us after the request", latency_us);
+}
+
+// Called by the output task on every wake, which follows every DMA buffer sent
+void AudioCodec::CheckFadeOut() {
+    if (fade_request_us_ == 0) {
+        return;
+    }
+    portENTER_CRITICAL(&output_lock_);
+    bool played = (int32_t)(output_played_frames_ - fade_end_frames_) >= 0;
+    portEXIT_CRITICAL(&output_lock_);
+    if (played) {
+        RecordFlushLatency(fade_request_us_);
+        fade_request_us_ = 0;
+    }
+}
+
+// The only task that blocks on the codec output. Woken by new samples and by every DMA
+// buffer sent, it writes the ring out in DMA buffer sized chunks, so Write only waits when
+// the DMA is full and the decoded audio stays ahead of it.
+void AudioCodec::OutputTask() {
+    std::vector<int16_t> chunk(output_sample_rate_ / 1000 * AUDIO_CODEC_OUTPUT_CHUNK_MS);
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        CheckFadeOut();
+        int64_t request_us = flush_request_us_.exchange(0);
+        if (request_us != 0) {
+            CompleteFlush(request_us, chunk);
+        }
+        SetOutputWriting(true);
+        size_t samples;
+        while (flush_request_us_ == 0 && (samples = output_ring_.Read(chunk.data(), chunk.size())) > 0) {
+            if (!output_enabled_) {
+                continue;
+            }
+            WriteOutput(chunk.data(), samples);
+        }
+        SetOutputWriting(false);
+    }
+}
+
+// Keeps the capacity of data, callers that reuse the vector do not allocate
+bool AudioCodec::InputData(std::vector<int16_t>& data) {
+    data.resize(input_frame_samples());
     int samples = Read(data.data(), data.size());
     if (samples > 0) {
         return true;
@@ -40,16 +272,35 @@ bool AudioCodec::InputData(std::vector<int16_t>& data) {
 
 IRAM_ATTR bool AudioCodec::on_sent(i2s_chan_handle_t handle, i2s_event_data_t *event, void *user_ctx) {
     auto audio_codec = (AudioCodec*)user_ctx;
-    if (audio_codec->output_enabled_ && audio_codec->on_output_ready_) {
-        return audio_codec->on_output_ready_();
+    TRACE_ISR(kTraceAudioOutputIsr, 0, 0);
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    if (audio_codec->UpdateOutputPlayed(AUDIO_CODEC_DMA_FRAME_NUM)) {
+        xEventGroupSetBitsFromISR(audio_codec->output_event_group_, AUDIO_CODEC_OUTPUT_DRAINED_EVENT,
+            &higher_priority_task_woken);
+        auto& drained = audio_codec->on_output_drained_;
+        if (drained.function != nullptr && drained.function(drained.context)) {
+            higher_priority_task_woken = pdTRUE;
+        }
     }
-    return false;
+    if (!audio_codec->output_enabled_) {
+        return higher_priority_task_woken == pdTRUE;
+    }
+    if (audio_codec->output_task_ != nullptr) {
+        vTaskNotifyGiveFromISR(audio_codec->output_task_, &higher_priority_task_woken);
+    }
+    auto& ready = audio_codec->on_output_ready_;
+    if (ready.function != nullptr && ready.function(ready.context)) {
+        return true;
+    }
+    return higher_priority_task_woken == pdTRUE;
 }
 
 IRAM_ATTR bool AudioCodec::on_recv(i2s_chan_handle_t handle, i2s_event_data_t *event, void *user_ctx) {
     auto audio_codec = (AudioCodec*)user_ctx;
-    if (audio_codec->input_enabled_ && audio_codec->on_input_ready_) {
-        return audio_codec->on_input_ready_();
+    TRACE_ISR(kTraceAudioInputIsr, 0, 0);
+    auto& ready = audio_codec->on_input_ready_;
+    if (audio_codec->input_enabled_ && ready.function != nullptr) {
+        return ready.function(ready.context);
     }
     return false;
 }
@@ -70,6 +321,7 @@ void AudioCodec::Start() {
     ESP_ERROR_CHECK(i2s_channel_enable(tx_handle_));
     ESP_ERROR_CHECK(i2s_channel_enable(rx_handle_));
 
+    StartOutputTask();
     EnableInput(true);
     EnableOutput(true);
 }
@@ -95,5 +347,9 @@ void AudioCodec::EnableOutput(bool enable) {
         return;
     }
     output_enabled_ = enable;
+    if (!enable) {
+        output_ring_.Clear();
+        DiscardOutputFrames();
+    }
     ESP_LOGI(TAG, "Set output enable to %s", enable ? "true" : "false");
 }
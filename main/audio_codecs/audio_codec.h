@@ -3,13 +3,35 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <freertos/task.h>
 #include <driver/i2s_std.h>
+#include <esp_attr.h>
 
 #include <vector>
 #include <string>
-#include <functional>
+#include <atomic>
 
 #include "board.h"
+#include "pcm_ring_buffer.h"
+
+#define AUDIO_CODEC_INPUT_FRAME_DURATION_MS 30
+// I2S DMA geometry shared by the codecs, every on_sent event is one buffer of frames
+#define AUDIO_CODEC_DMA_DESC_NUM 6
+#define AUDIO_CODEC_DMA_FRAME_NUM 240
+// Audio handed to Write per wake of the output task, one DMA buffer of the boards
+#define AUDIO_CODEC_OUTPUT_CHUNK_MS 10
+// Room in the output ring beyond the decode-ahead target, the longest Opus packet
+#define AUDIO_CODEC_OUTPUT_MAX_PACKET_MS 120
+#define AUDIO_CODEC_OUTPUT_TASK_STACK_SIZE 4096
+// Set in the output event group when everything written has been played
+#define AUDIO_CODEC_OUTPUT_DRAINED_EVENT (1 << 0)
+
+// Called from the I2S ISRs, a flash write may be running meanwhile, so the function must be
+// IRAM_ATTR and call nothing outside IRAM. Returns true when it woke a higher priority task.
+struct AudioCodecCallback {
+    bool (*function)(void* context) = nullptr;
+    void* context = nullptr;
+};
 
 class AudioCodec {
 public:
@@ -20,11 +42,24 @@ public:
     virtual void EnableInput(bool enable);
     virtual void EnableOutput(bool enable);
 
-    void Start();
+    virtual void Start();
+    // Queues the samples in the output ring and returns, the output task writes them to
+    // the codec as the DMA buffers are sent. Samples that do not fit are dropped.
     void OutputData(std::vector<int16_t>& data);
+    // Drops the queued output, the DMA buffers already written still play
+    void ClearOutput();
+    // Barge-in: drops the queued output, then clears the DMA buffers or lets them play out
+    // followed by a short fade (CONFIG_BARGE_IN_STOP). Returns at once, the output task does
+    // the work and records the abort_silence latency.
+    void FlushOutput();
+    // True once the last sample handed to OutputData has left the DMA, within one DMA buffer
+    bool output_drained();
+    bool WaitForOutputDrained(int timeout_ms);
     bool InputData(std::vector<int16_t>& data);
-    void OnOutputReady(std::function<bool()> callback);
-    void OnInputReady(std::function<bool()> callback);
+    void OnOutputReady(bool (*callback)(void* context), void* context);
+    void OnInputReady(bool (*callback)(void* context), void* context);
+    // Called when the output becomes drained, from the on_sent ISR or the output task
+    void OnOutputDrained(bool (*callback)(void* context), void* context);
 
     inline bool duplex() const { return duplex_; }
     inline bool input_reference() const { return input_reference_; }
@@ -33,15 +68,54 @@ public:
     inline int input_channels() const { return input_channels_; }
     inline int output_channels() const { return output_channels_; }
     inline int output_volume() const { return output_volume_; }
+    // Decoded audio waiting in the output ring, not counting the DMA buffers
+    inline int output_queued_ms() const { return output_ring_.size() * 1000 / output_sample_rate_; }
+    inline bool output_queue_empty() const { return output_ring_.size() == 0; }
+    // Interleaved samples returned by one InputData call
+    inline int input_frame_samples() const { return input_sample_rate_ / 1000 * AUDIO_CODEC_INPUT_FRAME_DURATION_MS * input_channels_; }
 
 private:
-    std::function<bool()> on_input_ready_;
-    std::function<bool()> on_output_ready_;
-    
     IRAM_ATTR static bool on_recv(i2s_chan_handle_t handle, i2s_event_data_t *event, void *user_ctx);
     IRAM_ATTR static bool on_sent(i2s_chan_handle_t handle, i2s_event_data_t *event, void *user_ctx);
 
+    PcmRingBuffer output_ring_;
+    TaskHandle_t output_task_ = nullptr;
+    uint32_t output_dropped_samples_ = 0;
+    // When FlushOutput was called, 0 when no flush is pending
+    std::atomic<int64_t> flush_request_us_{0};
+    // A flush whose fade is still playing, the output is silent once played reaches the
+    // end of the fade. Only used by the output task.
+    int64_t fade_request_us_ = 0;
+    uint32_t fade_end_frames_ = 0;
+
+    // Frames handed to Write and frames the DMA has sent, guarded by output_lock_. Every
+    // on_sent counts one DMA buffer of the written frames as sent. A write after an underrun
+    // may land behind a buffer of silence that is counted too, so played lags sent by one
+    // buffer and the output is only drained when played catches up with written.
+    portMUX_TYPE output_lock_ = portMUX_INITIALIZER_UNLOCKED;
+    uint32_t output_written_frames_ = 0;
+    uint32_t output_sent_frames_ = 0;
+    uint32_t output_played_frames_ = 0;
+    // The output task holds samples it has taken from the ring but not counted yet
+    bool output_writing_ = false;
+    bool output_drained_ = true;
+    EventGroupHandle_t output_event_group_ = nullptr;
+    AudioCodecCallback on_output_drained_;
+
+    void OutputTask();
+    void CompleteFlush(int64_t request_us, std::vector<int16_t>& chunk);
+    void RecordFlushLatency(int64_t request_us);
+    void CheckFadeOut();
+    void WriteOutput(const int16_t* data, int samples);
+    void SetOutputWriting(bool writing);
+    // Everything written so far is gone, played or cleared
+    void DiscardOutputFrames();
+    IRAM_ATTR bool UpdateOutputPlayed(int frames);
+
 protected:
+    AudioCodecCallback on_input_ready_;
+    AudioCodecCallback on_output_ready_;
+
     i2s_chan_handle_t tx_handle_ = nullptr;
     i2s_chan_handle_t rx_handle_ = nullptr;
 
@@ -55,6 +129,14 @@ protected:
     int output_channels_ = 1;
     int output_volume_ = 70;
 
+    // Called by Start, codecs that override it without calling the base must call it too
+    void StartOutputTask();
+    // Reports frames played and wakes the output task from task context, for codecs without
+    // the I2S on_sent callback
+    void NotifyOutputSent(int frames);
+    // Discards the audio in the DMA buffers, called by the output task between writes
+    virtual void ClearOutputBuffers();
+
     virtual int Read(int16_t* dest, int samples) = 0;
     virtual int Write(const int16_t* data, int samples) = 0;
 };
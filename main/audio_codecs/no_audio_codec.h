@@ -8,6 +8,10 @@
 
 class NoAudioCodec : public AudioCodec {
 private:
+    // 32 bit I2S words, reused between calls
+    std::vector<int32_t> input_buffer_;
+    std::vector<int32_t> output_buffer_;
+
     virtual int Write(const int16_t* data, int samples) override;
     virtual int Read(int16_t* dest, int samples) override;
 
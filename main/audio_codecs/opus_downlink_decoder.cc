@@ -0,0 +1,81 @@
+#include "opus_downlink_decoder.h"
+
+#include <esp_log.h>
+
+#define TAG "OpusDownlinkDecoder"
+
+// The longest packet Opus allows
+#define MAX_PACKET_DURATION_MS 120
+// Concealed when nothing has been decoded yet to take the duration from
+#define DEFAULT_LOST_DURATION_MS 20
+
+OpusDownlinkDecoder::OpusDownlinkDecoder(int sample_rate, int channels)
+    : sample_rate_(sample_rate), channels_(channels) {
+    int error;
+    decoder_ = opus_decoder_create(sample_rate, channels, &error);
+    if (decoder_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", error);
+    }
+}
+
+OpusDownlinkDecoder::~OpusDownlinkDecoder() {
+    if (decoder_ != nullptr) {
+        opus_decoder_destroy(decoder_);
+    }
+}
+
+bool OpusDownlinkDecoder::Decode(const uint8_t* opus, size_t size, std::vector<int16_t>& pcm) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (decoder_ == nullptr) {
+        return false;
+    }
+
+    pcm.resize(sample_rate_ / 1000 * MAX_PACKET_DURATION_MS * channels_);
+    auto ret = opus_decode(decoder_, opus, size, pcm.data(), pcm.size() / channels_, 0);
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Failed to decode audio, error code: %d", ret);
+        return false;
+    }
+    pcm.resize(ret * channels_);
+    return true;
+}
+
+bool OpusDownlinkDecoder::DecodeLost(const uint8_t* next, size_t next_size, std::vector<int16_t>& pcm, bool& fec) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (decoder_ == nullptr) {
+        return false;
+    }
+
+    // The lost packet most likely had the duration of its neighbours, FEC needs it exactly
+    int samples = 0;
+    if (next_size > 0) {
+        samples = opus_decoder_get_nb_samples(decoder_, next, next_size);
+    }
+    if (samples <= 0) {
+        opus_int32 last_duration = 0;
+        opus_decoder_ctl(decoder_, OPUS_GET_LAST_PACKET_DURATION(&last_duration));
+        samples = last_duration;
+    }
+    if (samples <= 0) {
+        samples = sample_rate_ / 1000 * DEFAULT_LOST_DURATION_MS;
+    }
+
+    // Without LBRR data in next the FEC decode falls back to concealment by itself
+    fec = next_size > 0;
+    pcm.resize(samples * channels_);
+    auto ret = opus_decode(decoder_, fec ? next : nullptr, fec ? next_size : 0,
+        pcm.data(), samples, fec ? 1 : 0);
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Failed to conceal lost audio, error code: %d", ret);
+        return false;
+    }
+    pcm.resize(ret * channels_);
+    return true;
+}
+
+void OpusDownlinkDecoder::ResetState() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (decoder_ != nullptr) {
+        opus_decoder_ctl(decoder_, OPUS_RESET_STATE);
+    }
+}
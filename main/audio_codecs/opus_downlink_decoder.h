@@ -0,0 +1,37 @@
+#ifndef _OPUS_DOWNLINK_DECODER_H
+#define _OPUS_DOWNLINK_DECODER_H
+
+#include <opus.h>
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Opus decoder for the downlink. Works like OpusDecoderWrapper, and also fills in lost
+// packets: from the in-band FEC of the packet that follows when it is available, otherwise
+// with the decoder's packet loss concealment.
+class OpusDownlinkDecoder {
+public:
+    OpusDownlinkDecoder(int sample_rate, int channels);
+    ~OpusDownlinkDecoder();
+    OpusDownlinkDecoder(const OpusDownlinkDecoder&) = delete;
+    OpusDownlinkDecoder& operator=(const OpusDownlinkDecoder&) = delete;
+
+    int sample_rate() const { return sample_rate_; }
+
+    // The packet is only read, it may point into flash
+    bool Decode(const uint8_t* opus, size_t size, std::vector<int16_t>& pcm);
+    // Decodes the packet before next, which was lost. With next its in-band FEC is used, which
+    // falls back to concealment when next carries none, fec tells which was tried. An empty
+    // next always conceals.
+    bool DecodeLost(const uint8_t* next, size_t next_size, std::vector<int16_t>& pcm, bool& fec);
+    void ResetState();
+
+private:
+    std::mutex mutex_;
+    OpusDecoder* decoder_ = nullptr;
+    int sample_rate_;
+    int channels_;
+};
+
+#endif // _OPUS_DOWNLINK_DECODER_H
@@ -0,0 +1,112 @@
+#include "opus_uplink_encoder.h"
+
+#include <esp_log.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "OpusUplinkEncoder"
+
+// The largest packet Opus produces for a single frame
+#define MAX_OPUS_PACKET_SIZE 1276
+
+OpusUplinkEncoder::OpusUplinkEncoder(int sample_rate, int channels, int duration_ms)
+    : sample_rate_(sample_rate), duration_ms_(duration_ms) {
+    int error;
+    encoder_ = opus_encoder_create(sample_rate, channels, OPUS_APPLICATION_VOIP, &error);
+    if (encoder_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", error);
+        return;
+    }
+
+    // Default DTX enabled, matching OpusEncoderWrapper
+    SetDtx(true);
+    SetComplexity(5);
+
+    frame_samples_ = sample_rate / 1000 * channels * duration_ms;
+    in_buffer_.resize(frame_samples_);
+    out_buffer_.resize(MAX_OPUS_PACKET_SIZE);
+}
+
+OpusUplinkEncoder::~OpusUplinkEncoder() {
+    if (encoder_ != nullptr) {
+        opus_encoder_destroy(encoder_);
+    }
+}
+
+void OpusUplinkEncoder::SetComplexity(int complexity) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (encoder_ != nullptr) {
+        opus_encoder_ctl(encoder_, OPUS_SET_COMPLEXITY(complexity));
+    }
+}
+
+void OpusUplinkEncoder::SetBitrate(int bitrate) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (encoder_ != nullptr) {
+        opus_encoder_ctl(encoder_, OPUS_SET_BITRATE(bitrate));
+    }
+}
+
+void OpusUplinkEncoder::SetDtx(bool enable) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (encoder_ != nullptr) {
+        opus_encoder_ctl(encoder_, OPUS_SET_DTX(enable ? 1 : 0));
+    }
+}
+
+void OpusUplinkEncoder::ResetState() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (encoder_ != nullptr) {
+        opus_encoder_ctl(encoder_, OPUS_RESET_STATE);
+    }
+    in_size_ = 0;
+}
+
+bool OpusUplinkEncoder::IsBufferEmpty() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return in_size_ == 0;
+}
+
+std::vector<uint8_t> OpusUplinkEncoder::GetSilencePacket() const {
+    // TOC byte of a SILK wideband frame (configurations 8 to 11 are 10, 20, 40 and 60 ms), mono, code 0
+    int config = 11;
+    if (duration_ms_ <= 10) {
+        config = 8;
+    } else if (duration_ms_ <= 20) {
+        config = 9;
+    } else if (duration_ms_ <= 40) {
+        config = 10;
+    }
+    return std::vector<uint8_t>{ (uint8_t)(config << 3) };
+}
+
+void OpusUplinkEncoder::Encode(std::vector<int16_t>&& pcm, std::function<void(std::vector<uint8_t>&& opus)> handler) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (encoder_ == nullptr) {
+        ESP_LOGE(TAG, "Audio encoder is not configured");
+        return;
+    }
+
+    const int16_t* data = pcm.data();
+    size_t remaining = pcm.size();
+    while (remaining > 0) {
+        size_t copy = std::min(remaining, frame_samples_ - in_size_);
+        memcpy(in_buffer_.data() + in_size_, data, copy * sizeof(int16_t));
+        in_size_ += copy;
+        data += copy;
+        remaining -= copy;
+        if (in_size_ < frame_samples_) {
+            break;
+        }
+
+        in_size_ = 0;
+        auto ret = opus_encode(encoder_, in_buffer_.data(), frame_samples_, out_buffer_.data(), out_buffer_.size());
+        if (ret < 0) {
+            ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
+            continue;
+        }
+        if (handler != nullptr) {
+            handler(std::vector<uint8_t>(out_buffer_.begin(), out_buffer_.begin() + ret));
+        }
+    }
+}
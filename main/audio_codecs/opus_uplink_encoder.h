@@ -0,0 +1,48 @@
+#ifndef _OPUS_UPLINK_ENCODER_H
+#define _OPUS_UPLINK_ENCODER_H
+
+#include <opus.h>
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Opus encoder for the uplink. Works like OpusEncoderWrapper, buffering the input until a
+// frame is complete, but also exposes the bitrate so it can be adapted at runtime. The
+// input buffer is sized once, only the packets handed to the handler are allocated.
+class OpusUplinkEncoder {
+public:
+    OpusUplinkEncoder(int sample_rate, int channels, int duration_ms);
+    ~OpusUplinkEncoder();
+    OpusUplinkEncoder(const OpusUplinkEncoder&) = delete;
+    OpusUplinkEncoder& operator=(const OpusUplinkEncoder&) = delete;
+
+    int sample_rate() const { return sample_rate_; }
+    int duration_ms() const { return duration_ms_; }
+
+    void SetComplexity(int complexity);
+    // Bits per second, or OPUS_AUTO
+    void SetBitrate(int bitrate);
+    void SetDtx(bool enable);
+    void ResetState();
+
+    // Calls handler once for every frame completed by pcm
+    void Encode(std::vector<int16_t>&& pcm, std::function<void(std::vector<uint8_t>&& opus)> handler);
+    bool IsBufferEmpty();
+    // A one byte packet without frame data for the current duration, decoders conceal it
+    // like a DTX frame, as comfort noise
+    std::vector<uint8_t> GetSilencePacket() const;
+
+private:
+    std::mutex mutex_;
+    OpusEncoder* encoder_ = nullptr;
+    int sample_rate_;
+    int duration_ms_;
+    size_t frame_samples_;
+    std::vector<int16_t> in_buffer_;
+    size_t in_size_ = 0;
+    std::vector<uint8_t> out_buffer_;
+};
+
+#endif // _OPUS_UPLINK_ENCODER_H
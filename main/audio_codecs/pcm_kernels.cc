@@ -0,0 +1,293 @@
+#include "pcm_kernels.h"
+
+#if defined(__XTENSA__)
+#include <xtensa/config/core-isa.h>
+#endif
+
+#define TAG "PcmKernels"
+
+#if defined(__XTENSA__) && XCHAL_HAVE_CLAMPS
+static inline int32_t Saturate16(int32_t value) {
+    int32_t result;
+    __asm__("clamps %0, %1, 15" : "=a"(result) : "a"(value));
+    return result;
+}
+#else
+static inline int32_t Saturate16(int32_t value) {
+    return value > INT16_MAX ? INT16_MAX : (value < INT16_MIN ? INT16_MIN : value);
+}
+#endif
+
+static inline int32_t Saturate32(int64_t value) {
+    return value > INT32_MAX ? INT32_MAX : (value < INT32_MIN ? INT32_MIN : (int32_t)value);
+}
+
+int32_t PcmVolumeToGain(int volume) {
+    if (volume <= 0) {
+        return 0;
+    }
+    if (volume >= 100) {
+        return 65536;
+    }
+    return volume * volume * 65536 / 10000;
+}
+
+// The loops are unrolled by four so the Xtensa zero overhead loop covers more work per
+// iteration and the loads of the next samples are scheduled while the previous ones retire
+
+void PcmShiftToInt16(const int32_t* src, int16_t* dest, size_t samples, int shift) {
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        int32_t a = src[i] >> shift;
+        int32_t b = src[i + 1] >> shift;
+        int32_t c = src[i + 2] >> shift;
+        int32_t d = src[i + 3] >> shift;
+        dest[i] = Saturate16(a);
+        dest[i + 1] = Saturate16(b);
+        dest[i + 2] = Saturate16(c);
+        dest[i + 3] = Saturate16(d);
+    }
+    for (; i < samples; ++i) {
+        dest[i] = Saturate16(src[i] >> shift);
+    }
+}
+
+void PcmScaleToInt32(const int16_t* src, int32_t* dest, size_t samples, int32_t gain) {
+    if (gain > 65536 || gain < -65536) {
+        for (size_t i = 0; i < samples; ++i) {
+            dest[i] = Saturate32((int64_t)src[i] * gain);
+        }
+        return;
+    }
+
+    // |src * gain| <= 32768 * 65536, which fits in 32 bits, so no saturation is needed
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        int32_t a = src[i] * gain;
+        int32_t b = src[i + 1] * gain;
+        int32_t c = src[i + 2] * gain;
+        int32_t d = src[i + 3] * gain;
+        dest[i] = a;
+        dest[i + 1] = b;
+        dest[i + 2] = c;
+        dest[i + 3] = d;
+    }
+    for (; i < samples; ++i) {
+        dest[i] = src[i] * gain;
+    }
+}
+
+void PcmScaleInt16(const int16_t* src, int16_t* dest, size_t samples, int32_t gain) {
+    if (gain > 65536 || gain < -65536) {
+        for (size_t i = 0; i < samples; ++i) {
+            dest[i] = Saturate16(Saturate32(((int64_t)src[i] * gain) >> 16));
+        }
+        return;
+    }
+
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        int32_t a = (src[i] * gain) >> 16;
+        int32_t b = (src[i + 1] * gain) >> 16;
+        int32_t c = (src[i + 2] * gain) >> 16;
+        int32_t d = (src[i + 3] * gain) >> 16;
+        dest[i] = Saturate16(a);
+        dest[i + 1] = Saturate16(b);
+        dest[i + 2] = Saturate16(c);
+        dest[i + 3] = Saturate16(d);
+    }
+    for (; i < samples; ++i) {
+        dest[i] = Saturate16((src[i] * gain) >> 16);
+    }
+}
+
+void PcmDeinterleave(const int16_t* src, int16_t* left, int16_t* right, size_t frames) {
+    for (size_t i = 0; i < frames; ++i) {
+        int16_t l = src[i * 2];
+        int16_t r = src[i * 2 + 1];
+        left[i] = l;
+        right[i] = r;
+    }
+}
+
+void PcmInterleave(const int16_t* left, const int16_t* right, int16_t* dest, size_t frames) {
+    size_t i = 0;
+    for (; i + 2 <= frames; i += 2) {
+        dest[i * 2] = left[i];
+        dest[i * 2 + 1] = right[i];
+        dest[i * 2 + 2] = left[i + 1];
+        dest[i * 2 + 3] = right[i + 1];
+    }
+    for (; i < frames; ++i) {
+        dest[i * 2] = left[i];
+        dest[i * 2 + 1] = right[i];
+    }
+}
+
+void PcmMix(const int16_t* a, const int16_t* b, int16_t* dest, size_t samples) {
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        int32_t s0 = a[i] + b[i];
+        int32_t s1 = a[i + 1] + b[i + 1];
+        int32_t s2 = a[i + 2] + b[i + 2];
+        int32_t s3 = a[i + 3] + b[i + 3];
+        dest[i] = Saturate16(s0);
+        dest[i + 1] = Saturate16(s1);
+        dest[i + 2] = Saturate16(s2);
+        dest[i + 3] = Saturate16(s3);
+    }
+    for (; i < samples; ++i) {
+        dest[i] = Saturate16(a[i] + b[i]);
+    }
+}
+
+int16_t PcmDotProductQ15(const int16_t* a, const int16_t* b, size_t samples) {
+    // Two accumulators, so consecutive multiply-adds do not wait for each other
+    int32_t sum0 = 1 << 14;
+    int32_t sum1 = 0;
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        sum0 += a[i] * b[i];
+        sum1 += a[i + 1] * b[i + 1];
+        sum0 += a[i + 2] * b[i + 2];
+        sum1 += a[i + 3] * b[i + 3];
+    }
+    for (; i < samples; ++i) {
+        sum0 += a[i] * b[i];
+    }
+    return Saturate16((sum0 + sum1) >> 15);
+}
+
+#if CONFIG_USE_PCM_KERNELS_BENCHMARK
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_random.h>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+
+#define BENCHMARK_SAMPLES 960     // One 60 ms frame at 16 kHz
+#define BENCHMARK_ROUNDS 200
+
+// The loops the codecs used before, kept here as the baseline
+
+static void ReferenceShiftToInt16(const int32_t* src, int16_t* dest, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        int32_t value = src[i] >> 12;
+        dest[i] = (value > INT16_MAX) ? INT16_MAX : (value < -INT16_MAX) ? -INT16_MAX : (int16_t)value;
+    }
+}
+
+static void ReferenceScaleToInt32(const int16_t* src, int32_t* dest, size_t samples, int volume) {
+    int32_t volume_factor = pow(double(volume) / 100.0, 2) * 65536;
+    for (size_t i = 0; i < samples; i++) {
+        int64_t temp = int64_t(src[i]) * volume_factor;
+        if (temp > INT32_MAX) {
+            dest[i] = INT32_MAX;
+        } else if (temp < INT32_MIN) {
+            dest[i] = INT32_MIN;
+        } else {
+            dest[i] = static_cast<int32_t>(temp);
+        }
+    }
+}
+
+static void ReferenceScaleInt16(const int16_t* src, int16_t* dest, size_t samples, int volume) {
+    for (size_t i = 0; i < samples; i++) {
+        dest[i] = (float)src[i] * (float)(volume / 100.0);
+    }
+}
+
+static void ReferenceDeinterleave(const int16_t* src, int16_t* left, int16_t* right, size_t frames) {
+    for (size_t i = 0, j = 0; i < frames; ++i, j += 2) {
+        left[i] = src[j];
+        right[i] = src[j + 1];
+    }
+}
+
+static void ReferenceInterleave(const int16_t* left, const int16_t* right, int16_t* dest, size_t frames) {
+    for (size_t i = 0, j = 0; i < frames; ++i, j += 2) {
+        dest[j] = left[i];
+        dest[j + 1] = right[i];
+    }
+}
+
+static void ReferenceMix(const int16_t* a, const int16_t* b, int16_t* dest, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        int32_t sum = a[i] + b[i];
+        dest[i] = (sum > INT16_MAX) ? INT16_MAX : (sum < INT16_MIN) ? INT16_MIN : (int16_t)sum;
+    }
+}
+
+template <typename F>
+static int64_t TimeRounds(F&& f) {
+    int64_t start = esp_timer_get_time();
+    for (int round = 0; round < BENCHMARK_ROUNDS; ++round) {
+        f();
+    }
+    return esp_timer_get_time() - start;
+}
+
+template <typename T>
+static int64_t MaxDifference(const std::vector<T>& a, const std::vector<T>& b) {
+    int64_t max = 0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        max = std::max<int64_t>(max, std::llabs((int64_t)a[i] - (int64_t)b[i]));
+    }
+    return max;
+}
+
+static void Report(const char* name, int64_t reference_us, int64_t kernel_us, int64_t max_difference) {
+    ESP_LOGI(TAG, "%-16s reference %5lld us kernel %5lld us speedup %.2fx max difference %lld",
+        name, reference_us, kernel_us, kernel_us > 0 ? (double)reference_us / kernel_us : 0.0, max_difference);
+}
+
+void PcmKernelsBenchmark() {
+    const int volume = 70;
+    std::vector<int32_t> i2s_input(BENCHMARK_SAMPLES);
+    std::vector<int16_t> pcm_a(BENCHMARK_SAMPLES), pcm_b(BENCHMARK_SAMPLES);
+    std::vector<int16_t> stereo(BENCHMARK_SAMPLES * 2);
+    for (int i = 0; i < BENCHMARK_SAMPLES; ++i) {
+        // Full scale I2S words, so the shift saturates now and then
+        i2s_input[i] = (int32_t)esp_random();
+        pcm_a[i] = (int16_t)esp_random();
+        pcm_b[i] = (int16_t)esp_random();
+        stereo[i * 2] = pcm_a[i];
+        stereo[i * 2 + 1] = pcm_b[i];
+    }
+
+    std::vector<int16_t> out16_a(BENCHMARK_SAMPLES), out16_b(BENCHMARK_SAMPLES);
+    std::vector<int16_t> out16_c(BENCHMARK_SAMPLES), out16_d(BENCHMARK_SAMPLES);
+    std::vector<int32_t> out32_a(BENCHMARK_SAMPLES), out32_b(BENCHMARK_SAMPLES);
+    std::vector<int16_t> stereo_a(BENCHMARK_SAMPLES * 2), stereo_b(BENCHMARK_SAMPLES * 2);
+
+    ESP_LOGI(TAG, "%d samples x %d rounds", BENCHMARK_SAMPLES, BENCHMARK_ROUNDS);
+
+    // The kernel clamps to -32768 where the old loop stopped at -32767, a difference of 1
+    auto reference = TimeRounds([&]() { ReferenceShiftToInt16(i2s_input.data(), out16_a.data(), BENCHMARK_SAMPLES); });
+    auto kernel = TimeRounds([&]() { PcmShiftToInt16(i2s_input.data(), out16_b.data(), BENCHMARK_SAMPLES, 12); });
+    Report("shift_to_int16", reference, kernel, MaxDifference(out16_a, out16_b));
+
+    reference = TimeRounds([&]() { ReferenceScaleToInt32(pcm_a.data(), out32_a.data(), BENCHMARK_SAMPLES, volume); });
+    kernel = TimeRounds([&]() { PcmScaleToInt32(pcm_a.data(), out32_b.data(), BENCHMARK_SAMPLES, PcmVolumeToGain(volume)); });
+    Report("scale_to_int32", reference, kernel, MaxDifference(out32_a, out32_b));
+
+    // The float loop truncates towards zero, the kernel rounds down, so negative samples may differ by 1
+    reference = TimeRounds([&]() { ReferenceScaleInt16(pcm_a.data(), out16_a.data(), BENCHMARK_SAMPLES, volume); });
+    kernel = TimeRounds([&]() { PcmScaleInt16(pcm_a.data(), out16_b.data(), BENCHMARK_SAMPLES, volume * 65536 / 100); });
+    Report("scale_int16", reference, kernel, MaxDifference(out16_a, out16_b));
+
+    reference = TimeRounds([&]() { ReferenceDeinterleave(stereo.data(), out16_a.data(), out16_c.data(), BENCHMARK_SAMPLES); });
+    kernel = TimeRounds([&]() { PcmDeinterleave(stereo.data(), out16_b.data(), out16_d.data(), BENCHMARK_SAMPLES); });
+    Report("deinterleave", reference, kernel, std::max(MaxDifference(out16_a, out16_b), MaxDifference(out16_c, out16_d)));
+
+    reference = TimeRounds([&]() { ReferenceInterleave(pcm_a.data(), pcm_b.data(), stereo_a.data(), BENCHMARK_SAMPLES); });
+    kernel = TimeRounds([&]() { PcmInterleave(pcm_a.data(), pcm_b.data(), stereo_b.data(), BENCHMARK_SAMPLES); });
+    Report("interleave", reference, kernel, MaxDifference(stereo_a, stereo_b));
+
+    reference = TimeRounds([&]() { ReferenceMix(pcm_a.data(), pcm_b.data(), out16_a.data(), BENCHMARK_SAMPLES); });
+    kernel = TimeRounds([&]() { PcmMix(pcm_a.data(), pcm_b.data(), out16_b.data(), BENCHMARK_SAMPLES); });
+    Report("mix", reference, kernel, MaxDifference(out16_a, out16_b));
+}
+#endif
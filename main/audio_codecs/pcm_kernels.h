@@ -0,0 +1,42 @@
+#ifndef _PCM_KERNELS_H
+#define _PCM_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Sample conversion loops shared by the codecs. On Xtensa (ESP32, ESP32-S3) saturation
+// uses the single cycle CLAMPS instruction, other targets use the portable compare.
+// All kernels accept any sample count and unaligned buffers.
+
+// Volume 0-100 to a Q16 gain with the same square law the codecs used before, 65536 at 100
+int32_t PcmVolumeToGain(int volume);
+
+// dest[i] = saturate16(src[i] >> shift), e.g. 32 bit I2S microphones to 16 bit PCM
+void PcmShiftToInt16(const int32_t* src, int16_t* dest, size_t samples, int shift);
+
+// dest[i] = src[i] * gain with a Q16 gain, saturated to 32 bits for gains above 65536
+void PcmScaleToInt32(const int16_t* src, int32_t* dest, size_t samples, int32_t gain);
+
+// dest[i] = saturate16((src[i] * gain) >> 16), dest may be src
+void PcmScaleInt16(const int16_t* src, int16_t* dest, size_t samples, int32_t gain);
+
+// Splits interleaved stereo into two channels. left may be src, each frame is read before
+// the slot it is written to, so the left channel can be compacted in place.
+void PcmDeinterleave(const int16_t* src, int16_t* left, int16_t* right, size_t frames);
+
+// Interleaves two channels into dest, dest must not overlap the inputs
+void PcmInterleave(const int16_t* left, const int16_t* right, int16_t* dest, size_t frames);
+
+// dest[i] = saturate16(a[i] + b[i]), dest may be a or b
+void PcmMix(const int16_t* a, const int16_t* b, int16_t* dest, size_t samples);
+
+// saturate16(round(sum(a[i] * b[i]) >> 15)) with Q15 coefficients in b. The sum is kept in 32
+// bits, so the absolute sum of the coefficients must stay below 2.
+int16_t PcmDotProductQ15(const int16_t* a, const int16_t* b, size_t samples);
+
+#if CONFIG_USE_PCM_KERNELS_BENCHMARK
+// Times the kernels against the plain loops they replaced and logs the results
+void PcmKernelsBenchmark();
+#endif
+
+#endif // _PCM_KERNELS_H
@@ -0,0 +1,96 @@
+#include "pcm_ring_buffer.h"
+
+#include <esp_heap_caps.h>
+#include <esp_attr.h>
+#include <algorithm>
+#include <cstring>
+
+PcmRingBuffer::~PcmRingBuffer() {
+    heap_caps_free(buffer_);
+}
+
+bool PcmRingBuffer::Configure(size_t capacity_samples) {
+    heap_caps_free(buffer_);
+    buffer_ = (int16_t*)heap_caps_malloc(capacity_samples * sizeof(int16_t), MALLOC_CAP_SPIRAM);
+    if (buffer_ == nullptr) {
+        buffer_ = (int16_t*)heap_caps_malloc(capacity_samples * sizeof(int16_t), MALLOC_CAP_8BIT);
+    }
+    capacity_ = buffer_ != nullptr ? capacity_samples : 0;
+    write_position_ = 0;
+    read_position_ = 0;
+    clear_pending_ = false;
+    return buffer_ != nullptr;
+}
+
+// In IRAM with size(), the I2S on_sent ISR reads the fill level
+IRAM_ATTR size_t PcmRingBuffer::Distance(size_t from, size_t to) const {
+    return to >= from ? to - from : to + 2 * capacity_ - from;
+}
+
+size_t PcmRingBuffer::Advance(size_t position, size_t samples) const {
+    position += samples;
+    return position >= 2 * capacity_ ? position - 2 * capacity_ : position;
+}
+
+IRAM_ATTR size_t PcmRingBuffer::size() const {
+    size_t write = write_position_.load(std::memory_order_acquire);
+    size_t read = read_position_.load(std::memory_order_acquire);
+    size_t queued = Distance(read, write);
+    if (clear_pending_.load(std::memory_order_acquire)) {
+        // Only what was written after the clear is still going to play
+        size_t cleared = Distance(read, clear_position_.load(std::memory_order_relaxed));
+        if (cleared <= queued) {
+            queued -= cleared;
+        }
+    }
+    return queued;
+}
+
+size_t PcmRingBuffer::space() const {
+    return capacity_ - Distance(read_position_.load(std::memory_order_acquire), write_position_.load(std::memory_order_acquire));
+}
+
+size_t PcmRingBuffer::Write(const int16_t* data, size_t samples) {
+    if (capacity_ == 0) {
+        return 0;
+    }
+    size_t write = write_position_.load(std::memory_order_relaxed);
+    size_t read = read_position_.load(std::memory_order_acquire);
+    samples = std::min(samples, capacity_ - Distance(read, write));
+
+    size_t index = write >= capacity_ ? write - capacity_ : write;
+    size_t first = std::min(samples, capacity_ - index);
+    memcpy(buffer_ + index, data, first * sizeof(int16_t));
+    memcpy(buffer_, data + first, (samples - first) * sizeof(int16_t));
+    write_position_.store(Advance(write, samples), std::memory_order_release);
+    return samples;
+}
+
+size_t PcmRingBuffer::Read(int16_t* dest, size_t samples) {
+    if (capacity_ == 0) {
+        return 0;
+    }
+    size_t read = read_position_.load(std::memory_order_relaxed);
+    size_t write = write_position_.load(std::memory_order_acquire);
+    if (clear_pending_.exchange(false, std::memory_order_acquire)) {
+        // The consumer may already be past the clear position if it read newer samples
+        // before the flag was set, never move backwards
+        size_t clear = clear_position_.load(std::memory_order_relaxed);
+        if (Distance(read, clear) <= Distance(read, write)) {
+            read = clear;
+        }
+    }
+    samples = std::min(samples, Distance(read, write));
+
+    size_t index = read >= capacity_ ? read - capacity_ : read;
+    size_t first = std::min(samples, capacity_ - index);
+    memcpy(dest, buffer_ + index, first * sizeof(int16_t));
+    memcpy(dest + first, buffer_, (samples - first) * sizeof(int16_t));
+    read_position_.store(Advance(read, samples), std::memory_order_release);
+    return samples;
+}
+
+void PcmRingBuffer::Clear() {
+    clear_position_.store(write_position_.load(std::memory_order_acquire), std::memory_order_relaxed);
+    clear_pending_.store(true, std::memory_order_release);
+}
@@ -0,0 +1,48 @@
+#ifndef _PCM_RING_BUFFER_H
+#define _PCM_RING_BUFFER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Single producer, single consumer sample ring, lock free. Write and Read never block,
+// they copy what fits. The positions run modulo twice the capacity, so a full ring can
+// be told from an empty one without a separate count.
+class PcmRingBuffer {
+public:
+    PcmRingBuffer() = default;
+    PcmRingBuffer(const PcmRingBuffer&) = delete;
+    PcmRingBuffer& operator=(const PcmRingBuffer&) = delete;
+    ~PcmRingBuffer();
+
+    // Allocates in PSRAM when available, call before either side runs
+    bool Configure(size_t capacity_samples);
+
+    // Producer side, returns the number of samples queued
+    size_t Write(const int16_t* data, size_t samples);
+    // Consumer side, returns the number of samples copied to dest
+    size_t Read(int16_t* dest, size_t samples);
+    // May be called from any task. The samples queued so far are dropped by the consumer on
+    // its next Read, samples written afterwards are kept.
+    void Clear();
+
+    // Samples still to be read, not counting those a pending Clear drops. In IRAM, safe to
+    // call from an ISR.
+    size_t size() const;
+    // Room for Write, a pending Clear frees its samples only once the consumer applies it
+    size_t space() const;
+    size_t capacity() const { return capacity_; }
+
+private:
+    int16_t* buffer_ = nullptr;
+    size_t capacity_ = 0;
+    std::atomic<size_t> write_position_{0};
+    std::atomic<size_t> read_position_{0};
+    std::atomic<bool> clear_pending_{false};
+    std::atomic<size_t> clear_position_{0};
+
+    size_t Distance(size_t from, size_t to) const;
+    size_t Advance(size_t position, size_t samples) const;
+};
+
+#endif // _PCM_RING_BUFFER_H
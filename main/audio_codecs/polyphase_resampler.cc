@@ -0,0 +1,221 @@
+#include "polyphase_resampler.h"
+#include "pcm_kernels.h"
+
+#include <esp_log.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+
+#define TAG "PolyphaseResampler"
+
+struct QualityPreset {
+    int taps;
+    // Kaiser window shape, trades the stopband attenuation against the transition width
+    double beta;
+    // Passband edge as a fraction of the lower Nyquist frequency
+    double rolloff;
+};
+
+static const QualityPreset QUALITY_PRESETS[] = {
+    { 8, 5.0, 0.80 },     // kResamplerQualityLow
+    { 32, 8.0, 0.92 },    // kResamplerQualityHigh
+};
+
+// Zeroth order modified Bessel function of the first kind, for the Kaiser window
+static double BesselI0(double x) {
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 32; ++k) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12) {
+            break;
+        }
+    }
+    return sum;
+}
+
+void PolyphaseResampler::Configure(int input_sample_rate, int output_sample_rate, PolyphaseResamplerQuality quality) {
+    input_sample_rate_ = input_sample_rate;
+    output_sample_rate_ = output_sample_rate;
+    int divisor = std::gcd(input_sample_rate, output_sample_rate);
+    up_ = output_sample_rate / divisor;
+    down_ = input_sample_rate / divisor;
+
+    const auto& preset = QUALITY_PRESETS[quality];
+    taps_ = preset.taps;
+
+    // Prototype low pass at up_ times the input rate, cut off at the lower of both Nyquist frequencies
+    int length = taps_ * up_;
+    double center = (length - 1) / 2.0;
+    double cutoff = 0.5 * preset.rolloff / std::max(up_, down_);
+    double beta_norm = BesselI0(preset.beta);
+    std::vector<double> prototype(length);
+    for (int m = 0; m < length; ++m) {
+        double t = m - center;
+        double sinc = t == 0.0 ? 1.0 : std::sin(2.0 * M_PI * cutoff * t) / (2.0 * M_PI * cutoff * t);
+        double r = length > 1 ? t / center : 0.0;
+        double window = BesselI0(preset.beta * std::sqrt(std::max(0.0, 1.0 - r * r))) / beta_norm;
+        prototype[m] = sinc * window;
+    }
+
+    // Phase p holds prototype[p + up_ * i] for the input sample i steps back. Each phase is
+    // normalized to unity gain, so a constant input gives a constant output whatever the phase.
+    coefficients_.assign(up_ * taps_, 0);
+    for (int p = 0; p < up_; ++p) {
+        double sum = 0.0;
+        for (int i = 0; i < taps_; ++i) {
+            sum += prototype[p + up_ * i];
+        }
+        int16_t* phase = &coefficients_[p * taps_];
+        for (int i = 0; i < taps_; ++i) {
+            double value = prototype[p + up_ * i] / sum * 32768.0;
+            phase[taps_ - 1 - i] = (int16_t)std::clamp(std::lround(value), -32768L, 32767L);
+        }
+    }
+
+    buffer_.assign(taps_ - 1 + kChunkSamples, 0);
+    Reset();
+    ESP_LOGI(TAG, "Resampling %d to %d Hz, %d/%d, %d taps per phase", input_sample_rate, output_sample_rate,
+        up_, down_, taps_);
+}
+
+void PolyphaseResampler::Reset() {
+    std::fill(buffer_.begin(), buffer_.end(), 0);
+    phase_ = 0;
+    next_input_ = 0;
+}
+
+int PolyphaseResampler::GetOutputSamples(int input_samples) const {
+    return (int)(((int64_t)input_samples * up_ + down_ - 1) / down_);
+}
+
+int PolyphaseResampler::Process(const int16_t* input, int input_samples, int16_t* output) {
+    const int history = taps_ - 1;
+    int written = 0;
+    while (input_samples > 0) {
+        int count = std::min(input_samples, kChunkSamples);
+        memcpy(buffer_.data() + history, input, count * sizeof(int16_t));
+
+        // The window of an output ends at its newest input sample, buffer_[next_input_ + history]
+        while (next_input_ < count) {
+            output[written++] = PcmDotProductQ15(buffer_.data() + next_input_, &coefficients_[phase_ * taps_], taps_);
+            phase_ += down_;
+            next_input_ += phase_ / up_;
+            phase_ %= up_;
+        }
+        next_input_ -= count;
+
+        memmove(buffer_.data(), buffer_.data() + count, history * sizeof(int16_t));
+        input += count;
+        input_samples -= count;
+    }
+    return written;
+}
+
+#if CONFIG_USE_RESAMPLER_BENCHMARK
+#include <esp_timer.h>
+#include <opus_resampler.h>
+
+#define BENCHMARK_FRAME_MS 60
+#define BENCHMARK_ROUNDS 50
+
+struct RatePair {
+    int input;
+    int output;
+};
+
+// Microphones at 24 kHz to the 16 kHz uplink, and the downlink to 24 kHz or 16 kHz speakers
+static const RatePair BENCHMARK_RATE_PAIRS[] = {
+    { 24000, 16000 },
+    { 16000, 24000 },
+};
+
+static void GenerateTone(std::vector<int16_t>& pcm, int sample_rate, double frequency) {
+    for (size_t i = 0; i < pcm.size(); ++i) {
+        pcm[i] = (int16_t)(16384.0 * std::sin(2.0 * M_PI * frequency * i / sample_rate));
+    }
+}
+
+// Least squares fit of a sine at the frequency, the power of the fit and of the residual
+// give the signal to noise ratio without having to know the delay of the filter
+static void MeasureTone(const int16_t* pcm, size_t samples, int sample_rate, double frequency,
+    double& signal_power, double& residual_power) {
+    double ss = 0, sc = 0, cc = 0, ys = 0, yc = 0, yy = 0;
+    for (size_t i = 0; i < samples; ++i) {
+        double s = std::sin(2.0 * M_PI * frequency * i / sample_rate);
+        double c = std::cos(2.0 * M_PI * frequency * i / sample_rate);
+        double y = pcm[i];
+        ss += s * s; sc += s * c; cc += c * c;
+        ys += y * s; yc += y * c; yy += y * y;
+    }
+    double det = ss * cc - sc * sc;
+    double a = (ys * cc - yc * sc) / det;
+    double b = (yc * ss - ys * sc) / det;
+    double fit = a * ys + b * yc;
+    signal_power = fit / samples;
+    residual_power = std::max(yy - fit, 1e-9) / samples;
+}
+
+template <typename Resampler>
+static void RunBenchmark(const char* name, Resampler& resampler, const RatePair& pair) {
+    int frame_samples = pair.input / 1000 * BENCHMARK_FRAME_MS;
+    int output_samples = resampler.GetOutputSamples(frame_samples);
+    std::vector<int16_t> input(frame_samples * BENCHMARK_ROUNDS);
+    std::vector<int16_t> output(output_samples * BENCHMARK_ROUNDS);
+
+    // Passband tone, the output error is the filter ripple, the quantization and the images
+    GenerateTone(input, pair.input, 1000.0);
+    int64_t start = esp_timer_get_time();
+    for (int round = 0; round < BENCHMARK_ROUNDS; ++round) {
+        resampler.Process(input.data() + round * frame_samples, frame_samples, output.data() + round * output_samples);
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start;
+    // Skip the first frame, the filter is still filling
+    double signal, residual;
+    MeasureTone(output.data() + output_samples, output.size() - output_samples, pair.output, 1000.0, signal, residual);
+    double snr_db = 10.0 * std::log10(signal / residual);
+
+    // Downsampling: a tone between both Nyquist frequencies must not alias into the output.
+    // Upsampling: a high tone must not leave an image above the input Nyquist frequency.
+    double frequency = pair.output < pair.input ? (pair.input + pair.output) / 4.0 : pair.input * 0.4;
+    GenerateTone(input, pair.input, frequency);
+    for (int round = 0; round < BENCHMARK_ROUNDS; ++round) {
+        resampler.Process(input.data() + round * frame_samples, frame_samples, output.data() + round * output_samples);
+    }
+    double stopband_db;
+    if (pair.output < pair.input) {
+        double input_power = 16384.0 * 16384.0 / 2;
+        double output_power = 0;
+        for (size_t i = output_samples; i < output.size(); ++i) {
+            output_power += (double)output[i] * output[i];
+        }
+        output_power /= output.size() - output_samples;
+        stopband_db = 10.0 * std::log10(std::max(output_power, 1e-9) / input_power);
+    } else {
+        MeasureTone(output.data() + output_samples, output.size() - output_samples, pair.output, frequency, signal, residual);
+        stopband_db = 10.0 * std::log10(residual / signal);
+    }
+
+    ESP_LOGI(TAG, "%5d -> %5d %-14s %4lld us per %d ms frame, 1 kHz SNR %5.1f dB, %s %6.1f dB",
+        pair.input, pair.output, name, elapsed_us / BENCHMARK_ROUNDS, BENCHMARK_FRAME_MS, snr_db,
+        pair.output < pair.input ? "alias" : "image", stopband_db);
+}
+
+void PolyphaseResamplerBenchmark() {
+    for (const auto& pair : BENCHMARK_RATE_PAIRS) {
+        OpusResampler opus_resampler;
+        opus_resampler.Configure(pair.input, pair.output);
+        RunBenchmark("opus", opus_resampler, pair);
+
+        PolyphaseResampler low;
+        low.Configure(pair.input, pair.output, kResamplerQualityLow);
+        RunBenchmark("polyphase_low", low, pair);
+
+        PolyphaseResampler high;
+        high.Configure(pair.input, pair.output, kResamplerQualityHigh);
+        RunBenchmark("polyphase_high", high, pair);
+    }
+}
+#endif
@@ -0,0 +1,67 @@
+#ifndef _POLYPHASE_RESAMPLER_H
+#define _POLYPHASE_RESAMPLER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+enum PolyphaseResamplerQuality {
+    kResamplerQualityLow,       // 8 taps per phase, wide transition band, 4 input samples of delay
+    kResamplerQualityHigh,      // 32 taps per phase, about 80 dB stopband, 16 input samples of delay
+};
+
+#if CONFIG_AUDIO_RESAMPLER_POLYPHASE_LOW
+#define POLYPHASE_RESAMPLER_DEFAULT_QUALITY kResamplerQualityLow
+#else
+#define POLYPHASE_RESAMPLER_DEFAULT_QUALITY kResamplerQualityHigh
+#endif
+
+// Fixed-point polyphase sample rate converter for any rational ratio, a drop-in for
+// OpusResampler. The Kaiser windowed sinc filter is computed in Configure, its phases are
+// stored as Q15 with a DC gain of exactly one. Process allocates nothing and writes to the
+// caller's buffer. Not thread safe, each stream needs its own instance.
+class PolyphaseResampler {
+public:
+    PolyphaseResampler() = default;
+    PolyphaseResampler(const PolyphaseResampler&) = delete;
+    PolyphaseResampler& operator=(const PolyphaseResampler&) = delete;
+
+    void Configure(int input_sample_rate, int output_sample_rate,
+        PolyphaseResamplerQuality quality = POLYPHASE_RESAMPLER_DEFAULT_QUALITY);
+    // Clears the filter history, e.g. between unrelated streams
+    void Reset();
+    // Returns the number of samples written to output, at most GetOutputSamples(input_samples)
+    int Process(const int16_t* input, int input_samples, int16_t* output);
+    // Exact when input_samples is a multiple of input_sample_rate / gcd(input, output), as
+    // every audio frame size is, otherwise the largest count Process may write
+    int GetOutputSamples(int input_samples) const;
+
+    int input_sample_rate() const { return input_sample_rate_; }
+    int output_sample_rate() const { return output_sample_rate_; }
+    int taps() const { return taps_; }
+
+private:
+    // Input samples copied behind the history per pass, bounds the work buffer
+    static constexpr int kChunkSamples = 512;
+
+    int input_sample_rate_ = 0;
+    int output_sample_rate_ = 0;
+    int up_ = 1;
+    int down_ = 1;
+    int taps_ = 0;
+    // up_ phases of taps_ coefficients, oldest input sample first
+    std::vector<int16_t> coefficients_;
+    // taps_ - 1 samples of history followed by one chunk of input
+    std::vector<int16_t> buffer_;
+    int phase_ = 0;
+    // Newest input sample of the next output, relative to the current chunk
+    int next_input_ = 0;
+};
+
+#if CONFIG_USE_RESAMPLER_BENCHMARK
+// Compares the CPU time and the quality of OpusResampler and both presets for the sample
+// rate pairs used by the boards and logs the results
+void PolyphaseResamplerBenchmark();
+#endif
+
+#endif // _POLYPHASE_RESAMPLER_H
@@ -0,0 +1,119 @@
+#include "audio_latency.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <cinttypes>
+
+#define TAG "AudioLatency"
+
+static const char* const STAGE_NAMES[] = {
+    "input_read",
+    "input_resample",
+    "afe",
+    "encode",
+    "send",
+    "uplink_total",
+    "decode_wait",
+    "decode",
+    "output_write",
+    "downlink_total",
+    "endpoint_stt",
+    "endpoint_tts",
+    "abort_silence"
+};
+
+int LatencyHistogram::BucketIndex(int64_t us) {
+    if (us <= 0) {
+        return 0;
+    }
+    uint32_t v = (uint32_t)std::min<int64_t>(us >> 6, UINT32_MAX);
+    if (v < 8) {
+        return v;
+    }
+    int exponent = 31 - __builtin_clz(v);
+    int sub = (v >> (exponent - 2)) & 3;
+    return std::min(8 + (exponent - 3) * 4 + sub, kBucketCount - 1);
+}
+
+int64_t LatencyHistogram::BucketUpperBound(int index) {
+    if (index < 8) {
+        return (int64_t)(index + 1) << 6;
+    }
+    int exponent = (index - 8) / 4 + 3;
+    int sub = (index - 8) % 4;
+    return ((int64_t)(5 + sub) << (exponent - 2)) << 6;
+}
+
+void LatencyHistogram::Record(int64_t us) {
+    buckets_[BucketIndex(us)].fetch_add(1, std::memory_order_relaxed);
+    int64_t max = max_us_.load(std::memory_order_relaxed);
+    while (us > max && !max_us_.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+    }
+}
+
+AudioLatencyStats LatencyHistogram::GetStats() const {
+    // Take a copy first, the counters keep moving while we walk them
+    uint32_t buckets[kBucketCount];
+    uint32_t count = 0;
+    for (int i = 0; i < kBucketCount; ++i) {
+        buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+        count += buckets[i];
+    }
+
+    AudioLatencyStats stats;
+    stats.count = count;
+    stats.max_us = max_us_.load(std::memory_order_relaxed);
+    if (count == 0) {
+        return stats;
+    }
+
+    const int percentiles[] = { 50, 95, 99 };
+    int64_t* results[] = { &stats.p50_us, &stats.p95_us, &stats.p99_us };
+    for (int p = 0; p < 3; ++p) {
+        uint32_t rank = (uint32_t)(((uint64_t)count * percentiles[p] + 99) / 100);
+        uint32_t cumulative = 0;
+        for (int i = 0; i < kBucketCount; ++i) {
+            cumulative += buckets[i];
+            if (cumulative >= rank) {
+                *results[p] = std::min(BucketUpperBound(i), stats.max_us);
+                break;
+            }
+        }
+    }
+    return stats;
+}
+
+void LatencyHistogram::Reset() {
+    for (auto& bucket : buckets_) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    max_us_.store(0, std::memory_order_relaxed);
+}
+
+int64_t AudioLatency::Stamp(AudioLatencyStage stage, int64_t since_us) {
+    int64_t now = esp_timer_get_time();
+    Record(stage, now - since_us);
+    return now;
+}
+
+void AudioLatency::Reset() {
+    for (auto& histogram : histograms_) {
+        histogram.Reset();
+    }
+}
+
+const char* AudioLatency::StageName(AudioLatencyStage stage) {
+    return STAGE_NAMES[stage];
+}
+
+void AudioLatency::PrintStats() {
+    for (int i = 0; i < kLatencyStageCount; ++i) {
+        auto stats = GetStats((AudioLatencyStage)i);
+        if (stats.count == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%s: count %" PRIu32 " p50 %lld us p95 %lld us p99 %lld us max %lld us",
+            STAGE_NAMES[i], stats.count, stats.p50_us, stats.p95_us, stats.p99_us, stats.max_us);
+    }
+}
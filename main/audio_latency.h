@@ -0,0 +1,78 @@
+#ifndef AUDIO_LATENCY_H
+#define AUDIO_LATENCY_H
+
+#include <atomic>
+#include <cstdint>
+
+// Uplink frames are timestamped when the I2S read returns, downlink packets when
+// they arrive from the protocol. Each stage measures the time since the previous
+// timestamp of the same frame, the totals measure the whole path.
+enum AudioLatencyStage {
+    kLatencyInputRead,          // Time blocked in AudioCodec::Read
+    kLatencyInputResample,      // I2S read -> resampled to 16 kHz
+    kLatencyAfe,                // I2S read -> fetched from the AFE
+    kLatencyEncode,             // AFE fetch (or I2S read without the AFE) -> Opus frame ready, includes the queue wait
+    kLatencySend,               // Encoded -> Protocol::SendAudio
+    kLatencyUplinkTotal,        // I2S read -> Protocol::SendAudio
+    kLatencyDecodeWait,         // Received -> decode job started
+    kLatencyDecode,             // Decode and resample
+    kLatencyOutputWrite,        // Decoded -> written to the DMA, the output ring depth when queued
+    kLatencyDownlinkTotal,      // Received -> written to the DMA
+    kLatencyEndpointStt,        // On-device end of utterance -> server "stt"
+    kLatencyEndpointTts,        // On-device end of utterance -> server "tts start"
+    kLatencyAbortSilence,       // Barge-in -> the speaker is silent
+    kLatencyStageCount
+};
+
+struct AudioLatencyStats {
+    uint32_t count = 0;
+    int64_t p50_us = 0;
+    int64_t p95_us = 0;
+    int64_t p99_us = 0;
+    int64_t max_us = 0;
+};
+
+// Log-linear histogram: 64 us resolution below 512 us, then 4 buckets per power of two
+// (about 25% resolution) up to 4 seconds. Record is lock free and may be called from any task.
+class LatencyHistogram {
+public:
+    static constexpr int kBucketCount = 60;
+
+    void Record(int64_t us);
+    AudioLatencyStats GetStats() const;
+    void Reset();
+
+    static int BucketIndex(int64_t us);
+    // Upper bound of the bucket, the reported percentiles are rounded up to it
+    static int64_t BucketUpperBound(int index);
+
+private:
+    std::atomic<uint32_t> buckets_[kBucketCount] = {};
+    std::atomic<int64_t> max_us_{0};
+};
+
+class AudioLatency {
+public:
+    static AudioLatency& GetInstance() {
+        static AudioLatency instance;
+        return instance;
+    }
+    AudioLatency(const AudioLatency&) = delete;
+    AudioLatency& operator=(const AudioLatency&) = delete;
+
+    void Record(AudioLatencyStage stage, int64_t us) { histograms_[stage].Record(us); }
+    // Records now - since_us and returns now, so the next stage can chain from it
+    int64_t Stamp(AudioLatencyStage stage, int64_t since_us);
+    AudioLatencyStats GetStats(AudioLatencyStage stage) const { return histograms_[stage].GetStats(); }
+    void Reset();
+    void PrintStats();
+
+    static const char* StageName(AudioLatencyStage stage);
+
+private:
+    AudioLatency() = default;
+
+    LatencyHistogram histograms_[kLatencyStageCount];
+};
+
+#endif // AUDIO_LATENCY_H
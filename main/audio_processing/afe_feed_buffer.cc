@@ -0,0 +1,52 @@
+#include "afe_feed_buffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+void AfeFeedBuffer::Configure(size_t chunk_samples, size_t chunk_count) {
+    chunk_samples_ = chunk_samples;
+    buffer_.assign(chunk_samples * chunk_count, 0);
+    Clear();
+}
+
+bool AfeFeedBuffer::Write(const int16_t* data, size_t samples) {
+    size_t capacity = buffer_.size();
+    bool dropped = false;
+    if (samples > capacity) {
+        // Only the newest samples fit
+        data += samples - capacity;
+        samples = capacity;
+    }
+    while (size_ + samples > capacity) {
+        size_t drop = std::min(chunk_samples_, size_);
+        read_ = (read_ + chunk_samples_) % capacity;
+        size_ -= drop;
+        dropped_chunks_++;
+        dropped = true;
+    }
+
+    size_t write = (read_ + size_) % capacity;
+    size_t first = std::min(samples, capacity - write);
+    memcpy(buffer_.data() + write, data, first * sizeof(int16_t));
+    memcpy(buffer_.data(), data + first, (samples - first) * sizeof(int16_t));
+    size_ += samples;
+    high_water_ = std::max(high_water_, size_);
+    return !dropped;
+}
+
+const int16_t* AfeFeedBuffer::PeekChunk() const {
+    if (chunk_samples_ == 0 || size_ < chunk_samples_) {
+        return nullptr;
+    }
+    return buffer_.data() + read_;
+}
+
+void AfeFeedBuffer::ConsumeChunk() {
+    read_ = (read_ + chunk_samples_) % buffer_.size();
+    size_ -= chunk_samples_;
+}
+
+void AfeFeedBuffer::Clear() {
+    read_ = 0;
+    size_ = 0;
+}
@@ -0,0 +1,39 @@
+#ifndef AFE_FEED_BUFFER_H
+#define AFE_FEED_BUFFER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Fixed capacity FIFO in front of an AFE feed(). The capacity is a whole number of feed
+// chunks and chunks are only consumed at chunk boundaries, so the next chunk is always
+// contiguous and is passed to feed() in place. Write is the only copy. Not thread safe,
+// the producer also consumes.
+class AfeFeedBuffer {
+public:
+    // Allocates chunk_samples * chunk_count samples, chunk_samples includes all channels
+    void Configure(size_t chunk_samples, size_t chunk_count);
+
+    // Appends samples. When there is no room the oldest whole chunks are dropped and false is returned.
+    bool Write(const int16_t* data, size_t samples);
+    // The next full chunk, or nullptr if less than a chunk is buffered
+    const int16_t* PeekChunk() const;
+    void ConsumeChunk();
+    void Clear();
+
+    size_t size() const { return size_; }
+    size_t capacity() const { return buffer_.size(); }
+    size_t chunk_samples() const { return chunk_samples_; }
+    size_t high_water() const { return high_water_; }
+    uint32_t dropped_chunks() const { return dropped_chunks_; }
+
+private:
+    std::vector<int16_t> buffer_;
+    size_t chunk_samples_ = 0;
+    size_t read_ = 0;           // Always on a chunk boundary
+    size_t size_ = 0;
+    size_t high_water_ = 0;
+    uint32_t dropped_chunks_ = 0;
+};
+
+#endif // AFE_FEED_BUFFER_H
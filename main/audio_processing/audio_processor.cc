@@ -1,7 +1,12 @@
 #include "audio_processor.h"
+#include "memory_accounting.h"
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <cinttypes>
 
 #define PROCESSOR_RUNNING 0x01
+// A 30 ms input frame never spans more than two 32 ms feed chunks, two more are headroom
+#define FEED_BUFFER_CHUNKS 4
 
 static const char* TAG = "AudioProcessor";
 
@@ -11,6 +16,7 @@ AudioProcessor::AudioProcessor()
 }
 
 void AudioProcessor::Initialize(int channels, bool reference) {
+    MemoryExternalScope memory_scope(kMemoryTagAfe);
     channels_ = channels;
     reference_ = reference;
     int ref_num = reference_ ? 1 : 0;
@@ -48,7 +54,9 @@ void AudioProcessor::Initialize(int channels, bool reference) {
     };
 
     afe_communication_data_ = esp_afe_vc_v1.create_from_config(&afe_config);
-    
+    input_buffer_.Configure(esp_afe_vc_v1.get_feed_chunksize(afe_communication_data_) * channels_, FEED_BUFFER_CHUNKS);
+    ESP_LOGI(TAG, "Feed buffer: %u samples", input_buffer_.capacity());
+
     xTaskCreate([](void* arg) {
         auto this_ = (AudioProcessor*)arg;
         this_->AudioProcessorTask();
@@ -63,14 +71,16 @@ AudioProcessor::~AudioProcessor() {
     vEventGroupDelete(event_group_);
 }
 
-void AudioProcessor::Input(const std::vector<int16_t>& data) {
-    input_buffer_.insert(input_buffer_.end(), data.begin(), data.end());
+void AudioProcessor::Input(const std::vector<int16_t>& data, int64_t capture_time_us) {
+    capture_times_.Push(data.size() / channels_, capture_time_us);
+    if (!input_buffer_.Write(data.data(), data.size())) {
+        ESP_LOGW(TAG, "Feed buffer overflow, %" PRIu32 " chunks dropped", input_buffer_.dropped_chunks());
+    }
 
-    auto feed_size = esp_afe_vc_v1.get_feed_chunksize(afe_communication_data_) * channels_;
-    while (input_buffer_.size() >= feed_size) {
-        auto chunk = input_buffer_.data();
+    const int16_t* chunk;
+    while ((chunk = input_buffer_.PeekChunk()) != nullptr) {
         esp_afe_vc_v1.feed(afe_communication_data_, chunk);
-        input_buffer_.erase(input_buffer_.begin(), input_buffer_.begin() + feed_size);
+        input_buffer_.ConsumeChunk();
     }
 }
 
@@ -86,11 +96,12 @@ bool AudioProcessor::IsRunning() {
     return xEventGroupGetBits(event_group_) & PROCESSOR_RUNNING;
 }
 
-void AudioProcessor::OnOutput(std::function<void(std::vector<int16_t>&& data)> callback) {
+void AudioProcessor::OnOutput(std::function<void(std::vector<int16_t>&& data, int64_t capture_time_us)> callback) {
     output_callback_ = callback;
 }
 
 void AudioProcessor::AudioProcessorTask() {
+    MemoryTagScope memory_tag_scope(kMemoryTagAfe);
     auto fetch_size = esp_afe_sr_v1.get_fetch_chunksize(afe_communication_data_);
     auto feed_size = esp_afe_sr_v1.get_feed_chunksize(afe_communication_data_);
     ESP_LOGI(TAG, "Audio communication task started, feed size: %d fetch size: %d",
@@ -100,18 +111,20 @@ void AudioProcessor::AudioProcessorTask() {
         xEventGroupWaitBits(event_group_, PROCESSOR_RUNNING, pdFALSE, pdTRUE, portMAX_DELAY);
 
         auto res = esp_afe_vc_v1.fetch(afe_communication_data_);
-        if ((xEventGroupGetBits(event_group_) & PROCESSOR_RUNNING) == 0) {
-            continue;
-        }
         if (res == nullptr || res->ret_value == ESP_FAIL) {
             if (res != nullptr) {
                 ESP_LOGI(TAG, "Error code: %d", res->ret_value);
             }
             continue;
         }
+        // Keep the frame count in step even for the output discarded below
+        int64_t capture_time_us = capture_times_.Pop(res->data_size / sizeof(int16_t));
+        if ((xEventGroupGetBits(event_group_) & PROCESSOR_RUNNING) == 0) {
+            continue;
+        }
 
         if (output_callback_) {
-            output_callback_(std::vector<int16_t>(res->data, res->data + res->data_size / sizeof(int16_t)));
+            output_callback_(std::vector<int16_t>(res->data, res->data + res->data_size / sizeof(int16_t)), capture_time_us);
         }
     }
 }
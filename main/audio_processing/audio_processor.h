@@ -2,6 +2,8 @@
 #define AUDIO_PROCESSOR_H
 
 #include <esp_afe_sr_models.h>
+#include "afe_feed_buffer.h"
+#include "capture_time_tracker.h"
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/event_groups.h>
@@ -16,20 +18,23 @@ public:
     ~AudioProcessor();
 
     void Initialize(int channels, bool reference);
-    void Input(const std::vector<int16_t>& data);
+    // capture_time_us is handed back with the output that contains the last sample of data
+    void Input(const std::vector<int16_t>& data, int64_t capture_time_us);
     void Start();
     void Stop();
     bool IsRunning();
-    void OnOutput(std::function<void(std::vector<int16_t>&& data)> callback);
+    void OnOutput(std::function<void(std::vector<int16_t>&& data, int64_t capture_time_us)> callback);
 
 private:
     EventGroupHandle_t event_group_ = nullptr;
     esp_afe_sr_data_t* afe_communication_data_ = nullptr;
-    std::vector<int16_t> input_buffer_;
-    std::function<void(std::vector<int16_t>&& data)> output_callback_;
+    AfeFeedBuffer input_buffer_;
+    std::function<void(std::vector<int16_t>&& data, int64_t capture_time_us)> output_callback_;
     int channels_;
     bool reference_;
 
+    CaptureTimeTracker capture_times_;
+
     void AudioProcessorTask();
 };
 
@@ -0,0 +1,35 @@
+#include "capture_time_tracker.h"
+
+#include <esp_timer.h>
+
+void CaptureTimeTracker::Push(size_t frames, int64_t capture_time_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    input_frames_ += frames;
+    if (count_ == kMaxInputStamps) {
+        PopFront();
+    }
+    stamps_[(head_ + count_) % kMaxInputStamps] = { input_frames_, capture_time_us };
+    count_++;
+}
+
+int64_t CaptureTimeTracker::Pop(size_t frames) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    output_frames_ += frames;
+    while (count_ > 0 && stamps_[head_].end_frame < output_frames_) {
+        PopFront();
+    }
+    if (count_ == 0) {
+        return esp_timer_get_time();
+    }
+    auto& front = stamps_[head_];
+    int64_t capture_time_us = front.capture_time_us;
+    if (front.end_frame == output_frames_) {
+        PopFront();
+    }
+    return capture_time_us;
+}
+
+void CaptureTimeTracker::PopFront() {
+    head_ = (head_ + 1) % kMaxInputStamps;
+    count_--;
+}
@@ -0,0 +1,37 @@
+#ifndef CAPTURE_TIME_TRACKER_H
+#define CAPTURE_TIME_TRACKER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// The AFE outputs one sample per input frame, so frame counts map its output back to the
+// input chunks and their capture times. Push is called by the feeding task, Pop by the
+// fetching task.
+class CaptureTimeTracker {
+public:
+    // frames were fed, the last of them was captured at capture_time_us
+    void Push(size_t frames, int64_t capture_time_us);
+    // frames were fetched, returns the capture time of the input chunk holding the last of them
+    int64_t Pop(size_t frames);
+
+private:
+    struct InputStamp {
+        uint64_t end_frame;
+        int64_t capture_time_us;
+    };
+
+    static constexpr size_t kMaxInputStamps = 64;
+    std::mutex mutex_;
+    // Fixed ring, the oldest stamp is dropped when it is full
+    std::array<InputStamp, kMaxInputStamps> stamps_;
+    size_t head_ = 0;
+    size_t count_ = 0;
+    uint64_t input_frames_ = 0;
+    uint64_t output_frames_ = 0;
+
+    void PopFront();
+};
+
+#endif // CAPTURE_TIME_TRACKER_H
@@ -0,0 +1,102 @@
+#include "endpointer.h"
+
+#include <esp_log.h>
+#include <cmath>
+
+#define TAG "Endpointer"
+
+// Energy of a silent frame, keeps the log finite for digital silence
+#define MIN_ENERGY_DB -96.0f
+
+void Endpointer::Configure(int sample_rate, const EndpointerConfig& config) {
+    samples_per_ms_ = sample_rate / 1000;
+    config_ = config;
+    noise_floor_valid_ = false;
+    Reset();
+}
+
+void Endpointer::Reset() {
+    state_ = kWaitingForSpeech;
+    speech_ms_ = 0;
+    silence_ms_ = 0;
+    utterance_ms_ = 0;
+}
+
+float Endpointer::FrameEnergyDb(const int16_t* data, size_t samples) {
+    if (samples == 0) {
+        return MIN_ENERGY_DB;
+    }
+    int64_t sum = 0;
+    for (size_t i = 0; i < samples; i++) {
+        sum += (int32_t)data[i] * data[i];
+    }
+    float mean = (float)sum / samples / (32768.0f * 32768.0f);
+    if (mean <= 0.0f) {
+        return MIN_ENERGY_DB;
+    }
+    return std::fmax(10.0f * std::log10(mean), MIN_ENERGY_DB);
+}
+
+void Endpointer::UpdateNoiseFloor(float energy_db) {
+    if (!noise_floor_valid_) {
+        noise_floor_db_ = energy_db;
+        noise_floor_valid_ = true;
+        return;
+    }
+    // Follow the floor down quickly and up slowly, so speech does not raise it
+    if (energy_db < noise_floor_db_) {
+        noise_floor_db_ += (energy_db - noise_floor_db_) * 0.5f;
+    } else {
+        noise_floor_db_ += (energy_db - noise_floor_db_) * 0.02f;
+    }
+}
+
+bool Endpointer::Process(const int16_t* data, size_t samples, bool speech) {
+    if (state_ == kEnded) {
+        return false;
+    }
+
+    int frame_ms = samples / samples_per_ms_;
+    float energy_db = FrameEnergyDb(data, samples);
+    if (!speech) {
+        UpdateNoiseFloor(energy_db);
+    }
+    bool loud = energy_db > noise_floor_db_ + config_.energy_margin_db;
+    bool voiced = speech && loud;
+    bool silent = !speech && !loud;
+
+    if (state_ == kWaitingForSpeech) {
+        if (voiced) {
+            speech_ms_ += frame_ms;
+            if (speech_ms_ >= config_.min_speech_ms) {
+                state_ = kInUtterance;
+                utterance_ms_ = speech_ms_;
+                ESP_LOGD(TAG, "Utterance started, noise floor %.1f dB", noise_floor_db_);
+            }
+        } else if (silent) {
+            speech_ms_ = 0;
+        }
+        return false;
+    }
+
+    utterance_ms_ += frame_ms;
+    if (voiced) {
+        speech_ms_ += frame_ms;
+        silence_ms_ = 0;
+    } else if (silent) {
+        silence_ms_ += frame_ms;
+    }
+
+    int end_silence_ms = config_.end_silence_ms;
+    if (speech_ms_ < config_.short_utterance_ms) {
+        end_silence_ms += end_silence_ms / 2;
+    }
+    bool timeout = config_.max_utterance_ms > 0 && utterance_ms_ >= config_.max_utterance_ms;
+    if (silence_ms_ >= end_silence_ms || timeout) {
+        state_ = kEnded;
+        ESP_LOGI(TAG, "End of utterance, speech %d ms, silence %d ms%s", speech_ms_, silence_ms_,
+            timeout ? ", max length reached" : "");
+        return true;
+    }
+    return false;
+}
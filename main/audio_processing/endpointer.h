@@ -0,0 +1,59 @@
+#ifndef ENDPOINTER_H
+#define ENDPOINTER_H
+
+#include <cstddef>
+#include <cstdint>
+
+struct EndpointerConfig {
+    // Voiced audio needed before an utterance counts as started, filters coughs and clicks
+    int min_speech_ms = 300;
+    // Trailing silence that ends the utterance
+    int end_silence_ms = 700;
+    // Utterances with less speech than this wait half as long again, a single word is often
+    // followed by a pause before the rest of the request
+    int short_utterance_ms = 1000;
+    // Ends the utterance regardless of silence, 0 disables it
+    int max_utterance_ms = 0;
+    // Frames this far above the noise floor are not counted as silence even if the VAD says so
+    int energy_margin_db = 8;
+};
+
+// End of utterance detection on the AFE output. A frame is voiced when the VAD reports
+// speech and its energy is above the noise floor, and silent when the VAD reports no speech
+// and the energy is near the floor. Frames in between, like breathing or a VAD that lags the
+// signal, neither extend the speech nor count towards the trailing silence. Called by the
+// AFE task only.
+class Endpointer {
+public:
+    void Configure(int sample_rate, const EndpointerConfig& config);
+    // Starts a new utterance, keeps the noise floor
+    void Reset();
+    // Returns true once, for the frame that ends the utterance
+    bool Process(const int16_t* data, size_t samples, bool speech);
+
+    bool ended() const { return state_ == kEnded; }
+    int speech_ms() const { return speech_ms_; }
+    int trailing_silence_ms() const { return silence_ms_; }
+    float noise_floor_db() const { return noise_floor_db_; }
+
+private:
+    enum State {
+        kWaitingForSpeech,
+        kInUtterance,
+        kEnded,
+    };
+
+    EndpointerConfig config_;
+    int samples_per_ms_ = 16;
+    State state_ = kWaitingForSpeech;
+    int speech_ms_ = 0;
+    int silence_ms_ = 0;
+    int utterance_ms_ = 0;
+    float noise_floor_db_ = 0.0f;
+    bool noise_floor_valid_ = false;
+
+    static float FrameEnergyDb(const int16_t* data, size_t samples);
+    void UpdateNoiseFloor(float energy_db);
+};
+
+#endif // ENDPOINTER_H
@@ -0,0 +1,92 @@
+#include "opus_packet_ring.h"
+
+#include <esp_heap_caps.h>
+#include <algorithm>
+#include <cstring>
+
+#define LENGTH_SIZE sizeof(uint16_t)
+
+OpusPacketRing::~OpusPacketRing() {
+    heap_caps_free(buffer_);
+}
+
+void OpusPacketRing::Configure(size_t capacity_bytes, size_t max_packets) {
+    heap_caps_free(buffer_);
+    buffer_ = (uint8_t*)heap_caps_malloc(capacity_bytes, MALLOC_CAP_SPIRAM);
+    if (buffer_ == nullptr) {
+        buffer_ = (uint8_t*)heap_caps_malloc(capacity_bytes, MALLOC_CAP_8BIT);
+    }
+    capacity_ = buffer_ != nullptr ? capacity_bytes : 0;
+    max_packets_ = max_packets;
+    Clear();
+}
+
+void OpusPacketRing::SetMaxPackets(size_t max_packets) {
+    max_packets_ = max_packets;
+    while (packets_ > max_packets_) {
+        DropFront();
+    }
+}
+
+bool OpusPacketRing::Push(const uint8_t* data, size_t size) {
+    size_t needed = LENGTH_SIZE + size;
+    if (size > UINT16_MAX || needed > capacity_ || max_packets_ == 0) {
+        dropped_packets_++;
+        return false;
+    }
+
+    bool dropped = false;
+    while (size_ + needed > capacity_ || packets_ >= max_packets_) {
+        DropFront();
+        dropped = true;
+    }
+
+    uint16_t length = size;
+    size_t write = (read_ + size_) % capacity_;
+    CopyIn(write, (const uint8_t*)&length, LENGTH_SIZE);
+    CopyIn((write + LENGTH_SIZE) % capacity_, data, size);
+    size_ += needed;
+    packets_++;
+    return !dropped;
+}
+
+bool OpusPacketRing::Pop(std::vector<uint8_t>& packet) {
+    if (packets_ == 0) {
+        return false;
+    }
+    uint16_t length;
+    CopyOut(read_, (uint8_t*)&length, LENGTH_SIZE);
+    packet.resize(length);
+    CopyOut((read_ + LENGTH_SIZE) % capacity_, packet.data(), length);
+    read_ = (read_ + LENGTH_SIZE + length) % capacity_;
+    size_ -= LENGTH_SIZE + length;
+    packets_--;
+    return true;
+}
+
+void OpusPacketRing::Clear() {
+    read_ = 0;
+    size_ = 0;
+    packets_ = 0;
+}
+
+void OpusPacketRing::DropFront() {
+    uint16_t length;
+    CopyOut(read_, (uint8_t*)&length, LENGTH_SIZE);
+    read_ = (read_ + LENGTH_SIZE + length) % capacity_;
+    size_ -= LENGTH_SIZE + length;
+    packets_--;
+    dropped_packets_++;
+}
+
+void OpusPacketRing::CopyIn(size_t offset, const uint8_t* data, size_t size) {
+    size_t first = std::min(size, capacity_ - offset);
+    memcpy(buffer_ + offset, data, first);
+    memcpy(buffer_, data + first, size - first);
+}
+
+void OpusPacketRing::CopyOut(size_t offset, uint8_t* data, size_t size) const {
+    size_t first = std::min(size, capacity_ - offset);
+    memcpy(data, buffer_ + offset, first);
+    memcpy(data + first, buffer_, size - first);
+}
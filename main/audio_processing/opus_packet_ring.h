@@ -0,0 +1,45 @@
+#ifndef OPUS_PACKET_RING_H
+#define OPUS_PACKET_RING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Fixed capacity FIFO of Opus packets in one buffer, preferably in PSRAM. Each packet is
+// stored as a 16 bit length followed by the payload and may wrap around the end. Push
+// drops the oldest packets until the new one fits in both the bytes and the packet limit.
+// Not thread safe.
+class OpusPacketRing {
+public:
+    OpusPacketRing() = default;
+    ~OpusPacketRing();
+    OpusPacketRing(const OpusPacketRing&) = delete;
+    OpusPacketRing& operator=(const OpusPacketRing&) = delete;
+
+    void Configure(size_t capacity_bytes, size_t max_packets);
+    void SetMaxPackets(size_t max_packets);
+
+    // Returns false if older packets were dropped to make room
+    bool Push(const uint8_t* data, size_t size);
+    bool Pop(std::vector<uint8_t>& packet);
+    void Clear();
+
+    size_t packets() const { return packets_; }
+    size_t bytes() const { return size_; }
+    uint32_t dropped_packets() const { return dropped_packets_; }
+
+private:
+    uint8_t* buffer_ = nullptr;
+    size_t capacity_ = 0;
+    size_t max_packets_ = 0;
+    size_t read_ = 0;
+    size_t size_ = 0;
+    size_t packets_ = 0;
+    uint32_t dropped_packets_ = 0;
+
+    void CopyIn(size_t offset, const uint8_t* data, size_t size);
+    void CopyOut(size_t offset, uint8_t* data, size_t size) const;
+    void DropFront();
+};
+
+#endif // OPUS_PACKET_RING_H
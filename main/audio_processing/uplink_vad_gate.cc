@@ -0,0 +1,70 @@
+#include "uplink_vad_gate.h"
+
+#include <esp_log.h>
+
+#define TAG "UplinkVadGate"
+
+void UplinkVadGate::Configure(int sample_rate, int hangover_ms, int lookback_ms) {
+    samples_per_ms_ = sample_rate / 1000;
+    hangover_samples_ = hangover_ms * samples_per_ms_;
+    lookback_samples_ = lookback_ms * samples_per_ms_;
+    Reset();
+}
+
+void UplinkVadGate::Reset() {
+    for (auto& frame : held_) {
+        frame.data.clear();
+    }
+    held_head_ = 0;
+    held_count_ = 0;
+    held_samples_ = 0;
+    silent_samples_ = 0;
+    open_ = true;
+}
+
+void UplinkVadGate::ReleaseOldest(const FrameHandler& handler, bool open) {
+    auto& frame = held_[held_head_];
+    held_head_ = (held_head_ + 1) % kMaxHeldFrames;
+    held_count_--;
+    held_samples_ -= frame.data.size();
+    handler(std::move(frame.data), frame.capture_time_us, open);
+}
+
+void UplinkVadGate::Process(std::vector<int16_t>&& data, int64_t capture_time_us, bool speech, const FrameHandler& handler) {
+    if (speech) {
+        silent_samples_ = 0;
+        if (!open_) {
+            open_ = true;
+            ESP_LOGD(TAG, "Open, %u held samples", held_samples_);
+            while (held_count_ > 0) {
+                ReleaseOldest(handler, true);
+            }
+        }
+        handler(std::move(data), capture_time_us, true);
+        return;
+    }
+
+    if (open_) {
+        silent_samples_ += data.size();
+        if (silent_samples_ <= hangover_samples_) {
+            handler(std::move(data), capture_time_us, true);
+            return;
+        }
+        open_ = false;
+        ESP_LOGD(TAG, "Closed after %u silent samples", silent_samples_);
+    }
+
+    // Hold the frame, the oldest held frames leave the lookback as silence
+    while (held_count_ > 0 && (held_count_ == kMaxHeldFrames || held_samples_ + data.size() > lookback_samples_)) {
+        ReleaseOldest(handler, false);
+    }
+    if (data.size() > lookback_samples_) {
+        handler(std::move(data), capture_time_us, false);
+        return;
+    }
+    auto& frame = held_[(held_head_ + held_count_) % kMaxHeldFrames];
+    frame.data = std::move(data);
+    frame.capture_time_us = capture_time_us;
+    held_count_++;
+    held_samples_ += frame.data.size();
+}
@@ -0,0 +1,47 @@
+#ifndef UPLINK_VAD_GATE_H
+#define UPLINK_VAD_GATE_H
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Hangover and lookback around the AFE voice activity for the uplink. The gate opens on
+// speech and closes once there has been no speech for the hangover. While it is closed the
+// newest frames are held back, and when it opens they are released before the current frame,
+// so the start of speech, which the VAD reports late, is not lost. Every frame reaches the
+// handler exactly once and in order. Called by the AFE task only.
+class UplinkVadGate {
+public:
+    // open is false for frames released while the gate is closed
+    using FrameHandler = std::function<void(std::vector<int16_t>&& data, int64_t capture_time_us, bool open)>;
+
+    void Configure(int sample_rate, int hangover_ms, int lookback_ms);
+    // Opens the gate and drops the held frames, e.g. when listening starts
+    void Reset();
+    void Process(std::vector<int16_t>&& data, int64_t capture_time_us, bool speech, const FrameHandler& handler);
+
+    bool is_open() const { return open_; }
+
+private:
+    struct HeldFrame {
+        std::vector<int16_t> data;
+        int64_t capture_time_us;
+    };
+
+    static constexpr size_t kMaxHeldFrames = 16;
+    std::array<HeldFrame, kMaxHeldFrames> held_;
+    size_t held_head_ = 0;
+    size_t held_count_ = 0;
+    size_t held_samples_ = 0;
+
+    int samples_per_ms_ = 16;
+    size_t hangover_samples_ = 0;
+    size_t lookback_samples_ = 0;
+    size_t silent_samples_ = 0;
+    bool open_ = true;
+
+    void ReleaseOldest(const FrameHandler& handler, bool open);
+};
+
+#endif // UPLINK_VAD_GATE_H
@@ -1,19 +1,22 @@
 #include "wake_word_detect.h"
 #include "application.h"
+#include "memory_accounting.h"
 
 #include <esp_log.h>
 #include <model_path.h>
 #include <arpa/inet.h>
 #include <sstream>
+#include <cinttypes>
 
 #define DETECTION_RUNNING_EVENT 1
+#define OUTPUT_RUNNING_EVENT 2
+// A 30 ms input frame never spans more than two 32 ms feed chunks, two more are headroom
+#define FEED_BUFFER_CHUNKS 4
 
 static const char* TAG = "WakeWordDetect";
 
 WakeWordDetect::WakeWordDetect()
-    : afe_detection_data_(nullptr),
-      wake_word_pcm_(),
-      wake_word_opus_() {
+    : afe_detection_data_(nullptr) {
 
     event_group_ = xEventGroupCreate();
 }
@@ -23,14 +26,11 @@ WakeWordDetect::~WakeWordDetect() {
         esp_afe_sr_v1.destroy(afe_detection_data_);
     }
 
-    if (wake_word_encode_task_stack_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_stack_);
-    }
-
     vEventGroupDelete(event_group_);
 }
 
 void WakeWordDetect::Initialize(int channels, bool reference) {
+    MemoryExternalScope memory_scope(kMemoryTagAfe);
     channels_ = channels;
     reference_ = reference;
     int ref_num = reference_ ? 1 : 0;
@@ -83,6 +83,9 @@ void WakeWordDetect::Initialize(int channels, bool reference) {
     };
 
     afe_detection_data_ = esp_afe_sr_v1.create_from_config(&afe_config);
+    input_buffer_.Configure(esp_afe_sr_v1.get_feed_chunksize(afe_detection_data_) * channels_, FEED_BUFFER_CHUNKS);
+    ESP_LOGI(TAG, "Feed buffer: %u samples", input_buffer_.capacity());
+    wake_word_pre_roll_.Initialize();
 
     xTaskCreate([](void* arg) {
         auto this_ = (WakeWordDetect*)arg;
@@ -100,43 +103,81 @@ void WakeWordDetect::OnVadStateChange(std::function<void(bool speaking)> callbac
 }
 
 void WakeWordDetect::StartDetection() {
+    // The audio before a pause in detection does not belong to the next wake word
+    wake_word_pre_roll_.Reset();
+    if (afe_detection_data_ != nullptr) {
+        esp_afe_sr_v1.enable_wakenet(afe_detection_data_);
+    }
     xEventGroupSetBits(event_group_, DETECTION_RUNNING_EVENT);
 }
 
 void WakeWordDetect::StopDetection() {
     xEventGroupClearBits(event_group_, DETECTION_RUNNING_EVENT);
+    // WakeNet is the most expensive stage, skip it while only the output is used
+    if (afe_detection_data_ != nullptr) {
+        esp_afe_sr_v1.disable_wakenet(afe_detection_data_);
+    }
 }
 
 bool WakeWordDetect::IsDetectionRunning() {
     return xEventGroupGetBits(event_group_) & DETECTION_RUNNING_EVENT;
 }
 
-void WakeWordDetect::Feed(const std::vector<int16_t>& data) {
-    input_buffer_.insert(input_buffer_.end(), data.begin(), data.end());
+bool WakeWordDetect::IsRunning() {
+    return xEventGroupGetBits(event_group_) & (DETECTION_RUNNING_EVENT | OUTPUT_RUNNING_EVENT);
+}
+
+void WakeWordDetect::OnOutput(std::function<void(std::vector<int16_t>&& data, int64_t capture_time_us, bool speech)> callback) {
+    output_callback_ = callback;
+}
+
+void WakeWordDetect::StartOutput() {
+    xEventGroupSetBits(event_group_, OUTPUT_RUNNING_EVENT);
+}
+
+void WakeWordDetect::StopOutput() {
+    xEventGroupClearBits(event_group_, OUTPUT_RUNNING_EVENT);
+}
+
+bool WakeWordDetect::IsOutputRunning() {
+    return xEventGroupGetBits(event_group_) & OUTPUT_RUNNING_EVENT;
+}
+
+void WakeWordDetect::Feed(const std::vector<int16_t>& data, int64_t capture_time_us) {
+    capture_times_.Push(data.size() / channels_, capture_time_us);
+    if (!input_buffer_.Write(data.data(), data.size())) {
+        ESP_LOGW(TAG, "Feed buffer overflow, %" PRIu32 " chunks dropped", input_buffer_.dropped_chunks());
+    }
 
-    auto feed_size = esp_afe_sr_v1.get_feed_chunksize(afe_detection_data_) * channels_;
-    while (input_buffer_.size() >= feed_size) {
-        esp_afe_sr_v1.feed(afe_detection_data_, input_buffer_.data());
-        input_buffer_.erase(input_buffer_.begin(), input_buffer_.begin() + feed_size);
+    const int16_t* chunk;
+    while ((chunk = input_buffer_.PeekChunk()) != nullptr) {
+        esp_afe_sr_v1.feed(afe_detection_data_, chunk);
+        input_buffer_.ConsumeChunk();
     }
 }
 
 void WakeWordDetect::AudioDetectionTask() {
+    MemoryTagScope memory_tag_scope(kMemoryTagAfe);
     auto fetch_size = esp_afe_sr_v1.get_fetch_chunksize(afe_detection_data_);
     auto feed_size = esp_afe_sr_v1.get_feed_chunksize(afe_detection_data_);
     ESP_LOGI(TAG, "Audio detection task started, feed size: %d fetch size: %d",
         feed_size, fetch_size);
 
     while (true) {
-        xEventGroupWaitBits(event_group_, DETECTION_RUNNING_EVENT, pdFALSE, pdTRUE, portMAX_DELAY);
+        xEventGroupWaitBits(event_group_, DETECTION_RUNNING_EVENT | OUTPUT_RUNNING_EVENT, pdFALSE, pdFALSE, portMAX_DELAY);
 
         auto res = esp_afe_sr_v1.fetch(afe_detection_data_);
         if (res == nullptr || res->ret_value == ESP_FAIL) {
             continue;;
         }
+        // Keep the frame count in step even for the output discarded below
+        int64_t capture_time_us = capture_times_.Pop(res->data_size / sizeof(int16_t));
+        auto bits = xEventGroupGetBits(event_group_);
 
-        // Store the wake word data for voice recognition, like who is speaking
-        StoreWakeWordData((uint16_t*)res->data, res->data_size / sizeof(uint16_t));
+        if ((bits & OUTPUT_RUNNING_EVENT) && output_callback_) {
+            output_callback_(std::vector<int16_t>(res->data, res->data + res->data_size / sizeof(int16_t)), capture_time_us,
+                res->vad_state == AFE_VAD_SPEECH);
+        }
 
         // VAD state change
         if (vad_state_change_callback_) {
@@ -149,6 +190,13 @@ void WakeWordDetect::AudioDetectionTask() {
             }
         }
 
+        if ((bits & DETECTION_RUNNING_EVENT) == 0) {
+            continue;
+        }
+
+        // Store the wake word data for voice recognition, like who is speaking
+        StoreWakeWordData(res->data, res->data_size / sizeof(int16_t));
+
         if (res->wakeup_state == WAKENET_DETECTED) {
             StopDetection();
             last_detected_wake_word_ = wake_words_[res->wake_word_index - 1];
@@ -160,54 +208,18 @@ void WakeWordDetect::AudioDetectionTask() {
     }
 }
 
-void WakeWordDetect::StoreWakeWordData(uint16_t* data, size_t samples) {
-    // store audio data to wake_word_pcm_
-    wake_word_pcm_.emplace_back(std::vector<int16_t>(data, data + samples));
-    // keep about 2 seconds of data, detect duration is 32ms (sample_rate == 16000, chunksize == 512)
-    while (wake_word_pcm_.size() > 2000 / 32) {
-        wake_word_pcm_.pop_front();
-    }
+void WakeWordDetect::StoreWakeWordData(const int16_t* data, size_t samples) {
+    wake_word_pre_roll_.Write(data, samples);
 }
 
-void WakeWordDetect::EncodeWakeWordData() {
-    wake_word_opus_.clear();
-    if (wake_word_encode_task_stack_ == nullptr) {
-        wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(4096 * 8, MALLOC_CAP_SPIRAM);
-    }
-    wake_word_encode_task_ = xTaskCreateStatic([](void* arg) {
-        auto this_ = (WakeWordDetect*)arg;
-        {
-            auto start_time = esp_timer_get_time();
-            auto encoder = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
-            encoder->SetComplexity(0); // 0 is the fastest
-
-            for (auto& pcm: this_->wake_word_pcm_) {
-                encoder->Encode(std::move(pcm), [this_](std::vector<uint8_t>&& opus) {
-                    std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-                    this_->wake_word_opus_.emplace_back(std::move(opus));
-                    this_->wake_word_cv_.notify_all();
-                });
-            }
-            this_->wake_word_pcm_.clear();
-
-            auto end_time = esp_timer_get_time();
-            ESP_LOGI(TAG, "Encode wake word opus %zu packets in %lld ms",
-                this_->wake_word_opus_.size(), (end_time - start_time) / 1000);
+void WakeWordDetect::SetWakeWordFrameDuration(int duration_ms) {
+    wake_word_pre_roll_.SetFrameDuration(duration_ms);
+}
 
-            std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-            this_->wake_word_opus_.push_back(std::vector<uint8_t>());
-            this_->wake_word_cv_.notify_all();
-        }
-        vTaskDelete(NULL);
-    }, "encode_detect_packets", 4096 * 8, this, 2, wake_word_encode_task_stack_, &wake_word_encode_task_buffer_);
+void WakeWordDetect::EncodeWakeWordData() {
+    wake_word_pre_roll_.Finish();
 }
 
 bool WakeWordDetect::GetWakeWordOpus(std::vector<uint8_t>& opus) {
-    std::unique_lock<std::mutex> lock(wake_word_mutex_);
-    wake_word_cv_.wait(lock, [this]() {
-        return !wake_word_opus_.empty();
-    });
-    opus.swap(wake_word_opus_.front());
-    wake_word_opus_.pop_front();
-    return !opus.empty();
+    return wake_word_pre_roll_.Read(opus);
 }
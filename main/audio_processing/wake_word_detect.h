@@ -7,14 +7,13 @@
 
 #include <esp_afe_sr_models.h>
 #include <esp_nsn_models.h>
+#include "afe_feed_buffer.h"
+#include "capture_time_tracker.h"
+#include "wake_word_pre_roll.h"
 
-#include <list>
 #include <string>
 #include <vector>
 #include <functional>
-#include <mutex>
-#include <condition_variable>
-
 
 class WakeWordDetect {
 public:
@@ -22,13 +21,26 @@ public:
     ~WakeWordDetect();
 
     void Initialize(int channels, bool reference);
-    void Feed(const std::vector<int16_t>& data);
+    // Feed while IsRunning(), capture_time_us is handed back with the output
+    void Feed(const std::vector<int16_t>& data, int64_t capture_time_us);
     void OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback);
     void OnVadStateChange(std::function<void(bool speaking)> callback);
     void StartDetection();
     void StopDetection();
     bool IsDetectionRunning();
+    // True while the AFE is needed for detection or for the output
+    bool IsRunning();
+
+    // With CONFIG_USE_SHARED_AUDIO_FRONT_END the processed (AEC / SE / NS) audio of the same AFE
+    // replaces AudioProcessor for the uplink, so each input frame goes through one AFE only.
+    // speech is the VAD state of the frame.
+    void OnOutput(std::function<void(std::vector<int16_t>&& data, int64_t capture_time_us, bool speech)> callback);
+    void StartOutput();
+    void StopOutput();
+    bool IsOutputRunning();
+    // The wake word audio is encoded continuously, this finishes the last frames, read them with GetWakeWordOpus
     void EncodeWakeWordData();
+    void SetWakeWordFrameDuration(int duration_ms);
     bool GetWakeWordOpus(std::vector<uint8_t>& opus);
     const std::string& GetLastDetectedWakeWord() const { return last_detected_wake_word_; }
 
@@ -36,24 +48,20 @@ private:
     esp_afe_sr_data_t* afe_detection_data_ = nullptr;
     char* wakenet_model_ = NULL;
     std::vector<std::string> wake_words_;
-    std::vector<int16_t> input_buffer_;
+    AfeFeedBuffer input_buffer_;
     EventGroupHandle_t event_group_;
     std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
     std::function<void(bool speaking)> vad_state_change_callback_;
+    std::function<void(std::vector<int16_t>&& data, int64_t capture_time_us, bool speech)> output_callback_;
+    CaptureTimeTracker capture_times_;
     bool is_speaking_ = false;
     int channels_;
     bool reference_;
     std::string last_detected_wake_word_;
 
-    TaskHandle_t wake_word_encode_task_ = nullptr;
-    StaticTask_t wake_word_encode_task_buffer_;
-    StackType_t* wake_word_encode_task_stack_ = nullptr;
-    std::list<std::vector<int16_t>> wake_word_pcm_;
-    std::list<std::vector<uint8_t>> wake_word_opus_;
-    std::mutex wake_word_mutex_;
-    std::condition_variable wake_word_cv_;
+    WakeWordPreRoll wake_word_pre_roll_;
 
-    void StoreWakeWordData(uint16_t* data, size_t size);
+    void StoreWakeWordData(const int16_t* data, size_t samples);
     void AudioDetectionTask();
 };
 
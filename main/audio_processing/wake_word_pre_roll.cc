@@ -0,0 +1,183 @@
+#include "wake_word_pre_roll.h"
+#include "memory_accounting.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <algorithm>
+#include <cstring>
+#include <cinttypes>
+
+#define TAG "WakeWordPreRoll"
+
+#define PRE_ROLL_DURATION_MS 2000
+// Room for 2 seconds at up to 64 kbps
+#define PRE_ROLL_PACKET_BYTES (16 * 1024)
+// PCM waiting for the encoder, four frames of the longest duration
+#define PRE_ROLL_PCM_SAMPLES (16000 / 1000 * 60 * 4)
+#define PRE_ROLL_ENCODE_TASK_STACK_SIZE (4096 * 8)
+
+WakeWordPreRoll::~WakeWordPreRoll() {
+    if (encode_task_ != nullptr) {
+        vTaskDelete(encode_task_);
+    }
+    heap_caps_free(encode_task_stack_);
+    heap_caps_free(pcm_);
+}
+
+void WakeWordPreRoll::Initialize() {
+    pcm_ = (int16_t*)heap_caps_malloc(PRE_ROLL_PCM_SAMPLES * sizeof(int16_t), MALLOC_CAP_SPIRAM);
+    if (pcm_ == nullptr) {
+        pcm_ = (int16_t*)heap_caps_malloc(PRE_ROLL_PCM_SAMPLES * sizeof(int16_t), MALLOC_CAP_8BIT);
+    }
+    pcm_capacity_ = pcm_ != nullptr ? PRE_ROLL_PCM_SAMPLES : 0;
+    packets_.Configure(PRE_ROLL_PACKET_BYTES, PRE_ROLL_DURATION_MS / frame_duration_ms_);
+
+    // A stack in PSRAM needs CONFIG_SPIRAM_ALLOW_STACK_EXTERNAL_MEMORY, same as AudioWorker
+#if CONFIG_SPIRAM_ALLOW_STACK_EXTERNAL_MEMORY
+    encode_task_stack_ = (StackType_t*)heap_caps_malloc(PRE_ROLL_ENCODE_TASK_STACK_SIZE, MALLOC_CAP_SPIRAM);
+#endif
+    if (encode_task_stack_ == nullptr) {
+        encode_task_stack_ = (StackType_t*)heap_caps_malloc(PRE_ROLL_ENCODE_TASK_STACK_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+    if (encode_task_stack_ == nullptr) {
+        // Without the encode task Write drops everything and Finish reports no packets
+        ESP_LOGE(TAG, "Failed to allocate the encode task stack, pre-roll disabled");
+        pcm_capacity_ = 0;
+        return;
+    }
+    // Below the detection task, encoding may fall behind for a frame but never delays detection
+    encode_task_ = xTaskCreateStatic([](void* arg) {
+        auto this_ = (WakeWordPreRoll*)arg;
+        this_->EncodeTask();
+        vTaskDelete(NULL);
+    }, "encode_pre_roll", PRE_ROLL_ENCODE_TASK_STACK_SIZE, this, 1, encode_task_stack_, &encode_task_buffer_);
+}
+
+void WakeWordPreRoll::SetFrameDuration(int duration_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // A pre-roll may be on its way to the server, switching now would drop its packets
+    next_frame_duration_ms_ = duration_ms;
+}
+
+void WakeWordPreRoll::Write(const int16_t* data, size_t samples) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (pcm_capacity_ == 0) {
+            return;
+        }
+        if (samples > pcm_capacity_) {
+            dropped_samples_ += samples - pcm_capacity_;
+            data += samples - pcm_capacity_;
+            samples = pcm_capacity_;
+        }
+        // The encoder fell behind, drop the oldest audio
+        if (pcm_size_ + samples > pcm_capacity_) {
+            size_t drop = pcm_size_ + samples - pcm_capacity_;
+            pcm_read_ = (pcm_read_ + drop) % pcm_capacity_;
+            pcm_size_ -= drop;
+            dropped_samples_ += drop;
+        }
+
+        size_t write = (pcm_read_ + pcm_size_) % pcm_capacity_;
+        size_t first = std::min(samples, pcm_capacity_ - write);
+        memcpy(pcm_ + write, data, first * sizeof(int16_t));
+        memcpy(pcm_, data + first, (samples - first) * sizeof(int16_t));
+        pcm_size_ += samples;
+    }
+    xTaskNotifyGive(encode_task_);
+}
+
+void WakeWordPreRoll::Finish() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        finishing_ = true;
+        finished_ = encode_task_ == nullptr;
+        if (finished_) {
+            return;
+        }
+    }
+    xTaskNotifyGive(encode_task_);
+}
+
+bool WakeWordPreRoll::Read(std::vector<uint8_t>& opus) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() {
+        return packets_.packets() > 0 || finished_ || !finishing_;
+    });
+    return packets_.Pop(opus);
+}
+
+void WakeWordPreRoll::Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pcm_read_ = 0;
+    pcm_size_ = 0;
+    packets_.Clear();
+    finishing_ = false;
+    finished_ = false;
+    frame_duration_ms_ = next_frame_duration_ms_;
+    // The encoder state belongs to the encode task
+    reset_pending_ = true;
+}
+
+void WakeWordPreRoll::EncodeTask() {
+    MemoryTagScope memory_tag_scope(kMemoryTagAudio);
+    std::unique_ptr<OpusEncoderWrapper> encoder;
+    int encoder_duration_ms = 0;
+    std::vector<int16_t> frame;
+    std::vector<uint8_t> packet;
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (encoder_duration_ms != frame_duration_ms_) {
+            encoder_duration_ms = frame_duration_ms_;
+            lock.unlock();
+            encoder.reset();
+            encoder = std::make_unique<OpusEncoderWrapper>(16000, 1, encoder_duration_ms);
+            encoder->SetComplexity(0); // 0 is the fastest
+            lock.lock();
+            packets_.Clear();
+            packets_.SetMaxPackets(PRE_ROLL_DURATION_MS / encoder_duration_ms);
+            reset_pending_ = false;
+        }
+
+        size_t frame_samples = 16000 / 1000 * encoder_duration_ms;
+        while (true) {
+            if (reset_pending_) {
+                reset_pending_ = false;
+                encoder->ResetState();
+            }
+            if (pcm_size_ < frame_samples) {
+                break;
+            }
+
+            frame.resize(frame_samples);
+            size_t first = std::min(frame_samples, pcm_capacity_ - pcm_read_);
+            memcpy(frame.data(), pcm_ + pcm_read_, first * sizeof(int16_t));
+            memcpy(frame.data() + first, pcm_, (frame_samples - first) * sizeof(int16_t));
+            pcm_read_ = (pcm_read_ + frame_samples) % pcm_capacity_;
+            pcm_size_ -= frame_samples;
+            lock.unlock();
+
+            packet.clear();
+            encoder->Encode(std::move(frame), [&packet](std::vector<uint8_t>&& opus) {
+                packet = std::move(opus);
+            });
+
+            lock.lock();
+            // A Reset while encoding makes this packet stale
+            if (!reset_pending_ && !packet.empty()) {
+                packets_.Push(packet.data(), packet.size());
+                cv_.notify_all();
+            }
+        }
+
+        if (finishing_ && !finished_) {
+            finished_ = true;
+            ESP_LOGI(TAG, "Pre-roll ready, %u packets, %u bytes, %" PRIu32 " samples dropped",
+                packets_.packets(), packets_.bytes(), dropped_samples_);
+            cv_.notify_all();
+        }
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef WAKE_WORD_PRE_ROLL_H
+#define WAKE_WORD_PRE_ROLL_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <opus_encoder.h>
+#include "opus_packet_ring.h"
+
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+// Keeps the audio before and during the wake word encoded as Opus, so the packets are ready
+// to send as soon as the wake word is detected. The detection task writes PCM into a small
+// ring in PSRAM, a background task encodes it frame by frame at complexity 0 into an
+// OpusPacketRing that holds the newest PRE_ROLL_DURATION_MS.
+class WakeWordPreRoll {
+public:
+    WakeWordPreRoll() = default;
+    ~WakeWordPreRoll();
+
+    void Initialize();
+    // Takes effect at the next Reset, so a pre-roll being sent keeps the duration it was encoded with
+    void SetFrameDuration(int duration_ms);
+    // Called by the detection task, never waits for the encoder
+    void Write(const int16_t* data, size_t samples);
+    // Encodes the whole frames written so far, Read returns false once they are all read
+    void Finish();
+    // Waits until a packet is encoded or Finish is done, returns false when there are no more packets
+    bool Read(std::vector<uint8_t>& opus);
+    // Drops everything and starts over, e.g. when detection restarts
+    void Reset();
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    TaskHandle_t encode_task_ = nullptr;
+    StaticTask_t encode_task_buffer_;
+    StackType_t* encode_task_stack_ = nullptr;
+
+    int16_t* pcm_ = nullptr;
+    size_t pcm_capacity_ = 0;
+    size_t pcm_read_ = 0;
+    size_t pcm_size_ = 0;
+    uint32_t dropped_samples_ = 0;
+    OpusPacketRing packets_;
+
+    int frame_duration_ms_ = 60;
+    int next_frame_duration_ms_ = 60;
+    bool reset_pending_ = false;
+    bool finishing_ = false;
+    bool finished_ = false;
+
+    void EncodeTask();
+};
+
+#endif // WAKE_WORD_PRE_ROLL_H
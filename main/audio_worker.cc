@@ -0,0 +1,107 @@
+#include "audio_worker.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <cinttypes>
+
+#define TAG "AudioWorker"
+
+AudioWorker::AudioWorker(const char* name, uint32_t stack_size, UBaseType_t priority, BaseType_t core_id)
+    : name_(name), stack_size_(stack_size) {
+    // Opus needs a deep stack, keep it out of the internal SRAM when there is PSRAM. The
+    // jobs never write to flash, which a task with its stack in PSRAM must not do.
+#if CONFIG_SPIRAM_ALLOW_STACK_EXTERNAL_MEMORY
+    task_stack_ = (StackType_t*)heap_caps_malloc(stack_size, MALLOC_CAP_SPIRAM);
+#endif
+    if (task_stack_ == nullptr) {
+        task_stack_ = (StackType_t*)heap_caps_malloc(stack_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+    if (task_stack_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the stack of %s", name);
+        return;
+    }
+    task_handle_ = xTaskCreateStaticPinnedToCore([](void* arg) {
+        auto worker = (AudioWorker*)arg;
+        worker->WorkerLoop();
+    }, name, stack_size, this, priority, task_stack_, &task_buffer_, core_id);
+}
+
+AudioWorker::~AudioWorker() {
+    if (task_handle_ != nullptr) {
+        vTaskDelete(task_handle_);
+    }
+    heap_caps_free(task_stack_);
+}
+
+bool AudioWorker::Schedule(BackgroundJob job) {
+#ifndef NDEBUG
+    TaskHandle_t producer = nullptr;
+    TaskHandle_t current = xTaskGetCurrentTaskHandle();
+    if (!producer_.compare_exchange_strong(producer, current)) {
+        assert(producer == current && "AudioWorker::Schedule called from a second task");
+    }
+#endif
+    scheduled_++;
+    // Without a task (the stack allocation failed) the job is dropped like on a full queue
+    if (task_handle_ == nullptr || !queue_.TryPush(Job{ std::move(job), esp_timer_get_time(), generation_.load() })) {
+        dropped_++;
+        std::lock_guard<std::mutex> lock(mutex_);
+        completed_++;
+        condition_variable_.notify_all();
+        return false;
+    }
+    xTaskNotifyGive(task_handle_);
+    return true;
+}
+
+void AudioWorker::WaitForCompletion() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    condition_variable_.wait(lock, [this]() {
+        return completed_ == scheduled_;
+    });
+}
+
+void AudioWorker::PrintStats() {
+    if (scheduled_ == 0) {
+        return;
+    }
+    // The stack sizes in application.h are checked against this
+    uint32_t stack_free = task_handle_ != nullptr ? uxTaskGetStackHighWaterMark(task_handle_) * sizeof(StackType_t) : 0;
+    ESP_LOGI(TAG, "%s: depth %u executed %" PRIu32 " dropped %" PRIu32 " cancelled %" PRIu32 " max wait %lld us stack used %" PRIu32 "/%" PRIu32, name_,
+        queue_.size(), completed_.load() - dropped_.load() - cancelled_.load(), dropped_.load(),
+        cancelled_.load(), max_wait_us_.load(), stack_size_ - stack_free, stack_size_);
+}
+
+void AudioWorker::WorkerLoop() {
+    ESP_LOGI(TAG, "%s started on core %d", name_, xPortGetCoreID());
+    Job job;
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (queue_.TryPop(job)) {
+            if (job.generation != generation_) {
+                cancelled_++;
+            } else {
+                int64_t wait_us = esp_timer_get_time() - job.enqueue_time;
+                if (wait_us > max_wait_us_) {
+                    max_wait_us_ = wait_us;
+                }
+                job.callback();
+            }
+            job.callback.Reset();
+
+            bool idle = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                completed_++;
+                if (completed_ == scheduled_) {
+                    idle = true;
+                    condition_variable_.notify_all();
+                }
+            }
+            if (idle && on_idle_) {
+                on_idle_();
+            }
+        }
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef AUDIO_WORKER_H
+#define AUDIO_WORKER_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <cassert>
+
+#include "task_queue.h"
+#include "background_task.h"
+
+#define AUDIO_WORKER_QUEUE_SIZE 16
+
+// A task pinned to one core that runs audio jobs from a single producer.
+// Used to give the uplink (encode) and downlink (decode) paths their own
+// worker so they run concurrently on dual-core chips. The stack is taken
+// from PSRAM when available, PrintStats reports how much of it was used.
+class AudioWorker {
+public:
+    AudioWorker(const char* name, uint32_t stack_size, UBaseType_t priority, BaseType_t core_id);
+    ~AudioWorker();
+
+    // Must always be called from the same task. Returns false if the queue is full and the job was dropped.
+    bool Schedule(BackgroundJob job);
+    void WaitForCompletion();
+    // Queued jobs are discarded instead of being run, the running job is not interrupted
+    void CancelPending() { generation_++; }
+    // Called from the worker whenever the last job finished
+    void OnIdle(std::function<void()> callback) { on_idle_ = callback; }
+    bool IsIdle() const { return completed_ == scheduled_; }
+    size_t QueueDepth() const { return queue_.size(); }
+    void PrintStats();
+
+private:
+    struct Job {
+        BackgroundJob callback;
+        int64_t enqueue_time = 0;
+        uint32_t generation = 0;
+    };
+
+    const char* name_;
+    SpscQueue<Job, AUDIO_WORKER_QUEUE_SIZE> queue_;
+    TaskHandle_t task_handle_ = nullptr;
+    StaticTask_t task_buffer_;
+    StackType_t* task_stack_ = nullptr;
+    uint32_t stack_size_;
+#ifndef NDEBUG
+    // The first task to call Schedule, the queue has room for one producer only
+    std::atomic<TaskHandle_t> producer_{nullptr};
+#endif
+    std::mutex mutex_;
+    std::condition_variable condition_variable_;
+    std::atomic<uint32_t> scheduled_{0};
+    std::atomic<uint32_t> completed_{0};
+    std::atomic<uint32_t> dropped_{0};
+    std::atomic<uint32_t> cancelled_{0};
+    std::atomic<uint32_t> generation_{0};
+    std::function<void()> on_idle_;
+    std::atomic<int64_t> max_wait_us_{0};
+
+    void WorkerLoop();
+};
+
+#endif // AUDIO_WORKER_H
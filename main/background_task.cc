@@ -1,11 +1,27 @@
 #include "background_task.h"
 
 #include <esp_log.h>
-#include <esp_task_wdt.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <cassert>
+#include <cinttypes>
 
 #define TAG "BackgroundTask"
 
+static const char* const LANE_NAMES[] = {
+    "realtime",
+    "normal",
+    "low"
+};
+
 BackgroundTask::BackgroundTask(uint32_t stack_size) {
+    // Decode jobs are paced by the producer (see QueueDepth), the bound only protects against bursts
+    ConfigureLane(kBackgroundTaskLaneRealtime, 8, kBackgroundTaskDropNewest);
+    // About 0.5 seconds of uplink audio. Dropping the oldest would cut the middle of the
+    // utterance out of the stream, so new frames are refused and the drop is logged
+    ConfigureLane(kBackgroundTaskLaneNormal, 16, kBackgroundTaskDropNewest);
+    ConfigureLane(kBackgroundTaskLaneLow, 32, kBackgroundTaskDropNewest);
+
     xTaskCreate([](void* arg) {
         BackgroundTask* task = (BackgroundTask*)arg;
         task->BackgroundTaskLoop();
@@ -18,46 +34,183 @@ BackgroundTask::~BackgroundTask() {
     }
 }
 
-void BackgroundTask::Schedule(std::function<void()> callback) {
+void BackgroundTask::ConfigureLane(BackgroundTaskLane lane, size_t max_depth, BackgroundTaskOverflowPolicy policy) {
+    assert(max_depth > 0);
     std::lock_guard<std::mutex> lock(mutex_);
-    if (active_tasks_ >= 30) {
-        int free_sram = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
-        if (free_sram < 10000) {
-            ESP_LOGW(TAG, "active_tasks_ == %u, free_sram == %u", active_tasks_.load(), free_sram);
-        }
+    auto& l = lanes_[lane];
+
+    // Keep the queued jobs, dropping the oldest ones if the lane shrinks
+    std::vector<Job> jobs(max_depth);
+    size_t keep = std::min(l.count, max_depth);
+    size_t skip = l.count - keep;
+    for (size_t i = 0; i < keep; ++i) {
+        jobs[i] = std::move(l.jobs[(l.head + skip + i) % l.jobs.size()]);
     }
-    active_tasks_++;
-    main_tasks_.emplace_back([this, cb = std::move(callback)]() {
-        cb();
-        {
-            std::lock_guard<std::mutex> lock(mutex_);
-            active_tasks_--;
-            if (main_tasks_.empty() && active_tasks_ == 0) {
-                condition_variable_.notify_all();
-            }
+    active_tasks_ -= skip;
+    l.stats.dropped += skip;
+
+    l.jobs = std::move(jobs);
+    l.head = 0;
+    l.count = keep;
+    l.policy = policy;
+    l.stats.depth = keep;
+}
+
+void BackgroundTask::Schedule(BackgroundJob callback, BackgroundTaskLane lane) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& l = lanes_[lane];
+    size_t capacity = l.jobs.size();
+    Job job = { std::move(callback), esp_timer_get_time(), l.generation };
+
+    if (l.count == capacity) {
+        switch (l.policy) {
+            case kBackgroundTaskDropOldest:
+                // The ring is full, so the oldest slot is also the next free one
+                l.jobs[l.head] = std::move(job);
+                l.head = (l.head + 1) % capacity;
+                l.stats.dropped++;
+                break;
+            case kBackgroundTaskDropNewest:
+                l.stats.dropped++;
+                if (!l.dropping) {
+                    l.dropping = true;
+                    ESP_LOGW(TAG, "Lane %s full, dropping new jobs (%" PRIu32 " dropped in total)",
+                        LANE_NAMES[lane], l.stats.dropped);
+                }
+                return;
+            case kBackgroundTaskMerge:
+                l.jobs[(l.head + l.count - 1) % capacity] = std::move(job);
+                l.stats.merged++;
+                break;
         }
-    });
+    } else {
+        l.jobs[(l.head + l.count) % capacity] = std::move(job);
+        l.count++;
+        l.dropping = false;
+        active_tasks_++;
+        idle_notified_ = false;
+        l.stats.depth = l.count;
+        l.stats.peak_depth = std::max(l.stats.peak_depth, l.count);
+    }
+    condition_variable_.notify_all();
+}
+
+void BackgroundTask::CancelPending(BackgroundTaskLane lane) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Stale jobs stay in the lane and are skipped when popped, see PopNextJob
+        lanes_[lane].generation++;
+    }
     condition_variable_.notify_all();
 }
 
+void BackgroundTask::OnIdle(std::function<void()> callback) {
+    on_idle_ = callback;
+}
+
+bool BackgroundTask::IsLaneIdle(BackgroundTaskLane lane) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return lanes_[lane].count == 0 && running_lane_ != lane;
+}
+
+size_t BackgroundTask::QueueDepth(BackgroundTaskLane lane) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return lanes_[lane].count;
+}
+
 void BackgroundTask::WaitForCompletion() {
     std::unique_lock<std::mutex> lock(mutex_);
     condition_variable_.wait(lock, [this]() {
-        return main_tasks_.empty() && active_tasks_ == 0;
+        return active_tasks_ == 0;
     });
 }
 
+BackgroundTaskLaneStats BackgroundTask::GetLaneStats(BackgroundTaskLane lane) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return lanes_[lane].stats;
+}
+
+void BackgroundTask::PrintStats() {
+    for (int i = 0; i < kBackgroundTaskLaneCount; ++i) {
+        auto stats = GetLaneStats((BackgroundTaskLane)i);
+        if (stats.executed == 0 && stats.dropped == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "Lane %s: depth %u/%u executed %" PRIu32 " dropped %" PRIu32 " merged %" PRIu32 " cancelled %" PRIu32 " wait avg %lld us max %lld us",
+            LANE_NAMES[i], stats.depth, stats.peak_depth, stats.executed, stats.dropped, stats.merged, stats.cancelled,
+            stats.executed > 0 ? stats.total_wait_us / stats.executed : 0, stats.max_wait_us);
+    }
+}
+
+// Must be called with mutex_ held
+bool BackgroundTask::PopNextJob(Job& job) {
+    for (int i = 0; i < kBackgroundTaskLaneCount; ++i) {
+        auto& l = lanes_[i];
+        while (l.count > 0) {
+            job = std::move(l.jobs[l.head]);
+            l.head = (l.head + 1) % l.jobs.size();
+            l.count--;
+            l.stats.depth = l.count;
+
+            if (job.generation != l.generation) {
+                l.stats.cancelled++;
+                job.callback.Reset();
+                active_tasks_--;
+                continue;
+            }
+
+            int64_t wait_us = esp_timer_get_time() - job.enqueue_time;
+            l.stats.executed++;
+            l.stats.total_wait_us += wait_us;
+            l.stats.max_wait_us = std::max(l.stats.max_wait_us, wait_us);
+            running_lane_ = (BackgroundTaskLane)i;
+            return true;
+        }
+    }
+    return false;
+}
+
 void BackgroundTask::BackgroundTaskLoop() {
     ESP_LOGI(TAG, "background_task started");
+    Job job;
     while (true) {
-        std::unique_lock<std::mutex> lock(mutex_);
-        condition_variable_.wait(lock, [this]() { return !main_tasks_.empty(); });
-        
-        std::list<std::function<void()>> tasks = std::move(main_tasks_);
-        lock.unlock();
-
-        for (auto& task : tasks) {
-            task();
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!PopNextJob(job)) {
+                // Skipping cancelled jobs may have emptied the lanes
+                if (active_tasks_ == 0 && !idle_notified_) {
+                    idle_notified_ = true;
+                    condition_variable_.notify_all();
+                    lock.unlock();
+                    if (on_idle_) {
+                        on_idle_();
+                    }
+                    lock.lock();
+                    continue;
+                }
+                condition_variable_.wait(lock);
+            }
         }
+
+        job.callback();
+        job.callback.Reset();
+        FinishJob();
+    }
+}
+
+void BackgroundTask::FinishJob() {
+    bool idle = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_lane_ = kBackgroundTaskLaneCount;
+        active_tasks_--;
+        if (active_tasks_ == 0) {
+            idle = true;
+            idle_notified_ = true;
+            condition_variable_.notify_all();
+        }
+    }
+    if (idle && on_idle_) {
+        on_idle_();
     }
 }
@@ -4,25 +4,91 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <mutex>
-#include <list>
+#include <vector>
 #include <condition_variable>
 #include <atomic>
+#include <functional>
+
+#include "task_queue.h"
+
+// Lanes are served in strict priority order, one job at a time
+enum BackgroundTaskLane {
+    kBackgroundTaskLaneRealtime,    // Downlink decode, an underrun is audible
+    kBackgroundTaskLaneNormal,      // Uplink encode
+    kBackgroundTaskLaneLow,         // Housekeeping
+    kBackgroundTaskLaneCount
+};
+
+// What to do when a job is scheduled to a full lane
+enum BackgroundTaskOverflowPolicy {
+    kBackgroundTaskDropOldest,      // Discard the oldest queued job, keeps latency bounded
+    kBackgroundTaskDropNewest,      // Discard the incoming job
+    kBackgroundTaskMerge,           // Replace the newest queued job, for jobs where only the latest matters
+};
+
+struct BackgroundTaskLaneStats {
+    size_t depth = 0;
+    size_t peak_depth = 0;
+    uint32_t executed = 0;
+    uint32_t dropped = 0;
+    uint32_t merged = 0;
+    uint32_t cancelled = 0;
+    int64_t total_wait_us = 0;
+    int64_t max_wait_us = 0;
+};
+
+using BackgroundJob = InlineTask<32>;
 
 class BackgroundTask {
 public:
     BackgroundTask(uint32_t stack_size = 4096 * 2);
     ~BackgroundTask();
 
-    void Schedule(std::function<void()> callback);
+    void ConfigureLane(BackgroundTaskLane lane, size_t max_depth, BackgroundTaskOverflowPolicy policy);
+    void Schedule(BackgroundJob callback, BackgroundTaskLane lane = kBackgroundTaskLaneLow);
     void WaitForCompletion();
+    // The jobs queued in lane are discarded instead of being run, the running job is not
+    // interrupted and the other lanes are left alone
+    void CancelPending(BackgroundTaskLane lane);
+    // Called from the background task whenever the last job finished or was cancelled
+    void OnIdle(std::function<void()> callback);
+    bool IsIdle() const { return active_tasks_ == 0; }
+    bool IsLaneIdle(BackgroundTaskLane lane);
+    size_t QueueDepth(BackgroundTaskLane lane);
+    BackgroundTaskLaneStats GetLaneStats(BackgroundTaskLane lane);
+    void PrintStats();
 
 private:
+    struct Job {
+        BackgroundJob callback;
+        int64_t enqueue_time = 0;
+        uint32_t generation = 0;
+    };
+
+    // Fixed size ring, no allocation once configured
+    struct Lane {
+        std::vector<Job> jobs;
+        size_t head = 0;
+        size_t count = 0;
+        BackgroundTaskOverflowPolicy policy = kBackgroundTaskDropOldest;
+        // Jobs scheduled before the last CancelPending carry an older generation
+        uint32_t generation = 0;
+        // Set by the first job refused while the lane is full, so a burst is logged once
+        bool dropping = false;
+        BackgroundTaskLaneStats stats;
+    };
+
     std::mutex mutex_;
-    std::list<std::function<void()>> main_tasks_;
+    Lane lanes_[kBackgroundTaskLaneCount];
     std::condition_variable condition_variable_;
     TaskHandle_t background_task_handle_ = nullptr;
     std::atomic<size_t> active_tasks_{0};
+    bool idle_notified_ = true;
+    BackgroundTaskLane running_lane_ = kBackgroundTaskLaneCount;
+    std::function<void()> on_idle_;
 
+    bool PopNextJob(Job& job);
+    void FinishJob();
     void BackgroundTaskLoop();
 };
 
@@ -58,6 +58,20 @@ Led* Board::GetLed() {
     return &led;
 }
 
+// The bitrate starts at a fixed 16 kbps instead of OPUS_AUTO, about 17 kbps for 16 kHz mono
+// at 60 ms, so the controller has a value to step from
+OpusEncoderLimits Board::GetOpusEncoderLimits() {
+#if CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4 || CONFIG_IDF_TARGET_LINUX
+    // Spare CPU goes to quality
+    return { .min_complexity = 0, .max_complexity = 8, .complexity = 3,
+             .min_bitrate = 12000, .max_bitrate = 24000, .bitrate = 16000 };
+#else
+    // Complexity 5 takes about half of an ESP32-C3
+    return { .min_complexity = 0, .max_complexity = 4, .complexity = 3,
+             .min_bitrate = 12000, .max_bitrate = 24000, .bitrate = 16000 };
+#endif
+}
+
 std::string Board::GetJson() {
     /* 
         {
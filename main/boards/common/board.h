@@ -10,6 +10,17 @@
 #include "led/led.h"
 #include "backlight.h"
 
+// Bounds of the adaptive uplink encoder, bitrates in bits per second. Boards override
+// GetOpusEncoderLimits to move them, e.g. from values in their config.h.
+struct OpusEncoderLimits {
+    int min_complexity;
+    int max_complexity;
+    int complexity;     // Starting value
+    int min_bitrate;
+    int max_bitrate;
+    int bitrate;        // Starting value
+};
+
 void* create_board();
 class AudioCodec;
 class Display;
@@ -48,6 +59,7 @@ public:
     virtual bool GetBatteryLevel(int &level, bool& charging, bool& discharging);
     virtual std::string GetJson();
     virtual void SetPowerSaveMode(bool enabled) = 0;
+    virtual OpusEncoderLimits GetOpusEncoderLimits();
 };
 
 #define DECLARE_BOARD(BOARD_CLASS_NAME) \
@@ -7,6 +7,7 @@
 
 #include <esp_log.h>
 #include <esp_timer.h>
+#include <algorithm>
 #include <ml307_http.h>
 #include <ml307_ssl_transport.h>
 #include <web_socket.h>
@@ -23,6 +24,16 @@ std::string Ml307Board::GetBoardType() {
     return "ml307";
 }
 
+OpusEncoderLimits Ml307Board::GetOpusEncoderLimits() {
+    // Cellular data is metered, start at complexity 5 and keep the bitrate low
+    auto limits = Board::GetOpusEncoderLimits();
+    limits.complexity = std::min(5, limits.max_complexity);
+    limits.min_bitrate = 10000;
+    limits.max_bitrate = 16000;
+    limits.bitrate = 16000;
+    return limits;
+}
+
 void Ml307Board::StartNetwork() {
     auto display = Board::GetInstance().GetDisplay();
     display->SetStatus(Lang::Strings::DETECTING_MODULE);
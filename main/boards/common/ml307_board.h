@@ -21,6 +21,7 @@ public:
     virtual Udp* CreateUdp() override;
     virtual const char* GetNetworkStateIcon() override;
     virtual void SetPowerSaveMode(bool enabled) override;
+    virtual OpusEncoderLimits GetOpusEncoderLimits() override;
 };
 
 #endif // ML307_BOARD_H
@@ -1,4 +1,5 @@
 #include "k10_audio_codec.h"
+#include "pcm_kernels.h"
 
 #include <esp_log.h>
 #include <driver/i2c.h>
@@ -74,8 +75,8 @@ void K10AudioCodec::CreateDuplexChannels(gpio_num_t mclk, gpio_num_t bclk, gpio_
     i2s_chan_config_t chan_cfg = {
         .id = I2S_NUM_0,
         .role = I2S_ROLE_MASTER,
-        .dma_desc_num = 6,
-        .dma_frame_num = 240,
+        .dma_desc_num = AUDIO_CODEC_DMA_DESC_NUM,
+        .dma_frame_num = AUDIO_CODEC_DMA_FRAME_NUM,
         .auto_clear_after_cb = true,
         .auto_clear_before_cb = false,
         .intr_priority = 0,
@@ -202,20 +203,14 @@ int K10AudioCodec::Write(const int16_t* data, int samples) {
     if (output_enabled_) {
         std::vector<int32_t> buffer(samples * 2);  // Allocate buffer for 2x samples
 
-        // Apply volume adjustment (same as before)
-        int32_t volume_factor = pow(double(output_volume_) / 100.0, 2) * 65536;
+        // Apply volume adjustment into the upper half, then spread it out.
+        // Slots 2i and 2i+1 are below samples + i, so no unread sample is overwritten.
+        PcmScaleToInt32(data, buffer.data() + samples, samples, PcmVolumeToGain(output_volume_));
         for (int i = 0; i < samples; i++) {
-            int64_t temp = int64_t(data[i]) * volume_factor;
-            if (temp > INT32_MAX) {
-            buffer[i * 2] = INT32_MAX;
-            } else if (temp < INT32_MIN) {
-            buffer[i * 2] = INT32_MIN;
-            } else {
-            buffer[i * 2] = static_cast<int32_t>(temp);
-            }
-
             // Repeat each sample for slow playback (assuming mono audio)
-            buffer[i * 2 + 1] = buffer[i * 2];
+            int32_t value = buffer[samples + i];
+            buffer[i * 2] = value;
+            buffer[i * 2 + 1] = value;
         }
 
         size_t bytes_written;
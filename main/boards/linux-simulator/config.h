@@ -0,0 +1,27 @@
+#ifndef _BOARD_CONFIG_H_
+#define _BOARD_CONFIG_H_
+
+#define AUDIO_INPUT_SAMPLE_RATE  16000
+#define AUDIO_OUTPUT_SAMPLE_RATE 24000
+
+// Microphone and speaker files, overridable with XIAOZHI_SIM_INPUT / XIAOZHI_SIM_OUTPUT.
+// The input must be 16-bit PCM, mono, AUDIO_INPUT_SAMPLE_RATE. When it runs out, silence is read.
+#define SIMULATOR_INPUT_WAV  "input.wav"
+#define SIMULATOR_OUTPUT_WAV "output.wav"
+
+// Same DMA geometry as the I2S codecs: 6 descriptors of 240 frames
+#define SIMULATOR_DMA_DESC_NUM  6
+#define SIMULATOR_DMA_FRAME_NUM 240
+
+// Period of the simulated I2S clock, on_recv / on_sent fire once per tick
+#define SIMULATOR_AUDIO_TICK_MS 10
+
+// How long a task yields between two polls of an idle socket
+#define SIMULATOR_SOCKET_POLL_MS 2
+
+#define SIMULATOR_CA_BUNDLE_PATH "/etc/ssl/certs/ca-certificates.crt"
+
+// Toggle the chat state every N seconds for soak tests, 0 to disable. Overridable with XIAOZHI_SIM_AUTO_CHAT
+#define SIMULATOR_AUTO_CHAT_SECONDS 0
+
+#endif // _BOARD_CONFIG_H_
@@ -0,0 +1,208 @@
+#include "board.h"
+#include "wav_audio_codec.h"
+#include "posix_http.h"
+#include "posix_mqtt.h"
+#include "posix_udp.h"
+#include "posix_transport.h"
+#include "application.h"
+#include "system_info.h"
+#include "font_awesome_symbols.h"
+#include "config.h"
+#include "iot/thing_manager.h"
+#include "trace.h"
+#include "polyphase_resampler.h"
+#include "pcm_kernels.h"
+#include "assets/lang_config.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <esp_app_desc.h>
+
+#include <cstdlib>
+#include <poll.h>
+#include <unistd.h>
+
+#define TAG "LinuxSimulatorBoard"
+
+static std::string GetEnv(const char* name, const char* default_value) {
+    const char* value = getenv(name);
+    return value != nullptr ? value : default_value;
+}
+
+// Runs the firmware on a workstation: WAV files instead of I2S, host sockets instead of WiFi.
+// Keys on stdin replace the buttons, see README.md.
+class LinuxSimulatorBoard : public Board {
+private:
+    int auto_chat_seconds_ = SIMULATOR_AUTO_CHAT_SECONDS;
+
+    virtual std::string GetBoardJson() override {
+        std::string board_json = std::string("{\"type\":\"" BOARD_TYPE "\",");
+        board_json += "\"name\":\"" BOARD_NAME "\",";
+        board_json += "\"mac\":\"" + SystemInfo::GetMacAddress() + "\"}";
+        return board_json;
+    }
+
+    void InitializeIot() {
+        auto& thing_manager = iot::ThingManager::GetInstance();
+        thing_manager.AddThing(iot::CreateThing("Speaker"));
+    }
+
+    // Replaces the boot / volume buttons, one command per line
+    void ConsoleTask() {
+        std::string line;
+        struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+        while (true) {
+            // Never block inside read(), the POSIX port would stall every other task
+            if (poll(&pfd, 1, 0) <= 0) {
+                vTaskDelay(pdMS_TO_TICKS(50));
+                continue;
+            }
+            char c;
+            if (read(STDIN_FILENO, &c, 1) != 1) {
+                // stdin closed, e.g. running under a script
+                break;
+            }
+            if (c != '\n') {
+                line.push_back(c);
+                continue;
+            }
+
+            auto& app = Application::GetInstance();
+            if (line == "t") {
+                app.ToggleChatState();
+            } else if (line == "s") {
+                app.StartListening();
+            } else if (line == "e") {
+                app.StopListening();
+            } else if (line.rfind("w ", 0) == 0) {
+                app.WakeWordInvoke(line.substr(2));
+#if CONFIG_USE_TRACE
+            } else if (line == "trace") {
+                Trace::DumpAsync("");
+            } else if (line.rfind("trace ", 0) == 0) {
+                Trace::DumpAsync(line.substr(6));
+#endif
+#if CONFIG_USE_RESAMPLER_BENCHMARK || CONFIG_USE_PCM_KERNELS_BENCHMARK
+            } else if (line == "bench") {
+                RunBenchmarks();
+#endif
+            } else if (line == "q") {
+                ESP_LOGI(TAG, "Bye");
+                exit(0);
+            } else if (!line.empty()) {
+                printf("t: toggle chat, s: start listening, e: stop listening, w <text>: wake word, "
+                    "trace [url]: dump the trace, bench: run the benchmarks, q: quit\n");
+            }
+            line.clear();
+        }
+        vTaskDelete(NULL);
+    }
+
+#if CONFIG_USE_RESAMPLER_BENCHMARK || CONFIG_USE_PCM_KERNELS_BENCHMARK
+    // The same benchmarks as at boot, on the host CPU, in a task with room for the log formatting
+    void RunBenchmarks() {
+        xTaskCreate([](void* arg) {
+#if CONFIG_USE_PCM_KERNELS_BENCHMARK
+            PcmKernelsBenchmark();
+#endif
+#if CONFIG_USE_RESAMPLER_BENCHMARK
+            PolyphaseResamplerBenchmark();
+#endif
+            vTaskDelete(NULL);
+        }, "benchmark", 4096 * 4, nullptr, 1, nullptr);
+    }
+#endif
+
+    // Soak test driver, opens and closes a conversation periodically
+    void AutoChatTask() {
+        while (true) {
+            vTaskDelay(pdMS_TO_TICKS(auto_chat_seconds_ * 1000));
+            auto& app = Application::GetInstance();
+            ESP_LOGI(TAG, "Auto chat: toggle in state %d", app.GetDeviceState());
+            app.ToggleChatState();
+        }
+    }
+
+public:
+    LinuxSimulatorBoard() {
+        auto_chat_seconds_ = std::atoi(GetEnv("XIAOZHI_SIM_AUTO_CHAT", std::to_string(SIMULATOR_AUTO_CHAT_SECONDS).c_str()).c_str());
+        InitializeIot();
+    }
+
+    virtual std::string GetBoardType() override {
+        return "simulator";
+    }
+
+    virtual AudioCodec* GetAudioCodec() override {
+        static WavAudioCodec audio_codec(AUDIO_INPUT_SAMPLE_RATE, AUDIO_OUTPUT_SAMPLE_RATE,
+            GetEnv("XIAOZHI_SIM_INPUT", SIMULATOR_INPUT_WAV), GetEnv("XIAOZHI_SIM_OUTPUT", SIMULATOR_OUTPUT_WAV));
+        return &audio_codec;
+    }
+
+    virtual Http* CreateHttp() override {
+        return new PosixHttp();
+    }
+
+    virtual WebSocket* CreateWebSocket() override {
+#ifdef CONFIG_CONNECTION_TYPE_WEBSOCKET
+        std::string url = CONFIG_WEBSOCKET_URL;
+        return new WebSocket(CreatePosixTransport(url.find("wss://") == 0));
+#endif
+        return nullptr;
+    }
+
+    virtual Mqtt* CreateMqtt() override {
+        return new PosixMqtt();
+    }
+
+    virtual Udp* CreateUdp() override {
+        return new PosixUdp();
+    }
+
+    virtual void StartNetwork() override {
+        // The host network is up already
+        xTaskCreate([](void* arg) {
+            ((LinuxSimulatorBoard*)arg)->ConsoleTask();
+        }, "console", 4096, this, 1, nullptr);
+
+        if (auto_chat_seconds_ > 0) {
+            ESP_LOGI(TAG, "Auto chat every %d seconds", auto_chat_seconds_);
+            xTaskCreate([](void* arg) {
+                ((LinuxSimulatorBoard*)arg)->AutoChatTask();
+            }, "auto_chat", 4096, this, 1, nullptr);
+        }
+    }
+
+    virtual const char* GetNetworkStateIcon() override {
+        return FONT_AWESOME_WIFI;
+    }
+
+    virtual void SetPowerSaveMode(bool enabled) override {
+    }
+
+    // The partition table and chip details of Board::GetJson do not exist on the host
+    virtual std::string GetJson() override {
+        auto app_desc = esp_app_get_description();
+        std::string json = "{";
+        json += "\"version\":2,";
+        json += "\"language\":\"" + std::string(Lang::CODE) + "\",";
+        json += "\"flash_size\":" + std::to_string(SystemInfo::GetFlashSize()) + ",";
+        json += "\"minimum_free_heap_size\":" + std::to_string(SystemInfo::GetMinimumFreeHeapSize()) + ",";
+        json += "\"mac_address\":\"" + SystemInfo::GetMacAddress() + "\",";
+        json += "\"uuid\":\"" + uuid_ + "\",";
+        json += "\"chip_model_name\":\"" + SystemInfo::GetChipModelName() + "\",";
+        json += "\"application\":{";
+        json += "\"name\":\"" + std::string(app_desc->project_name) + "\",";
+        json += "\"version\":\"" + std::string(app_desc->version) + "\",";
+        json += "\"compile_time\":\"" + std::string(app_desc->date) + "T" + std::string(app_desc->time) + "Z\",";
+        json += "\"idf_version\":\"" + std::string(app_desc->idf_ver) + "\"";
+        json += "},";
+        json += "\"ota\":{\"label\":\"factory\"},";
+        json += "\"board\":" + GetBoardJson();
+        json += "}";
+        return json;
+    }
+};
+
+DECLARE_BOARD(LinuxSimulatorBoard);
@@ -0,0 +1,194 @@
+#include "posix_http.h"
+#include "posix_transport.h"
+
+#include <esp_log.h>
+
+#include <algorithm>
+#include <cstring>
+
+#define TAG "PosixHttp"
+
+static std::string ToLower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+    return s;
+}
+
+PosixHttp::PosixHttp() {
+}
+
+PosixHttp::~PosixHttp() {
+    Close();
+}
+
+void PosixHttp::SetHeader(const std::string& key, const std::string& value) {
+    headers_[key] = value;
+}
+
+bool PosixHttp::Open(const std::string& method, const std::string& url, const std::string& content) {
+    bool secure;
+    size_t host_start;
+    if (url.find("https://") == 0) {
+        secure = true;
+        host_start = 8;
+    } else if (url.find("http://") == 0) {
+        secure = false;
+        host_start = 7;
+    } else {
+        ESP_LOGE(TAG, "Unsupported URL: %s", url.c_str());
+        return false;
+    }
+    size_t path_start = url.find('/', host_start);
+    std::string host_port = url.substr(host_start, path_start == std::string::npos ? std::string::npos : path_start - host_start);
+    std::string path = path_start == std::string::npos ? "/" : url.substr(path_start);
+    std::string host = host_port;
+    int port = secure ? 443 : 80;
+    size_t colon = host_port.find(':');
+    if (colon != std::string::npos) {
+        host = host_port.substr(0, colon);
+        port = std::stoi(host_port.substr(colon + 1));
+    }
+
+    Close();
+    transport_ = CreatePosixTransport(secure);
+    if (!transport_->Connect(host.c_str(), port)) {
+        Close();
+        return false;
+    }
+
+    std::string request = method + " " + path + " HTTP/1.1\r\n";
+    request += "Host: " + host_port + "\r\n";
+    request += "Connection: close\r\n";
+    for (const auto& header : headers_) {
+        request += header.first + ": " + header.second + "\r\n";
+    }
+    if (!content.empty() || method == "POST" || method == "PUT") {
+        request += "Content-Length: " + std::to_string(content.size()) + "\r\n";
+    }
+    request += "\r\n";
+    request += content;
+    if (transport_->Send(request.data(), request.size()) != (int)request.size()) {
+        Close();
+        return false;
+    }
+
+    std::string line;
+    if (!ReadLine(line) || line.compare(0, 5, "HTTP/") != 0) {
+        ESP_LOGE(TAG, "Invalid response from %s", host.c_str());
+        Close();
+        return false;
+    }
+    status_code_ = std::atoi(line.c_str() + line.find(' ') + 1);
+
+    while (ReadLine(line) && !line.empty()) {
+        size_t separator = line.find(':');
+        if (separator == std::string::npos) {
+            continue;
+        }
+        std::string value = line.substr(separator + 1);
+        value.erase(0, value.find_first_not_of(' '));
+        response_headers_[ToLower(line.substr(0, separator))] = value;
+    }
+
+    auto it = response_headers_.find("content-length");
+    if (it != response_headers_.end()) {
+        content_length_ = std::stoul(it->second);
+    }
+    it = response_headers_.find("transfer-encoding");
+    chunked_ = it != response_headers_.end() && ToLower(it->second) == "chunked";
+    return true;
+}
+
+void PosixHttp::Close() {
+    if (transport_ != nullptr) {
+        transport_->Disconnect();
+        delete transport_;
+        transport_ = nullptr;
+    }
+    response_headers_.clear();
+    status_code_ = -1;
+    content_length_ = 0;
+    chunked_ = false;
+    chunk_remaining_ = 0;
+    eof_ = false;
+    buffer_.clear();
+    body_.clear();
+}
+
+std::string PosixHttp::GetResponseHeader(const std::string& key) const {
+    auto it = response_headers_.find(ToLower(key));
+    if (it == response_headers_.end()) {
+        return "";
+    }
+    return it->second;
+}
+
+const std::string& PosixHttp::GetBody() {
+    char chunk[1024];
+    int ret;
+    while ((ret = Read(chunk, sizeof(chunk))) > 0) {
+        body_.append(chunk, ret);
+    }
+    return body_;
+}
+
+bool PosixHttp::FillBuffer() {
+    char chunk[1024];
+    int ret = transport_ != nullptr ? transport_->Receive(chunk, sizeof(chunk)) : -1;
+    if (ret <= 0) {
+        return false;
+    }
+    buffer_.append(chunk, ret);
+    return true;
+}
+
+bool PosixHttp::ReadLine(std::string& line) {
+    size_t end;
+    while ((end = buffer_.find("\r\n")) == std::string::npos) {
+        if (!FillBuffer()) {
+            return false;
+        }
+    }
+    line = buffer_.substr(0, end);
+    buffer_.erase(0, end + 2);
+    return true;
+}
+
+int PosixHttp::ReadRaw(char* buffer, size_t buffer_size) {
+    if (buffer_.empty() && !FillBuffer()) {
+        return 0;
+    }
+    size_t length = std::min(buffer_size, buffer_.size());
+    memcpy(buffer, buffer_.data(), length);
+    buffer_.erase(0, length);
+    return length;
+}
+
+int PosixHttp::Read(char* buffer, size_t buffer_size) {
+    if (eof_) {
+        return 0;
+    }
+    if (!chunked_) {
+        return ReadRaw(buffer, buffer_size);
+    }
+
+    if (chunk_remaining_ == 0) {
+        std::string line;
+        if (!ReadLine(line)) {
+            return -1;
+        }
+        // The CRLF that terminates the previous chunk
+        if (line.empty() && !ReadLine(line)) {
+            return -1;
+        }
+        chunk_remaining_ = std::stoul(line, nullptr, 16);
+        if (chunk_remaining_ == 0) {
+            eof_ = true;
+            return 0;
+        }
+    }
+    int ret = ReadRaw(buffer, std::min(buffer_size, chunk_remaining_));
+    if (ret > 0) {
+        chunk_remaining_ -= ret;
+    }
+    return ret;
+}
@@ -0,0 +1,41 @@
+#ifndef _POSIX_HTTP_H_
+#define _POSIX_HTTP_H_
+
+#include <http.h>
+#include <transport.h>
+#include <map>
+#include <string>
+
+// HTTP/1.1 client, one request per connection
+class PosixHttp : public Http {
+public:
+    PosixHttp();
+    virtual ~PosixHttp();
+
+    virtual void SetHeader(const std::string& key, const std::string& value) override;
+    virtual bool Open(const std::string& method, const std::string& url, const std::string& content = "") override;
+    virtual void Close() override;
+    virtual int GetStatusCode() const override { return status_code_; }
+    virtual std::string GetResponseHeader(const std::string& key) const override;
+    virtual size_t GetBodyLength() const override { return content_length_; }
+    virtual const std::string& GetBody() override;
+    virtual int Read(char* buffer, size_t buffer_size) override;
+
+private:
+    Transport* transport_ = nullptr;
+    std::map<std::string, std::string> headers_;
+    std::map<std::string, std::string> response_headers_;
+    int status_code_ = -1;
+    size_t content_length_ = 0;
+    bool chunked_ = false;
+    size_t chunk_remaining_ = 0;
+    bool eof_ = false;
+    std::string buffer_;
+    std::string body_;
+
+    bool FillBuffer();
+    bool ReadLine(std::string& line);
+    int ReadRaw(char* buffer, size_t buffer_size);
+};
+
+#endif // _POSIX_HTTP_H_
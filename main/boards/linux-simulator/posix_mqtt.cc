@@ -0,0 +1,251 @@
+#include "posix_mqtt.h"
+#include "posix_transport.h"
+
+#include <freertos/task.h>
+#include <esp_log.h>
+
+#define TAG "PosixMqtt"
+
+#define MQTT_CONNECTED_EVENT (1 << 0)
+#define MQTT_RECEIVE_TASK_EXITED (1 << 1)
+
+#define MQTT_CONNECT     0x10
+#define MQTT_CONNACK     0x20
+#define MQTT_PUBLISH     0x30
+#define MQTT_PUBACK      0x40
+#define MQTT_SUBSCRIBE   0x82
+#define MQTT_UNSUBSCRIBE 0xA2
+#define MQTT_PINGREQ     0xC0
+#define MQTT_DISCONNECT  0xE0
+
+#define MQTT_CONNECT_TIMEOUT_MS 10000
+
+static void AppendString(std::string& body, const std::string& value) {
+    body.push_back(value.size() >> 8);
+    body.push_back(value.size() & 0xFF);
+    body += value;
+}
+
+static void AppendUint16(std::string& body, uint16_t value) {
+    body.push_back(value >> 8);
+    body.push_back(value & 0xFF);
+}
+
+PosixMqtt::PosixMqtt() {
+    event_group_ = xEventGroupCreate();
+    xEventGroupSetBits(event_group_, MQTT_RECEIVE_TASK_EXITED);
+
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            PosixMqtt* mqtt = (PosixMqtt*)arg;
+            mqtt->SendPacket(MQTT_PINGREQ, "");
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "mqtt_keep_alive",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&timer_args, &keep_alive_timer_);
+}
+
+PosixMqtt::~PosixMqtt() {
+    Disconnect();
+    esp_timer_delete(keep_alive_timer_);
+    vEventGroupDelete(event_group_);
+}
+
+bool PosixMqtt::Connect(const std::string broker_address, int broker_port, const std::string client_id, const std::string username, const std::string password) {
+    Disconnect();
+
+    // 8883 is the well known MQTT over TLS port, which is what the server hands out
+    transport_ = CreatePosixTransport(broker_port == 8883);
+    if (!transport_->Connect(broker_address.c_str(), broker_port)) {
+        delete transport_;
+        transport_ = nullptr;
+        return false;
+    }
+
+    std::string body;
+    AppendString(body, "MQTT");
+    body.push_back(4);  // Protocol level 3.1.1
+    uint8_t flags = 0x02;  // Clean session
+    if (!username.empty()) {
+        flags |= 0x80;
+    }
+    if (!password.empty()) {
+        flags |= 0x40;
+    }
+    body.push_back(flags);
+    AppendUint16(body, keep_alive_seconds_);
+    AppendString(body, client_id);
+    if (!username.empty()) {
+        AppendString(body, username);
+    }
+    if (!password.empty()) {
+        AppendString(body, password);
+    }
+
+    xEventGroupClearBits(event_group_, MQTT_CONNECTED_EVENT | MQTT_RECEIVE_TASK_EXITED);
+    xTaskCreate([](void* arg) {
+        PosixMqtt* mqtt = (PosixMqtt*)arg;
+        mqtt->ReceiveTask();
+        xEventGroupSetBits(mqtt->event_group_, MQTT_RECEIVE_TASK_EXITED);
+        vTaskDelete(NULL);
+    }, "mqtt_receive", 4096, this, 1, nullptr);
+
+    if (!SendPacket(MQTT_CONNECT, body)) {
+        Disconnect();
+        return false;
+    }
+    auto bits = xEventGroupWaitBits(event_group_, MQTT_CONNECTED_EVENT | MQTT_RECEIVE_TASK_EXITED,
+        pdFALSE, pdFALSE, pdMS_TO_TICKS(MQTT_CONNECT_TIMEOUT_MS));
+    if (!(bits & MQTT_CONNECTED_EVENT)) {
+        ESP_LOGE(TAG, "Failed to connect to %s:%d", broker_address.c_str(), broker_port);
+        Disconnect();
+        return false;
+    }
+
+    esp_timer_start_periodic(keep_alive_timer_, keep_alive_seconds_ * 1000000ULL / 2);
+    if (on_connected_callback_) {
+        on_connected_callback_();
+    }
+    return true;
+}
+
+void PosixMqtt::Disconnect() {
+    if (transport_ == nullptr) {
+        return;
+    }
+    esp_timer_stop(keep_alive_timer_);
+    if (connected_) {
+        SendPacket(MQTT_DISCONNECT, "");
+    }
+    transport_->Disconnect();
+    xEventGroupWaitBits(event_group_, MQTT_RECEIVE_TASK_EXITED, pdFALSE, pdFALSE, portMAX_DELAY);
+    delete transport_;
+    transport_ = nullptr;
+}
+
+bool PosixMqtt::Publish(const std::string topic, const std::string payload, int qos) {
+    std::string body;
+    AppendString(body, topic);
+    uint8_t header = MQTT_PUBLISH;
+    if (qos > 0) {
+        header |= 0x02;
+        AppendUint16(body, ++packet_id_ == 0 ? ++packet_id_ : packet_id_);
+    }
+    body += payload;
+    return SendPacket(header, body);
+}
+
+bool PosixMqtt::Subscribe(const std::string topic, int qos) {
+    std::string body;
+    AppendUint16(body, ++packet_id_ == 0 ? ++packet_id_ : packet_id_);
+    AppendString(body, topic);
+    body.push_back(qos > 0 ? 1 : 0);
+    return SendPacket(MQTT_SUBSCRIBE, body);
+}
+
+bool PosixMqtt::Unsubscribe(const std::string topic) {
+    std::string body;
+    AppendUint16(body, ++packet_id_ == 0 ? ++packet_id_ : packet_id_);
+    AppendString(body, topic);
+    return SendPacket(MQTT_UNSUBSCRIBE, body);
+}
+
+bool PosixMqtt::IsConnected() {
+    return connected_ && transport_ != nullptr && transport_->connected();
+}
+
+bool PosixMqtt::SendPacket(uint8_t header, const std::string& body) {
+    std::string packet;
+    packet.push_back(header);
+    size_t length = body.size();
+    do {
+        uint8_t byte = length % 128;
+        length /= 128;
+        packet.push_back(length > 0 ? byte | 0x80 : byte);
+    } while (length > 0);
+    packet += body;
+
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    if (transport_ == nullptr || !transport_->connected()) {
+        return false;
+    }
+    return transport_->Send(packet.data(), packet.size()) == (int)packet.size();
+}
+
+bool PosixMqtt::ReceivePacket(uint8_t& header, std::string& body) {
+    auto receive_exact = [this](char* buffer, size_t length) {
+        while (length > 0) {
+            int ret = transport_->Receive(buffer, length);
+            if (ret <= 0) {
+                return false;
+            }
+            buffer += ret;
+            length -= ret;
+        }
+        return true;
+    };
+
+    if (!receive_exact((char*)&header, 1)) {
+        return false;
+    }
+    size_t length = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+        if (shift > 21 || !receive_exact((char*)&byte, 1)) {
+            return false;
+        }
+        length |= (size_t)(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    body.resize(length);
+    return length == 0 || receive_exact(body.data(), length);
+}
+
+void PosixMqtt::ReceiveTask() {
+    uint8_t header;
+    std::string body;
+    while (ReceivePacket(header, body)) {
+        switch (header & 0xF0) {
+            case MQTT_CONNACK:
+                if (body.size() >= 2 && body[1] == 0) {
+                    connected_ = true;
+                    xEventGroupSetBits(event_group_, MQTT_CONNECTED_EVENT);
+                } else {
+                    ESP_LOGE(TAG, "Connection refused, return code %d", body.size() >= 2 ? body[1] : -1);
+                }
+                break;
+            case MQTT_PUBLISH: {
+                if (body.size() < 2) {
+                    break;
+                }
+                uint8_t qos = (header >> 1) & 0x03;
+                size_t topic_length = ((uint8_t)body[0] << 8) | (uint8_t)body[1];
+                size_t offset = 2 + topic_length;
+                std::string topic = body.substr(2, topic_length);
+                if (qos > 0 && offset + 2 <= body.size()) {
+                    SendPacket(MQTT_PUBACK, body.substr(offset, 2));
+                    offset += 2;
+                }
+                if (on_message_callback_) {
+                    on_message_callback_(topic, body.substr(std::min(offset, body.size())));
+                }
+                break;
+            }
+            default:
+                // SUBACK, UNSUBACK, PUBACK and PINGRESP need no handling
+                break;
+        }
+    }
+
+    bool was_connected = connected_;
+    connected_ = false;
+    transport_->Disconnect();
+    if (was_connected && on_disconnected_callback_) {
+        on_disconnected_callback_();
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef _POSIX_MQTT_H_
+#define _POSIX_MQTT_H_
+
+#include <mqtt.h>
+#include <transport.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <esp_timer.h>
+
+#include <mutex>
+#include <string>
+
+// MQTT 3.1.1 client, QoS 0/1 publish and subscribe, enough for MqttProtocol
+class PosixMqtt : public Mqtt {
+public:
+    PosixMqtt();
+    virtual ~PosixMqtt();
+
+    virtual bool Connect(const std::string broker_address, int broker_port, const std::string client_id, const std::string username, const std::string password) override;
+    virtual void Disconnect() override;
+    virtual bool Publish(const std::string topic, const std::string payload, int qos = 0) override;
+    virtual bool Subscribe(const std::string topic, int qos = 0) override;
+    virtual bool Unsubscribe(const std::string topic) override;
+    virtual bool IsConnected() override;
+
+private:
+    Transport* transport_ = nullptr;
+    EventGroupHandle_t event_group_;
+    esp_timer_handle_t keep_alive_timer_ = nullptr;
+    std::mutex send_mutex_;
+    uint16_t packet_id_ = 0;
+    bool connected_ = false;
+
+    bool SendPacket(uint8_t header, const std::string& body);
+    bool ReceivePacket(uint8_t& header, std::string& body);
+    void ReceiveTask();
+};
+
+#endif // _POSIX_MQTT_H_
@@ -0,0 +1,246 @@
+#include "posix_transport.h"
+#include "config.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+
+#include <cerrno>
+#include <cstring>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define TAG "PosixTransport"
+
+int posix_connect(const char* host, int port, int type) {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = type;
+    struct addrinfo* result = nullptr;
+    std::string service = std::to_string(port);
+    int ret = getaddrinfo(host, service.c_str(), &hints, &result);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to resolve %s: %s", host, gai_strerror(ret));
+        return -1;
+    }
+
+    int fd = -1;
+    for (auto ai = result; ai != nullptr; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+
+    if (fd < 0) {
+        ESP_LOGE(TAG, "Failed to connect to %s:%d", host, port);
+        return -1;
+    }
+    if (type == SOCK_STREAM) {
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    }
+    return fd;
+}
+
+bool posix_wait_readable(int fd, const std::atomic<bool>& closing) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    while (!closing) {
+        int ret = poll(&pfd, 1, 0);
+        if (ret > 0) {
+            return true;
+        }
+        if (ret < 0 && errno != EINTR) {
+            return false;
+        }
+        vTaskDelay(pdMS_TO_TICKS(SIMULATOR_SOCKET_POLL_MS));
+    }
+    return false;
+}
+
+PosixTcpTransport::PosixTcpTransport() {
+}
+
+PosixTcpTransport::~PosixTcpTransport() {
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+bool PosixTcpTransport::Connect(const char* host, int port) {
+    closing_ = false;
+    fd_ = posix_connect(host, port, SOCK_STREAM);
+    connected_ = fd_ >= 0;
+    return connected_;
+}
+
+void PosixTcpTransport::Disconnect() {
+    // Only flag the socket, the reader notices within one poll interval and the fd is closed in the destructor
+    closing_ = true;
+    connected_ = false;
+    if (fd_ >= 0) {
+        shutdown(fd_, SHUT_RDWR);
+    }
+}
+
+int PosixTcpTransport::Send(const char* data, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        int ret = send(fd_, data + sent, length - sent, MSG_NOSIGNAL);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            ESP_LOGE(TAG, "Send failed: %s", strerror(errno));
+            connected_ = false;
+            return -1;
+        }
+        sent += ret;
+    }
+    return sent;
+}
+
+int PosixTcpTransport::Receive(char* buffer, size_t bufferSize) {
+    if (!posix_wait_readable(fd_, closing_)) {
+        return -1;
+    }
+    int ret = recv(fd_, buffer, bufferSize, 0);
+    if (ret <= 0) {
+        connected_ = false;
+    }
+    return ret;
+}
+
+static int tls_send(void* ctx, const unsigned char* buf, size_t len) {
+    int ret = send(*(int*)ctx, buf, len, MSG_NOSIGNAL);
+    return ret < 0 ? MBEDTLS_ERR_SSL_WANT_WRITE : ret;
+}
+
+static int tls_recv(void* ctx, unsigned char* buf, size_t len) {
+    int ret = recv(*(int*)ctx, buf, len, MSG_DONTWAIT);
+    if (ret < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? MBEDTLS_ERR_SSL_WANT_READ : -1;
+    }
+    return ret;
+}
+
+PosixTlsTransport::PosixTlsTransport() {
+    mbedtls_ssl_init(&ssl_);
+    mbedtls_ssl_config_init(&conf_);
+    mbedtls_entropy_init(&entropy_);
+    mbedtls_ctr_drbg_init(&ctr_drbg_);
+    mbedtls_x509_crt_init(&ca_);
+}
+
+PosixTlsTransport::~PosixTlsTransport() {
+    mbedtls_ssl_free(&ssl_);
+    mbedtls_ssl_config_free(&conf_);
+    mbedtls_ctr_drbg_free(&ctr_drbg_);
+    mbedtls_entropy_free(&entropy_);
+    mbedtls_x509_crt_free(&ca_);
+}
+
+bool PosixTlsTransport::Connect(const char* host, int port) {
+    if (!PosixTcpTransport::Connect(host, port)) {
+        return false;
+    }
+
+    int ret = mbedtls_ctr_drbg_seed(&ctr_drbg_, mbedtls_entropy_func, &entropy_, nullptr, 0);
+    if (ret == 0) {
+        ret = mbedtls_ssl_config_defaults(&conf_, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    }
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to set up TLS: -0x%x", -ret);
+        PosixTcpTransport::Disconnect();
+        return false;
+    }
+
+    int authmode = MBEDTLS_SSL_VERIFY_NONE;
+#ifdef MBEDTLS_FS_IO
+    if (mbedtls_x509_crt_parse_file(&ca_, SIMULATOR_CA_BUNDLE_PATH) >= 0) {
+        mbedtls_ssl_conf_ca_chain(&conf_, &ca_, nullptr);
+        authmode = MBEDTLS_SSL_VERIFY_REQUIRED;
+    }
+#endif
+    if (authmode == MBEDTLS_SSL_VERIFY_NONE) {
+        ESP_LOGW(TAG, "No CA bundle at %s, the server certificate is not verified", SIMULATOR_CA_BUNDLE_PATH);
+    }
+    mbedtls_ssl_conf_authmode(&conf_, authmode);
+    mbedtls_ssl_conf_rng(&conf_, mbedtls_ctr_drbg_random, &ctr_drbg_);
+
+    mbedtls_ssl_setup(&ssl_, &conf_);
+    mbedtls_ssl_set_hostname(&ssl_, host);
+    mbedtls_ssl_set_bio(&ssl_, &fd_, tls_send, tls_recv, nullptr);
+
+    while ((ret = mbedtls_ssl_handshake(&ssl_)) != 0) {
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            ESP_LOGE(TAG, "TLS handshake with %s failed: -0x%x", host, -ret);
+            PosixTcpTransport::Disconnect();
+            return false;
+        }
+        if (!posix_wait_readable(fd_, closing_)) {
+            PosixTcpTransport::Disconnect();
+            return false;
+        }
+    }
+    return true;
+}
+
+void PosixTlsTransport::Disconnect() {
+    if (connected_) {
+        mbedtls_ssl_close_notify(&ssl_);
+    }
+    PosixTcpTransport::Disconnect();
+}
+
+int PosixTlsTransport::Send(const char* data, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        int ret = mbedtls_ssl_write(&ssl_, (const unsigned char*)data + sent, length - sent);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            continue;
+        }
+        if (ret <= 0) {
+            ESP_LOGE(TAG, "TLS write failed: -0x%x", -ret);
+            connected_ = false;
+            return -1;
+        }
+        sent += ret;
+    }
+    return sent;
+}
+
+int PosixTlsTransport::Receive(char* buffer, size_t bufferSize) {
+    while (true) {
+        // Records that were already decrypted do not show up on the socket
+        if (mbedtls_ssl_get_bytes_avail(&ssl_) == 0 && !posix_wait_readable(fd_, closing_)) {
+            return -1;
+        }
+        int ret = mbedtls_ssl_read(&ssl_, (unsigned char*)buffer, bufferSize);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            continue;
+        }
+        if (ret <= 0) {
+            connected_ = false;
+            return ret == 0 || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY ? 0 : -1;
+        }
+        return ret;
+    }
+}
+
+Transport* CreatePosixTransport(bool secure) {
+    if (secure) {
+        return new PosixTlsTransport();
+    }
+    return new PosixTcpTransport();
+}
@@ -0,0 +1,55 @@
+#ifndef _POSIX_TRANSPORT_H_
+#define _POSIX_TRANSPORT_H_
+
+#include <transport.h>
+#include <string>
+#include <atomic>
+
+#include <mbedtls/ssl.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+
+// Host sockets used from FreeRTOS tasks. The POSIX port runs one task at a time,
+// so a task must never sleep inside the kernel: sockets are polled and the task
+// yields with vTaskDelay while there is nothing to read.
+int posix_connect(const char* host, int port, int type);
+bool posix_wait_readable(int fd, const std::atomic<bool>& closing);
+
+class PosixTcpTransport : public Transport {
+public:
+    PosixTcpTransport();
+    virtual ~PosixTcpTransport();
+
+    virtual bool Connect(const char* host, int port) override;
+    virtual void Disconnect() override;
+    virtual int Send(const char* data, size_t length) override;
+    virtual int Receive(char* buffer, size_t bufferSize) override;
+
+protected:
+    int fd_ = -1;
+    std::atomic<bool> closing_{false};
+};
+
+class PosixTlsTransport : public PosixTcpTransport {
+public:
+    PosixTlsTransport();
+    virtual ~PosixTlsTransport();
+
+    virtual bool Connect(const char* host, int port) override;
+    virtual void Disconnect() override;
+    virtual int Send(const char* data, size_t length) override;
+    virtual int Receive(char* buffer, size_t bufferSize) override;
+
+private:
+    mbedtls_ssl_context ssl_;
+    mbedtls_ssl_config conf_;
+    mbedtls_entropy_context entropy_;
+    mbedtls_ctr_drbg_context ctr_drbg_;
+    mbedtls_x509_crt ca_;
+};
+
+// TLS over mbedtls when secure is set, plain TCP otherwise
+Transport* CreatePosixTransport(bool secure);
+
+#endif // _POSIX_TRANSPORT_H_
@@ -0,0 +1,81 @@
+#include "posix_udp.h"
+#include "posix_transport.h"
+
+#include <freertos/task.h>
+#include <esp_log.h>
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define TAG "PosixUdp"
+
+#define UDP_RECEIVE_TASK_EXITED (1 << 0)
+
+PosixUdp::PosixUdp() {
+    event_group_ = xEventGroupCreate();
+    xEventGroupSetBits(event_group_, UDP_RECEIVE_TASK_EXITED);
+}
+
+PosixUdp::~PosixUdp() {
+    Disconnect();
+    vEventGroupDelete(event_group_);
+}
+
+bool PosixUdp::Connect(const std::string& host, int port) {
+    Disconnect();
+    fd_ = posix_connect(host.c_str(), port, SOCK_DGRAM);
+    if (fd_ < 0) {
+        return false;
+    }
+    closing_ = false;
+    connected_ = true;
+
+    xEventGroupClearBits(event_group_, UDP_RECEIVE_TASK_EXITED);
+    xTaskCreate([](void* arg) {
+        PosixUdp* udp = (PosixUdp*)arg;
+        udp->ReceiveTask();
+        xEventGroupSetBits(udp->event_group_, UDP_RECEIVE_TASK_EXITED);
+        vTaskDelete(NULL);
+    }, "udp_receive", 4096, this, 1, nullptr);
+    return true;
+}
+
+void PosixUdp::Disconnect() {
+    if (fd_ < 0) {
+        return;
+    }
+    closing_ = true;
+    connected_ = false;
+    xEventGroupWaitBits(event_group_, UDP_RECEIVE_TASK_EXITED, pdFALSE, pdFALSE, portMAX_DELAY);
+    close(fd_);
+    fd_ = -1;
+}
+
+int PosixUdp::Send(const std::string& data) {
+    if (!connected_) {
+        return -1;
+    }
+    int ret = send(fd_, data.data(), data.size(), 0);
+    if (ret < 0) {
+        ESP_LOGW(TAG, "Send failed: %s", strerror(errno));
+    }
+    return ret;
+}
+
+void PosixUdp::ReceiveTask() {
+    std::string buffer;
+    while (posix_wait_readable(fd_, closing_)) {
+        buffer.resize(1500);
+        int ret = recv(fd_, buffer.data(), buffer.size(), 0);
+        if (ret < 0) {
+            // ECONNREFUSED is reported for ICMP errors, keep listening like lwIP does
+            continue;
+        }
+        buffer.resize(ret);
+        if (message_callback_) {
+            message_callback_(buffer);
+        }
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef _POSIX_UDP_H_
+#define _POSIX_UDP_H_
+
+#include <udp.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+
+#include <atomic>
+#include <string>
+
+class PosixUdp : public Udp {
+public:
+    PosixUdp();
+    virtual ~PosixUdp();
+
+    virtual bool Connect(const std::string& host, int port) override;
+    virtual void Disconnect() override;
+    virtual int Send(const std::string& data) override;
+
+private:
+    int fd_ = -1;
+    std::atomic<bool> closing_{false};
+    EventGroupHandle_t event_group_;
+
+    void ReceiveTask();
+};
+
+#endif // _POSIX_UDP_H_
@@ -0,0 +1,170 @@
+#include "esp_timer.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <esp_log.h>
+
+#include <list>
+#include <time.h>
+
+#define TAG "esp_timer"
+
+struct esp_timer {
+    esp_timer_cb_t callback;
+    void* arg;
+    const char* name;
+    bool skip_unhandled_events;
+    bool active;
+    int64_t alarm_us;
+    uint64_t period_us;
+};
+
+static SemaphoreHandle_t timer_mutex = nullptr;
+static TaskHandle_t timer_task = nullptr;
+// Active timers sorted by alarm time
+static std::list<esp_timer*> timer_list;
+
+static void timer_insert(esp_timer* timer) {
+    auto it = timer_list.begin();
+    while (it != timer_list.end() && (*it)->alarm_us <= timer->alarm_us) {
+        ++it;
+    }
+    timer_list.insert(it, timer);
+    timer->active = true;
+}
+
+static void timer_remove(esp_timer* timer) {
+    if (timer->active) {
+        timer_list.remove(timer);
+        timer->active = false;
+    }
+}
+
+static void timer_task_loop(void* arg) {
+    while (true) {
+        TickType_t wait = portMAX_DELAY;
+        esp_timer* expired = nullptr;
+
+        xSemaphoreTake(timer_mutex, portMAX_DELAY);
+        if (!timer_list.empty()) {
+            auto timer = timer_list.front();
+            int64_t now = esp_timer_get_time();
+            if (timer->alarm_us <= now) {
+                timer_list.pop_front();
+                timer->active = false;
+                if (timer->period_us > 0) {
+                    timer->alarm_us += timer->period_us;
+                    if (timer->skip_unhandled_events && timer->alarm_us <= now) {
+                        timer->alarm_us = now + timer->period_us;
+                    }
+                    timer_insert(timer);
+                }
+                expired = timer;
+            } else {
+                wait = pdMS_TO_TICKS((timer->alarm_us - now + 999) / 1000);
+                if (wait == 0) {
+                    wait = 1;
+                }
+            }
+        }
+        xSemaphoreGive(timer_mutex);
+
+        if (expired != nullptr) {
+            // The callback may stop or delete its own timer, do not touch it afterwards
+            expired->callback(expired->arg);
+            continue;
+        }
+        ulTaskNotifyTake(pdTRUE, wait);
+    }
+}
+
+static void timer_init() {
+    if (timer_task != nullptr) {
+        return;
+    }
+    timer_mutex = xSemaphoreCreateMutex();
+    xTaskCreate(timer_task_loop, "esp_timer", 4096, nullptr, configMAX_PRIORITIES - 2, &timer_task);
+}
+
+extern "C" {
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* create_args, esp_timer_handle_t* out_handle) {
+    if (create_args == nullptr || create_args->callback == nullptr || out_handle == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (create_args->dispatch_method == ESP_TIMER_ISR) {
+        ESP_LOGW(TAG, "Timer %s: ISR dispatch is emulated on the timer task", create_args->name);
+    }
+    timer_init();
+    auto timer = new esp_timer();
+    timer->callback = create_args->callback;
+    timer->arg = create_args->arg;
+    timer->name = create_args->name;
+    timer->skip_unhandled_events = create_args->skip_unhandled_events;
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+static esp_err_t timer_start(esp_timer_handle_t timer, uint64_t timeout_us, uint64_t period_us) {
+    if (timer == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    xSemaphoreTake(timer_mutex, portMAX_DELAY);
+    if (timer->active) {
+        xSemaphoreGive(timer_mutex);
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->alarm_us = esp_timer_get_time() + timeout_us;
+    timer->period_us = period_us;
+    timer_insert(timer);
+    xSemaphoreGive(timer_mutex);
+    xTaskNotifyGive(timer_task);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    return timer_start(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period) {
+    return timer_start(timer, period, period);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    if (timer == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    xSemaphoreTake(timer_mutex, portMAX_DELAY);
+    bool active = timer->active;
+    timer_remove(timer);
+    timer->period_us = 0;
+    xSemaphoreGive(timer_mutex);
+    return active ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+    if (timer == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    xSemaphoreTake(timer_mutex, portMAX_DELAY);
+    if (timer->active) {
+        xSemaphoreGive(timer_mutex);
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreGive(timer_mutex);
+    delete timer;
+    return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer) {
+    return timer != nullptr && timer->active;
+}
+
+int64_t esp_timer_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+} // extern "C"
@@ -0,0 +1,166 @@
+// Implementations of the ESP-IDF APIs that the linux target does not provide,
+// see the headers in shims/include.
+#include <driver/gpio.h>
+#include <driver/i2s_common.h>
+#include <esp_pm.h>
+#include <esp_mac.h>
+#include <esp_chip_info.h>
+#include <esp_flash.h>
+#include <esp_ota_ops.h>
+#include <esp_random.h>
+#include <esp_log.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <unistd.h>
+#include <sys/random.h>
+
+#define TAG "SimShims"
+
+#ifndef SIMULATOR_FLASH_SIZE
+#define SIMULATOR_FLASH_SIZE (16 * 1024 * 1024)
+#endif
+
+extern "C" {
+
+esp_err_t gpio_config(const gpio_config_t* config) {
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level) {
+    ESP_LOGD(TAG, "GPIO %d -> %lu", gpio_num, (unsigned long)level);
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num) {
+    return 0;
+}
+
+esp_err_t i2s_channel_register_event_callback(i2s_chan_handle_t handle, const i2s_event_callbacks_t* callbacks, void* user_data) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t i2s_channel_enable(i2s_chan_handle_t handle) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t i2s_channel_disable(i2s_chan_handle_t handle) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t esp_pm_lock_create(esp_pm_lock_type_t lock_type, int arg, const char* name, esp_pm_lock_handle_t* out_handle) {
+    *out_handle = nullptr;
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t esp_pm_lock_delete(esp_pm_lock_handle_t handle) {
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t handle) {
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t handle) {
+    return ESP_OK;
+}
+
+esp_err_t esp_read_mac(uint8_t* mac, esp_mac_type_t type) {
+    const char* env = getenv("XIAOZHI_SIM_MAC");
+    unsigned int bytes[6];
+    if (env != nullptr && sscanf(env, "%x:%x:%x:%x:%x:%x",
+            &bytes[0], &bytes[1], &bytes[2], &bytes[3], &bytes[4], &bytes[5]) == 6) {
+        for (int i = 0; i < 6; ++i) {
+            mac[i] = (uint8_t)bytes[i];
+        }
+    } else {
+        char hostname[64] = {0};
+        gethostname(hostname, sizeof(hostname) - 1);
+        size_t hash = std::hash<std::string>()(hostname);
+        // Locally administered unicast address
+        mac[0] = 0x02;
+        for (int i = 1; i < 6; ++i) {
+            mac[i] = (uint8_t)(hash >> (i * 8));
+        }
+    }
+    mac[5] += (uint8_t)type;
+    return ESP_OK;
+}
+
+void esp_chip_info(esp_chip_info_t* out_info) {
+    memset(out_info, 0, sizeof(*out_info));
+    out_info->model = CHIP_POSIX_LINUX;
+    out_info->cores = (uint8_t)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+esp_err_t esp_flash_get_size(esp_flash_t* chip, uint32_t* out_size) {
+    *out_size = SIMULATOR_FLASH_SIZE;
+    return ESP_OK;
+}
+
+const esp_partition_t* esp_ota_get_running_partition(void) {
+    static esp_partition_t factory = {};
+    if (factory.label[0] == '\0') {
+        factory.type = ESP_PARTITION_TYPE_APP;
+        factory.subtype = ESP_PARTITION_SUBTYPE_APP_FACTORY;
+        strncpy(factory.label, "factory", sizeof(factory.label) - 1);
+    }
+    return &factory;
+}
+
+const esp_partition_t* esp_ota_get_next_update_partition(const esp_partition_t* start_from) {
+    return nullptr;
+}
+
+esp_err_t esp_ota_get_state_partition(const esp_partition_t* partition, esp_ota_img_states_t* ota_state) {
+    *ota_state = ESP_OTA_IMG_VALID;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_valid_cancel_rollback(void) {
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t* partition, size_t image_size, esp_ota_handle_t* out_handle) {
+    ESP_LOGW(TAG, "Firmware upgrade is not supported by the simulator");
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void* data, size_t size) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle) {
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t* partition) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+uint32_t esp_random(void) {
+    uint32_t value = 0;
+    esp_fill_random(&value, sizeof(value));
+    return value;
+}
+
+void esp_fill_random(void* buf, size_t len) {
+    uint8_t* p = (uint8_t*)buf;
+    while (len > 0) {
+        ssize_t ret = getrandom(p, len, 0);
+        if (ret <= 0) {
+            continue;
+        }
+        p += ret;
+        len -= ret;
+    }
+}
+
+} // extern "C"
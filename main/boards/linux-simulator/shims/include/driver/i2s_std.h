@@ -0,0 +1,4 @@
+// Simulator shim, see i2s_common.h
+#pragma once
+
+#include "driver/i2s_common.h"
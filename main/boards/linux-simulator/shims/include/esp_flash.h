@@ -0,0 +1,17 @@
+// Simulator shim, the flash size comes from SIMULATOR_FLASH_SIZE.
+#pragma once
+
+#include <stdint.h>
+#include <esp_err.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct esp_flash_t esp_flash_t;
+
+esp_err_t esp_flash_get_size(esp_flash_t* chip, uint32_t* out_size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,23 @@
+// Simulator shim. The MAC address is taken from XIAOZHI_SIM_MAC ("aa:bb:cc:dd:ee:ff")
+// or derived from the host name, so every workstation shows up as a different device.
+#pragma once
+
+#include <stdint.h>
+#include <esp_err.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    ESP_MAC_WIFI_STA,
+    ESP_MAC_WIFI_SOFTAP,
+    ESP_MAC_BT,
+    ESP_MAC_ETH,
+} esp_mac_type_t;
+
+esp_err_t esp_read_mac(uint8_t* mac, esp_mac_type_t type);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,9 @@
+// Simulator shim, the host has no external RAM.
+#pragma once
+
+#include <stdbool.h>
+
+static inline bool esp_ptr_external_ram(const void* p) {
+    (void)p;
+    return false;
+}
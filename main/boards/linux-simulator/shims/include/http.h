@@ -0,0 +1,20 @@
+// Mirrors the Http interface of the esp-ml307 component, which is not built for the linux target.
+#ifndef _HTTP_H_
+#define _HTTP_H_
+
+#include <string>
+
+class Http {
+public:
+    virtual ~Http() = default;
+    virtual void SetHeader(const std::string& key, const std::string& value) = 0;
+    virtual bool Open(const std::string& method, const std::string& url, const std::string& content = "") = 0;
+    virtual void Close() = 0;
+    virtual int GetStatusCode() const = 0;
+    virtual std::string GetResponseHeader(const std::string& key) const = 0;
+    virtual size_t GetBodyLength() const = 0;
+    virtual const std::string& GetBody() = 0;
+    virtual int Read(char* buffer, size_t buffer_size) = 0;
+};
+
+#endif // _HTTP_H_
@@ -0,0 +1,23 @@
+// Mirrors the Udp interface of the esp-ml307 component, which is not built for the linux target.
+#ifndef _UDP_H_
+#define _UDP_H_
+
+#include <string>
+#include <functional>
+
+class Udp {
+public:
+    virtual ~Udp() = default;
+    virtual bool Connect(const std::string& host, int port) = 0;
+    virtual void Disconnect() = 0;
+    virtual int Send(const std::string& data) = 0;
+
+    virtual void OnMessage(std::function<void(const std::string& data)> callback) { message_callback_ = std::move(callback); }
+    bool connected() const { return connected_; }
+
+protected:
+    std::function<void(const std::string& data)> message_callback_;
+    bool connected_ = false;
+};
+
+#endif // _UDP_H_
@@ -0,0 +1,52 @@
+// Same API as the WebSocket class of the esp-ml307 component, which is not built for the linux target.
+// Client side RFC 6455 over any Transport, the receive loop runs on its own task.
+#ifndef _WEB_SOCKET_H_
+#define _WEB_SOCKET_H_
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/task.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <functional>
+
+#include "transport.h"
+
+class WebSocket {
+public:
+    WebSocket(Transport* transport);
+    ~WebSocket();
+
+    void SetHeader(const char* key, const char* value);
+    bool IsConnected() const;
+    bool Connect(const char* uri);
+    bool Send(const std::string& data);
+    bool Send(const void* data, size_t len, bool binary = false, bool fin = true);
+    void Ping();
+    void Close();
+
+    void OnConnected(std::function<void()> callback);
+    void OnDisconnected(std::function<void()> callback);
+    void OnData(std::function<void(const char*, size_t, bool binary)> callback);
+    void OnError(std::function<void(int)> callback);
+
+private:
+    Transport* transport_;
+    TaskHandle_t receive_task_ = nullptr;
+    EventGroupHandle_t event_group_;
+    std::mutex send_mutex_;
+    bool continuation_ = false;
+    std::map<std::string, std::string> headers_;
+    std::function<void(const char*, size_t, bool binary)> on_data_;
+    std::function<void(int)> on_error_;
+    std::function<void()> on_connected_;
+    std::function<void()> on_disconnected_;
+
+    bool SendFrame(uint8_t opcode, const void* data, size_t len, bool fin);
+    bool ReceiveExact(char* buffer, size_t length);
+    void ReceiveTask();
+};
+
+#endif // _WEB_SOCKET_H_
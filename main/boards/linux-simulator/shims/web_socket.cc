@@ -0,0 +1,264 @@
+#include "web_socket.h"
+
+#include <esp_log.h>
+#include <esp_random.h>
+#include <mbedtls/base64.h>
+
+#include <cstring>
+#include <vector>
+
+#define TAG "WebSocket"
+
+#define WEBSOCKET_RECEIVE_TASK_EXITED (1 << 0)
+
+WebSocket::WebSocket(Transport* transport) : transport_(transport) {
+    event_group_ = xEventGroupCreate();
+}
+
+WebSocket::~WebSocket() {
+    if (transport_->connected()) {
+        Close();
+        transport_->Disconnect();
+    }
+    if (receive_task_ != nullptr) {
+        xEventGroupWaitBits(event_group_, WEBSOCKET_RECEIVE_TASK_EXITED, pdFALSE, pdFALSE, portMAX_DELAY);
+    }
+    vEventGroupDelete(event_group_);
+    delete transport_;
+}
+
+void WebSocket::SetHeader(const char* key, const char* value) {
+    headers_[key] = value;
+}
+
+bool WebSocket::IsConnected() const {
+    return transport_->connected();
+}
+
+bool WebSocket::Connect(const char* uri) {
+    std::string url = uri;
+    bool secure = url.find("wss://") == 0;
+    size_t host_start = url.find("://");
+    if (host_start == std::string::npos) {
+        ESP_LOGE(TAG, "Invalid URI: %s", uri);
+        return false;
+    }
+    host_start += 3;
+    size_t path_start = url.find('/', host_start);
+    std::string host_port = url.substr(host_start, path_start == std::string::npos ? std::string::npos : path_start - host_start);
+    std::string path = path_start == std::string::npos ? "/" : url.substr(path_start);
+
+    std::string host = host_port;
+    int port = secure ? 443 : 80;
+    size_t colon = host_port.find(':');
+    if (colon != std::string::npos) {
+        host = host_port.substr(0, colon);
+        port = std::stoi(host_port.substr(colon + 1));
+    }
+
+    if (!transport_->Connect(host.c_str(), port)) {
+        ESP_LOGE(TAG, "Failed to connect to %s:%d", host.c_str(), port);
+        return false;
+    }
+
+    uint8_t nonce[16];
+    esp_fill_random(nonce, sizeof(nonce));
+    unsigned char key[32];
+    size_t key_length = 0;
+    mbedtls_base64_encode(key, sizeof(key), &key_length, nonce, sizeof(nonce));
+
+    std::string request = "GET " + path + " HTTP/1.1\r\n";
+    request += "Host: " + host_port + "\r\n";
+    request += "Upgrade: websocket\r\n";
+    request += "Connection: Upgrade\r\n";
+    request += "Sec-WebSocket-Key: " + std::string((char*)key, key_length) + "\r\n";
+    request += "Sec-WebSocket-Version: 13\r\n";
+    for (const auto& header : headers_) {
+        request += header.first + ": " + header.second + "\r\n";
+    }
+    request += "\r\n";
+    if (transport_->Send(request.data(), request.size()) != (int)request.size()) {
+        ESP_LOGE(TAG, "Failed to send the handshake");
+        transport_->Disconnect();
+        return false;
+    }
+
+    // Read the response byte by byte, so that no frame data is consumed with the headers
+    std::string response;
+    char c;
+    while (response.size() < 4096 && response.find("\r\n\r\n") == std::string::npos) {
+        if (transport_->Receive(&c, 1) != 1) {
+            ESP_LOGE(TAG, "Connection closed during the handshake");
+            transport_->Disconnect();
+            return false;
+        }
+        response.push_back(c);
+    }
+    if (response.find(" 101 ") == std::string::npos) {
+        ESP_LOGE(TAG, "Handshake failed: %s", response.substr(0, response.find("\r\n")).c_str());
+        transport_->Disconnect();
+        return false;
+    }
+
+    xEventGroupClearBits(event_group_, WEBSOCKET_RECEIVE_TASK_EXITED);
+    xTaskCreate([](void* arg) {
+        WebSocket* ws = (WebSocket*)arg;
+        ws->ReceiveTask();
+        xEventGroupSetBits(ws->event_group_, WEBSOCKET_RECEIVE_TASK_EXITED);
+        vTaskDelete(NULL);
+    }, "websocket", 4096, this, 1, &receive_task_);
+
+    if (on_connected_) {
+        on_connected_();
+    }
+    return true;
+}
+
+bool WebSocket::Send(const std::string& data) {
+    return Send(data.data(), data.size(), false);
+}
+
+bool WebSocket::Send(const void* data, size_t len, bool binary, bool fin) {
+    uint8_t opcode = continuation_ ? 0x0 : (binary ? 0x2 : 0x1);
+    continuation_ = !fin;
+    return SendFrame(opcode, data, len, fin);
+}
+
+void WebSocket::Ping() {
+    SendFrame(0x9, nullptr, 0, true);
+}
+
+void WebSocket::Close() {
+    SendFrame(0x8, nullptr, 0, true);
+}
+
+void WebSocket::OnConnected(std::function<void()> callback) {
+    on_connected_ = callback;
+}
+
+void WebSocket::OnDisconnected(std::function<void()> callback) {
+    on_disconnected_ = callback;
+}
+
+void WebSocket::OnData(std::function<void(const char*, size_t, bool binary)> callback) {
+    on_data_ = callback;
+}
+
+void WebSocket::OnError(std::function<void(int)> callback) {
+    on_error_ = callback;
+}
+
+bool WebSocket::SendFrame(uint8_t opcode, const void* data, size_t len, bool fin) {
+    if (!transport_->connected()) {
+        return false;
+    }
+
+    // Client frames are always masked
+    std::vector<uint8_t> frame;
+    frame.reserve(len + 14);
+    frame.push_back((fin ? 0x80 : 0x00) | opcode);
+    if (len < 126) {
+        frame.push_back(0x80 | len);
+    } else if (len < 65536) {
+        frame.push_back(0x80 | 126);
+        frame.push_back(len >> 8);
+        frame.push_back(len & 0xFF);
+    } else {
+        frame.push_back(0x80 | 127);
+        for (int i = 7; i >= 0; --i) {
+            frame.push_back(((uint64_t)len >> (i * 8)) & 0xFF);
+        }
+    }
+    uint8_t mask[4];
+    esp_fill_random(mask, sizeof(mask));
+    frame.insert(frame.end(), mask, mask + 4);
+    auto payload = (const uint8_t*)data;
+    for (size_t i = 0; i < len; ++i) {
+        frame.push_back(payload[i] ^ mask[i % 4]);
+    }
+
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    return transport_->Send((const char*)frame.data(), frame.size()) == (int)frame.size();
+}
+
+bool WebSocket::ReceiveExact(char* buffer, size_t length) {
+    while (length > 0) {
+        int ret = transport_->Receive(buffer, length);
+        if (ret <= 0) {
+            return false;
+        }
+        buffer += ret;
+        length -= ret;
+    }
+    return true;
+}
+
+void WebSocket::ReceiveTask() {
+    std::vector<char> message;
+    bool message_binary = false;
+    uint8_t header[2];
+
+    while (ReceiveExact((char*)header, sizeof(header))) {
+        bool fin = header[0] & 0x80;
+        uint8_t opcode = header[0] & 0x0F;
+        bool masked = header[1] & 0x80;
+        uint64_t length = header[1] & 0x7F;
+        if (length == 126) {
+            uint8_t ext[2];
+            if (!ReceiveExact((char*)ext, sizeof(ext))) {
+                break;
+            }
+            length = (ext[0] << 8) | ext[1];
+        } else if (length == 127) {
+            uint8_t ext[8];
+            if (!ReceiveExact((char*)ext, sizeof(ext))) {
+                break;
+            }
+            length = 0;
+            for (int i = 0; i < 8; ++i) {
+                length = (length << 8) | ext[i];
+            }
+        }
+        uint8_t mask[4] = {0};
+        if (masked && !ReceiveExact((char*)mask, sizeof(mask))) {
+            break;
+        }
+
+        std::vector<char> payload(length);
+        if (length > 0 && !ReceiveExact(payload.data(), length)) {
+            break;
+        }
+        if (masked) {
+            for (size_t i = 0; i < length; ++i) {
+                payload[i] ^= mask[i % 4];
+            }
+        }
+
+        if (opcode == 0x8) {
+            ESP_LOGI(TAG, "Connection closed by the server");
+            break;
+        } else if (opcode == 0x9) {
+            SendFrame(0xA, payload.data(), payload.size(), true);
+            continue;
+        } else if (opcode == 0xA) {
+            continue;
+        }
+
+        if (opcode != 0x0) {
+            message.clear();
+            message_binary = opcode == 0x2;
+        }
+        message.insert(message.end(), payload.begin(), payload.end());
+        if (fin) {
+            if (on_data_) {
+                on_data_(message.data(), message.size(), message_binary);
+            }
+            message.clear();
+        }
+    }
+
+    transport_->Disconnect();
+    if (on_disconnected_) {
+        on_disconnected_();
+    }
+}
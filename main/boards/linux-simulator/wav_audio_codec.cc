@@ -0,0 +1,246 @@
+#include "wav_audio_codec.h"
+#include "config.h"
+
+#include <esp_log.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#define TAG "WavAudioCodec"
+
+struct WavHeader {
+    char riff[4];
+    uint32_t riff_size;
+    char wave[4];
+    char fmt[4];
+    uint32_t fmt_size;
+    uint16_t audio_format;
+    uint16_t channels;
+    uint32_t sample_rate;
+    uint32_t byte_rate;
+    uint16_t block_align;
+    uint16_t bits_per_sample;
+    char data[4];
+    uint32_t data_size;
+};
+
+WavAudioCodec::WavAudioCodec(int input_sample_rate, int output_sample_rate, const std::string& input_path, const std::string& output_path) {
+    duplex_ = true;
+    input_reference_ = false;
+    input_channels_ = 1;
+    output_channels_ = 1;
+    input_sample_rate_ = input_sample_rate;
+    output_sample_rate_ = output_sample_rate;
+
+    if (!OpenInput(input_path)) {
+        ESP_LOGW(TAG, "No usable input %s, the microphone reads silence", input_path.c_str());
+    }
+    if (!OpenOutput(output_path)) {
+        ESP_LOGW(TAG, "Cannot write %s, the speaker output is discarded", output_path.c_str());
+    }
+    ESP_LOGI(TAG, "Simulated codec: input %s, output %s", input_path.c_str(), output_path.c_str());
+}
+
+WavAudioCodec::~WavAudioCodec() {
+    if (clock_task_ != nullptr) {
+        vTaskDelete(clock_task_);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (input_file_ != nullptr) {
+        fclose(input_file_);
+    }
+    if (output_file_ != nullptr) {
+        UpdateOutputHeader();
+        fclose(output_file_);
+    }
+}
+
+bool WavAudioCodec::OpenInput(const std::string& path) {
+    input_file_ = fopen(path.c_str(), "rb");
+    if (input_file_ == nullptr) {
+        return false;
+    }
+
+    // Walk the RIFF chunks, the fmt and data chunks are not always at fixed offsets
+    char riff[12];
+    bool format_ok = false;
+    if (fread(riff, 1, sizeof(riff), input_file_) == sizeof(riff) && memcmp(riff, "RIFF", 4) == 0 && memcmp(riff + 8, "WAVE", 4) == 0) {
+        char id[4];
+        uint32_t size;
+        while (fread(id, 1, 4, input_file_) == 4 && fread(&size, 4, 1, input_file_) == 1) {
+            if (memcmp(id, "fmt ", 4) == 0) {
+                uint16_t fmt[8] = {0};
+                if (fread(fmt, 1, std::min<uint32_t>(size, sizeof(fmt)), input_file_) < 16) {
+                    break;
+                }
+                uint32_t sample_rate = fmt[2] | ((uint32_t)fmt[3] << 16);
+                format_ok = fmt[0] == 1 && fmt[1] == input_channels_ && (int)sample_rate == input_sample_rate_ && fmt[7] == 16;
+                if (!format_ok) {
+                    ESP_LOGE(TAG, "%s: expected 16-bit PCM, %d channel(s), %d Hz", path.c_str(), input_channels_, input_sample_rate_);
+                    break;
+                }
+                fseek(input_file_, (long)size - std::min<long>(size, sizeof(fmt)) + (size & 1), SEEK_CUR);
+            } else if (memcmp(id, "data", 4) == 0) {
+                input_data_offset_ = ftell(input_file_);
+                return format_ok;
+            } else {
+                fseek(input_file_, size + (size & 1), SEEK_CUR);
+            }
+        }
+    }
+    fclose(input_file_);
+    input_file_ = nullptr;
+    return false;
+}
+
+bool WavAudioCodec::OpenOutput(const std::string& path) {
+    output_file_ = fopen(path.c_str(), "wb");
+    if (output_file_ == nullptr) {
+        return false;
+    }
+    output_data_bytes_ = 0;
+    UpdateOutputHeader();
+    return true;
+}
+
+// Must be called with mutex_ held
+void WavAudioCodec::UpdateOutputHeader() {
+    WavHeader header;
+    memcpy(header.riff, "RIFF", 4);
+    header.riff_size = 36 + output_data_bytes_;
+    memcpy(header.wave, "WAVE", 4);
+    memcpy(header.fmt, "fmt ", 4);
+    header.fmt_size = 16;
+    header.audio_format = 1;
+    header.channels = output_channels_;
+    header.sample_rate = output_sample_rate_;
+    header.bits_per_sample = 16;
+    header.block_align = output_channels_ * 2;
+    header.byte_rate = output_sample_rate_ * header.block_align;
+    memcpy(header.data, "data", 4);
+    header.data_size = output_data_bytes_;
+
+    long position = ftell(output_file_);
+    fseek(output_file_, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, output_file_);
+    fseek(output_file_, std::max<long>(position, sizeof(header)), SEEK_SET);
+    fflush(output_file_);
+}
+
+void WavAudioCodec::Start() {
+    xTaskCreate([](void* arg) {
+        auto codec = (WavAudioCodec*)arg;
+        codec->ClockTask();
+    }, "audio_clock", 4096, this, configMAX_PRIORITIES - 1, &clock_task_);
+
+    StartOutputTask();
+    EnableInput(true);
+    EnableOutput(true);
+}
+
+void WavAudioCodec::ClockTask() {
+    const int input_per_tick = input_sample_rate_ * SIMULATOR_AUDIO_TICK_MS / 1000 * input_channels_;
+    const int output_per_tick = output_sample_rate_ * SIMULATOR_AUDIO_TICK_MS / 1000 * output_channels_;
+    const int input_capacity = SIMULATOR_DMA_DESC_NUM * SIMULATOR_DMA_FRAME_NUM * input_channels_;
+    const int ticks_per_second = 1000 / SIMULATOR_AUDIO_TICK_MS;
+    std::vector<int16_t> silence(output_per_tick, 0);
+    TickType_t last_wake = xTaskGetTickCount();
+    int tick = 0;
+
+    while (true) {
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(SIMULATOR_AUDIO_TICK_MS));
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (input_enabled_) {
+                input_available_ += input_per_tick;
+                if (input_available_ > input_capacity) {
+                    // The DMA ring overwrote samples nobody read, skip them in the file too
+                    int dropped = input_available_ - input_capacity;
+                    input_available_ = input_capacity;
+                    if (input_file_ != nullptr) {
+                        fseek(input_file_, dropped * sizeof(int16_t), SEEK_CUR);
+                    }
+                }
+            }
+
+            if (output_enabled_) {
+                if (output_pending_ >= output_per_tick) {
+                    output_pending_ -= output_per_tick;
+                } else {
+                    // Underrun, the speaker plays zeros for the rest of the tick
+                    int missing = output_per_tick - output_pending_;
+                    output_pending_ = 0;
+                    if (output_file_ != nullptr) {
+                        fwrite(silence.data(), sizeof(int16_t), missing, output_file_);
+                        output_data_bytes_ += missing * sizeof(int16_t);
+                    }
+                }
+            }
+
+            if (++tick % ticks_per_second == 0 && output_file_ != nullptr) {
+                // Keep the file playable if the simulator is killed
+                UpdateOutputHeader();
+            }
+        }
+
+        if (input_enabled_ && on_input_ready_.function != nullptr) {
+            on_input_ready_.function(on_input_ready_.context);
+        }
+        if (output_enabled_) {
+            NotifyOutputSent(output_per_tick / output_channels_);
+            if (on_output_ready_.function != nullptr) {
+                on_output_ready_.function(on_output_ready_.context);
+            }
+        }
+    }
+}
+
+int WavAudioCodec::Read(int16_t* dest, int samples) {
+    // Block like i2s_channel_read until the simulated DMA has captured enough samples
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (input_available_ >= samples) {
+                input_available_ -= samples;
+                size_t read = 0;
+                if (input_file_ != nullptr) {
+                    read = fread(dest, sizeof(int16_t), samples, input_file_);
+                }
+                std::fill(dest + read, dest + samples, 0);
+                return samples;
+            }
+        }
+        vTaskDelay(pdMS_TO_TICKS(SIMULATOR_AUDIO_TICK_MS));
+    }
+}
+
+int WavAudioCodec::Write(const int16_t* data, int samples) {
+    const int output_capacity = SIMULATOR_DMA_DESC_NUM * SIMULATOR_DMA_FRAME_NUM * output_channels_;
+    int written = 0;
+    // Block like i2s_channel_write while the simulated DMA buffers are full
+    while (written < samples) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            int space = std::min(output_capacity - output_pending_, samples - written);
+            if (space > 0) {
+                if (output_file_ != nullptr) {
+                    fwrite(data + written, sizeof(int16_t), space, output_file_);
+                    output_data_bytes_ += space * sizeof(int16_t);
+                }
+                output_pending_ += space;
+                written += space;
+                continue;
+            }
+        }
+        vTaskDelay(pdMS_TO_TICKS(SIMULATOR_AUDIO_TICK_MS));
+    }
+    return samples;
+}
+
+void WavAudioCodec::ClearOutputBuffers() {
+    // The file already has the samples, only the playback clock forgets them
+    std::lock_guard<std::mutex> lock(mutex_);
+    output_pending_ = 0;
+}
@@ -0,0 +1,45 @@
+#ifndef _WAV_AUDIO_CODEC_H
+#define _WAV_AUDIO_CODEC_H
+
+#include "audio_codec.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+// Simulated codec: the microphone reads a WAV file and the speaker writes one.
+// A clock task plays the role of the I2S DMA, it fires the ready callbacks and paces
+// Read / Write in real time, so the application sees the same timing as on the device.
+class WavAudioCodec : public AudioCodec {
+public:
+    WavAudioCodec(int input_sample_rate, int output_sample_rate, const std::string& input_path, const std::string& output_path);
+    virtual ~WavAudioCodec();
+
+    virtual void Start() override;
+
+private:
+    FILE* input_file_ = nullptr;
+    FILE* output_file_ = nullptr;
+    long input_data_offset_ = 0;
+    uint32_t output_data_bytes_ = 0;
+    TaskHandle_t clock_task_ = nullptr;
+    std::mutex mutex_;
+    // Samples the simulated DMA has captured but the application has not read yet
+    int input_available_ = 0;
+    // Samples written by the application but not yet played
+    int output_pending_ = 0;
+
+    bool OpenInput(const std::string& path);
+    bool OpenOutput(const std::string& path);
+    void UpdateOutputHeader();
+    void ClockTask();
+
+    virtual int Read(int16_t* dest, int samples) override;
+    virtual int Write(const int16_t* data, int samples) override;
+    virtual void ClearOutputBuffers() override;
+};
+
+#endif // _WAV_AUDIO_CODEC_H
@@ -8,6 +8,8 @@
 
 #include <string>
 
+#include "memory_accounting.h"
+
 struct DisplayFonts {
     const lv_font_t* text_font = nullptr;
     const lv_font_t* icon_font = nullptr;
@@ -62,7 +64,7 @@ protected:
 
 class DisplayLockGuard {
 public:
-    DisplayLockGuard(Display *display) : display_(display) {
+    DisplayLockGuard(Display *display) : display_(display), memory_tag_scope_(kMemoryTagDisplay) {
         if (!display_->Lock(3000)) {
             ESP_LOGE("Display", "Failed to lock display");
         }
@@ -73,6 +75,7 @@ public:
 
 private:
     Display *display_;
+    MemoryTagScope memory_tag_scope_;
 };
 
 class NoDisplay : public Display {
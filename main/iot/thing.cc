@@ -1,5 +1,6 @@
 #include "thing.h"
 #include "application.h"
+#include "memory_accounting.h"
 
 #include <esp_log.h>
 
@@ -18,6 +19,7 @@ void RegisterThing(const std::string& type, std::function<Thing*()> creator) {
 }
 
 Thing* CreateThing(const std::string& type) {
+    MemoryTagScope memory_tag_scope(kMemoryTagIot);
     auto creator = thing_creators->find(type);
     if (creator == thing_creators->end()) {
         ESP_LOGE(TAG, "Thing type not found: %s", type.c_str());
@@ -1,4 +1,5 @@
 #include "thing_manager.h"
+#include "memory_accounting.h"
 
 #include <esp_log.h>
 
@@ -7,10 +8,12 @@
 namespace iot {
 
 void ThingManager::AddThing(Thing* thing) {
+    MemoryTagScope memory_tag_scope(kMemoryTagIot);
     things_.push_back(thing);
 }
 
 std::string ThingManager::GetDescriptorsJson() {
+    MemoryTagScope memory_tag_scope(kMemoryTagIot);
     std::string json_str = "[";
     for (auto& thing : things_) {
         json_str += thing->GetDescriptorJson() + ",";
@@ -23,6 +26,7 @@ std::string ThingManager::GetDescriptorsJson() {
 }
 
 bool ThingManager::GetStatesJson(std::string& json, bool delta) {
+    MemoryTagScope memory_tag_scope(kMemoryTagIot);
     if (!delta) {
         last_states_.clear();
     }
@@ -51,6 +55,7 @@ bool ThingManager::GetStatesJson(std::string& json, bool delta) {
 }
 
 void ThingManager::Invoke(const cJSON* command) {
+    MemoryTagScope memory_tag_scope(kMemoryTagIot);
     auto name = cJSON_GetObjectItem(command, "name");
     for (auto& thing : things_) {
         if (thing->name() == name->valuestring) {
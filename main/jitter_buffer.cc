@@ -0,0 +1,182 @@
+#include "jitter_buffer.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <cinttypes>
+
+#define TAG "JitterBuffer"
+
+// Arrivals further apart than this start a new talk spurt and are not counted as jitter
+#define TALK_SPURT_GAP_US 1000000
+// One frame of the delay added by an underrun is removed after this long without another
+#define UNDERRUN_DECAY_US 10000000
+
+void JitterBuffer::Configure(int frame_duration_ms, int min_delay_ms, int max_delay_ms) {
+    frame_duration_ms_ = frame_duration_ms;
+    min_delay_ms_ = min_delay_ms;
+    max_delay_ms_ = std::max(min_delay_ms, max_delay_ms);
+    jitter_us_ = 0;
+    underrun_delay_ms_ = 0;
+    Reset();
+}
+
+void JitterBuffer::SetFrameDuration(int frame_duration_ms) {
+    frame_duration_ms_ = frame_duration_ms;
+}
+
+void JitterBuffer::Reset() {
+    packets_.clear();
+    playing_ = false;
+    local_ = false;
+    has_next_ = false;
+    has_last_arrival_ = false;
+    played_ = false;
+    stats_.depth = 0;
+}
+
+int JitterBuffer::target_delay_ms() const {
+    // Twice the mean lateness, in whole frames
+    int jitter_ms = (int)(jitter_us_ * 2 / 1000);
+    int target = (jitter_ms + frame_duration_ms_ - 1) / frame_duration_ms_ * frame_duration_ms_;
+    target += underrun_delay_ms_;
+    return std::clamp(target, min_delay_ms_, max_delay_ms_);
+}
+
+void JitterBuffer::Put(AudioPacket&& packet, uint32_t sequence) {
+    stats_.received++;
+    if ((has_next_ && (int32_t)(sequence - next_sequence_) < 0) || packets_.count(sequence) > 0) {
+        stats_.late++;
+        return;
+    }
+
+    if (has_last_arrival_ && (int32_t)(sequence - last_arrival_sequence_) > 0) {
+        int64_t arrival_us = packet.receive_time_us - last_arrival_us_;
+        if (arrival_us < TALK_SPURT_GAP_US) {
+            int64_t expected_us = (int64_t)(sequence - last_arrival_sequence_) * frame_duration_ms_ * 1000;
+            int64_t lateness_us = std::max<int64_t>(arrival_us - expected_us, 0);
+            jitter_us_ += (lateness_us - jitter_us_) / 16;
+        }
+    }
+    if (!has_last_arrival_ || (int32_t)(sequence - last_arrival_sequence_) > 0) {
+        has_last_arrival_ = true;
+        last_arrival_sequence_ = sequence;
+        last_arrival_us_ = packet.receive_time_us;
+    }
+
+    packets_.emplace(sequence, std::move(packet));
+    stats_.depth = packets_.size();
+    stats_.max_depth = std::max(stats_.max_depth, stats_.depth);
+}
+
+void JitterBuffer::PutLocal(AudioPacket&& packet) {
+    uint32_t sequence;
+    if (!packets_.empty()) {
+        sequence = packets_.rbegin()->first + 1;
+    } else {
+        local_ = true;
+        sequence = has_next_ ? next_sequence_ : 0;
+    }
+    packets_.emplace(sequence, std::move(packet));
+    stats_.depth = packets_.size();
+}
+
+void JitterBuffer::ReportUnderrun() {
+    if (!playing_) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    if (has_last_arrival_ && now - last_arrival_us_ < frame_duration_ms_ * 1000) {
+        return;
+    }
+    playing_ = false;
+    stats_.underruns++;
+    underrun_delay_ms_ = std::min(underrun_delay_ms_ + frame_duration_ms_, max_delay_ms_);
+    last_underrun_us_ = now;
+    ESP_LOGD(TAG, "Underrun, target delay %d ms", target_delay_ms());
+}
+
+void JitterBuffer::Pause() {
+    playing_ = false;
+}
+
+JitterBuffer::Result JitterBuffer::Get(AudioPacket& packet, bool end_of_stream) {
+    if (packets_.empty()) {
+        return kJitterBufferEmpty;
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (!playing_) {
+        int target_us = target_delay_ms() * 1000;
+        const auto& oldest = packets_.begin()->second;
+        bool ready = local_ || end_of_stream ||
+            (int64_t)packets_.size() * frame_duration_ms_ * 1000 >= target_us ||
+            now - oldest.receive_time_us >= target_us;
+        if (!ready) {
+            return kJitterBufferEmpty;
+        }
+        playing_ = true;
+        if (!has_next_) {
+            has_next_ = true;
+            next_sequence_ = packets_.begin()->first;
+        }
+    }
+
+    auto it = packets_.begin();
+    if (it->first != next_sequence_) {
+        uint32_t gap = it->first - next_sequence_;
+        if (played_ && (int64_t)gap * frame_duration_ms_ <= max_delay_ms_) {
+            stats_.lost++;
+            stats_.concealed++;
+            next_sequence_++;
+            if (gap == 1) {
+                packet.payload = it->second.payload;
+                packet.view = it->second.view;
+            } else {
+                packet.payload.clear();
+                packet.view = {};
+            }
+            packet.receive_time_us = 0;
+            return kJitterBufferConcealment;
+        }
+        // Too long to conceal, continue with the next packet
+        stats_.lost += gap;
+        next_sequence_ = it->first;
+    }
+
+    packet = std::move(it->second);
+    packets_.erase(it);
+    next_sequence_++;
+    stats_.depth = packets_.size();
+
+    played_ = true;
+    if (underrun_delay_ms_ > 0 && now - last_underrun_us_ > UNDERRUN_DECAY_US) {
+        underrun_delay_ms_ = std::max(underrun_delay_ms_ - frame_duration_ms_, 0);
+        last_underrun_us_ = now;
+    }
+    return kJitterBufferPacket;
+}
+
+JitterBufferStats JitterBuffer::GetStats() const {
+    JitterBufferStats stats = stats_;
+    stats.target_delay_ms = target_delay_ms();
+    stats.jitter_ms = (int)(jitter_us_ / 1000);
+    return stats;
+}
+
+void JitterBuffer::ResetStats() {
+    size_t depth = stats_.depth;
+    stats_ = JitterBufferStats();
+    stats_.depth = depth;
+    stats_.max_depth = depth;
+}
+
+void JitterBuffer::PrintStats() const {
+    if (stats_.received == 0) {
+        return;
+    }
+    auto stats = GetStats();
+    ESP_LOGI(TAG, "received %" PRIu32 " late %" PRIu32 " lost %" PRIu32 " concealed %" PRIu32 " underruns %" PRIu32 " depth %u max %u target %d ms jitter %d ms",
+        stats.received, stats.late, stats.lost, stats.concealed, stats.underruns, stats.depth, stats.max_depth,
+        stats.target_delay_ms, stats.jitter_ms);
+}
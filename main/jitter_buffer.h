@@ -0,0 +1,99 @@
+#ifndef JITTER_BUFFER_H
+#define JITTER_BUFFER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string_view>
+#include <vector>
+
+struct AudioPacket {
+    std::vector<uint8_t> payload;
+    // 0 for local sounds, which are not counted in the downlink latency
+    int64_t receive_time_us = 0;
+    // Local sounds point into the assets in flash instead of owning a payload
+    std::string_view view;
+
+    const uint8_t* data() const { return view.empty() ? payload.data() : (const uint8_t*)view.data(); }
+    size_t size() const { return view.empty() ? payload.size() : view.size(); }
+};
+
+struct JitterBufferStats {
+    uint32_t received = 0;
+    // Arrived after their turn had passed, or twice
+    uint32_t late = 0;
+    uint32_t lost = 0;
+    // Lost packets replaced by a concealment frame
+    uint32_t concealed = 0;
+    uint32_t underruns = 0;
+    size_t depth = 0;
+    size_t max_depth = 0;
+    int target_delay_ms = 0;
+    int jitter_ms = 0;
+};
+
+// Orders the downlink packets by sequence and holds them until the playout delay is reached.
+// The target delay follows the interarrival jitter (RFC 3550, counting late arrivals only)
+// plus one frame for every recent underrun, within the configured bounds. Playback starts
+// once the buffered audio, or the time the oldest packet has waited, reaches the target.
+// A missing packet is returned as a concealment, carrying a copy of the packet that follows
+// it when that has arrived, so the decoder can use its in-band FEC, unless the gap is longer
+// than the maximum delay. Not thread safe, the caller holds its own lock.
+class JitterBuffer {
+public:
+    enum Result {
+        kJitterBufferPacket,
+        kJitterBufferConcealment,
+        kJitterBufferEmpty,
+    };
+
+    void Configure(int frame_duration_ms, int min_delay_ms, int max_delay_ms);
+    void SetFrameDuration(int frame_duration_ms);
+    // Drops the packets for a new stream, keeps what was learned about the network
+    void Reset();
+
+    void Put(AudioPacket&& packet, uint32_t sequence);
+    // Local sounds follow the buffered packets and play without waiting
+    void PutLocal(AudioPacket&& packet);
+    // end_of_stream plays out what is left without waiting for the target delay. For a
+    // concealment the payload is the next packet, or empty when it has not arrived either.
+    Result Get(AudioPacket& packet, bool end_of_stream);
+    // Called when the output ran dry while the stream was playing. Only counted, and the delay
+    // only raised, when the packet after the newest one is overdue by a frame, an output that
+    // ran dry while the sender kept time needs no more delay.
+    void ReportUnderrun();
+    // The sender paused on purpose, e.g. between sentences: the next packet waits for the
+    // target delay again, nothing is counted
+    void Pause();
+
+    bool empty() const { return packets_.empty(); }
+    size_t size() const { return packets_.size(); }
+    int target_delay_ms() const;
+    JitterBufferStats GetStats() const;
+    // The counters start again, e.g. for every audio channel session
+    void ResetStats();
+    void PrintStats() const;
+
+private:
+    std::map<uint32_t, AudioPacket> packets_;
+    int frame_duration_ms_ = 60;
+    int min_delay_ms_ = 0;
+    int max_delay_ms_ = 360;
+
+    bool playing_ = false;
+    bool local_ = false;
+    bool has_next_ = false;
+    uint32_t next_sequence_ = 0;
+    bool has_last_arrival_ = false;
+    uint32_t last_arrival_sequence_ = 0;
+    int64_t last_arrival_us_ = 0;
+    int64_t jitter_us_ = 0;
+    int underrun_delay_ms_ = 0;
+    int64_t last_underrun_us_ = 0;
+    // Concealment needs a decoded packet before the gap
+    bool played_ = false;
+
+    JitterBufferStats stats_;
+};
+
+#endif // JITTER_BUFFER_H
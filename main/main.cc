@@ -7,6 +7,8 @@
 
 #include "application.h"
 #include "system_info.h"
+#include "pcm_kernels.h"
+#include "polyphase_resampler.h"
 
 #define TAG "main"
 
@@ -24,6 +26,13 @@ extern "C" void app_main(void)
     }
     ESP_ERROR_CHECK(ret);
 
+#if CONFIG_USE_PCM_KERNELS_BENCHMARK
+    PcmKernelsBenchmark();
+#endif
+#if CONFIG_USE_RESAMPLER_BENCHMARK
+    PolyphaseResamplerBenchmark();
+#endif
+
     // Launch the application
     Application::GetInstance().Start();
     // The main thread will exit and release the stack memory
@@ -0,0 +1,250 @@
+#include "memory_accounting.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_memory_utils.h>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <cinttypes>
+
+#define TAG "MemoryAccounting"
+
+#define ALLOCATION_MAGIC 0x4D41
+
+static const char* const TAG_NAMES[] = {
+    "other",
+    "board",
+    "audio",
+    "protocol",
+    "display",
+    "afe",
+    "ota",
+    "iot",
+};
+static_assert(sizeof(TAG_NAMES) / sizeof(TAG_NAMES[0]) == kMemoryTagCount, "TAG_NAMES must match MemoryTag");
+
+// 12 bytes of fields padded to a multiple of the malloc alignment, 16 bytes on the chips
+// (alignment 8, or 16 on RISC-V) and on a 64-bit host
+struct alignas(alignof(std::max_align_t)) AllocationHeader {
+    uint32_t size;
+    uint16_t magic;
+    uint8_t tag;
+    uint8_t psram;
+    // From the start of the malloc block to the header, only over-aligned blocks have a gap
+    uint32_t offset;
+};
+static_assert(sizeof(AllocationHeader) % alignof(std::max_align_t) == 0, "AllocationHeader must keep the malloc alignment");
+
+thread_local MemoryTag MemoryAccounting::current_tag_ = kMemoryTagOther;
+MemoryAccounting::Counters MemoryAccounting::counters_[kMemoryTagCount];
+std::atomic<size_t> MemoryAccounting::tracked_internal_{0};
+std::atomic<size_t> MemoryAccounting::tracked_psram_{0};
+
+static void UpdatePeak(std::atomic<size_t>& peak, size_t value) {
+    size_t current = peak.load(std::memory_order_relaxed);
+    while (value > current && !peak.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+void MemoryAccounting::Add(Counters& counters, bool psram, size_t size) {
+    if (psram) {
+        UpdatePeak(counters.psram_peak, counters.psram_bytes.fetch_add(size, std::memory_order_relaxed) + size);
+    } else {
+        UpdatePeak(counters.internal_peak, counters.internal_bytes.fetch_add(size, std::memory_order_relaxed) + size);
+    }
+}
+
+void MemoryAccounting::OnAllocate(MemoryTag tag, bool psram, size_t size) {
+    auto& counters = counters_[tag];
+    Add(counters, psram, size);
+    counters.allocations.fetch_add(1, std::memory_order_relaxed);
+    (psram ? tracked_psram_ : tracked_internal_).fetch_add(size, std::memory_order_relaxed);
+}
+
+void MemoryAccounting::OnFree(MemoryTag tag, bool psram, size_t size) {
+    auto& counters = counters_[tag];
+    (psram ? counters.psram_bytes : counters.internal_bytes).fetch_sub(size, std::memory_order_relaxed);
+    counters.allocations.fetch_sub(1, std::memory_order_relaxed);
+    (psram ? tracked_psram_ : tracked_internal_).fetch_sub(size, std::memory_order_relaxed);
+}
+
+MemoryAccounting::Snapshot MemoryAccounting::TakeSnapshot() {
+    Snapshot snapshot;
+    snapshot.free_internal = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    snapshot.free_psram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    snapshot.tracked_internal = tracked_internal_.load(std::memory_order_relaxed);
+    snapshot.tracked_psram = tracked_psram_.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+void MemoryAccounting::AddExternal(MemoryTag tag, const Snapshot& before) {
+    auto after = TakeSnapshot();
+    // The heap may have shrunk by less than operator new counted if something else freed memory meanwhile
+    auto consumed = [](size_t free_before, size_t free_after, size_t tracked_before, size_t tracked_after) -> size_t {
+        int64_t heap = (int64_t)free_before - (int64_t)free_after;
+        int64_t tracked = (int64_t)tracked_after - (int64_t)tracked_before;
+        return heap > tracked ? heap - tracked : 0;
+    };
+    size_t internal = consumed(before.free_internal, after.free_internal, before.tracked_internal, after.tracked_internal);
+    size_t psram = consumed(before.free_psram, after.free_psram, before.tracked_psram, after.tracked_psram);
+
+    auto& counters = counters_[tag];
+    if (internal > 0) {
+        Add(counters, false, internal);
+        counters.external_internal_bytes.fetch_add(internal, std::memory_order_relaxed);
+    }
+    if (psram > 0) {
+        Add(counters, true, psram);
+        counters.external_psram_bytes.fetch_add(psram, std::memory_order_relaxed);
+    }
+}
+
+MemoryTagStats MemoryAccounting::GetStats(MemoryTag tag) {
+    auto& counters = counters_[tag];
+    MemoryTagStats stats;
+    stats.internal_bytes = counters.internal_bytes.load(std::memory_order_relaxed);
+    stats.internal_peak = counters.internal_peak.load(std::memory_order_relaxed);
+    stats.psram_bytes = counters.psram_bytes.load(std::memory_order_relaxed);
+    stats.psram_peak = counters.psram_peak.load(std::memory_order_relaxed);
+    stats.external_internal_bytes = counters.external_internal_bytes.load(std::memory_order_relaxed);
+    stats.external_psram_bytes = counters.external_psram_bytes.load(std::memory_order_relaxed);
+    stats.allocations = counters.allocations.load(std::memory_order_relaxed);
+    return stats;
+}
+
+const char* MemoryAccounting::TagName(MemoryTag tag) {
+    return TAG_NAMES[tag];
+}
+
+void MemoryAccounting::PrintStats() {
+    for (int i = 0; i < kMemoryTagCount; ++i) {
+        auto stats = GetStats((MemoryTag)i);
+        if (stats.internal_peak == 0 && stats.psram_peak == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%s: internal %u (peak %u, external %u) psram %u (peak %u, external %u) allocations %" PRIu32,
+            TAG_NAMES[i], stats.internal_bytes, stats.internal_peak, stats.external_internal_bytes,
+            stats.psram_bytes, stats.psram_peak, stats.external_psram_bytes, stats.allocations);
+    }
+}
+
+static void* TrackedAllocate(size_t size, size_t alignment = alignof(AllocationHeader)) noexcept {
+    // Room to move the block up to the next multiple of the alignment
+    size_t padding = alignment > alignof(AllocationHeader) ? alignment : 0;
+    auto block = (uint8_t*)malloc(sizeof(AllocationHeader) + padding + size);
+    if (block == nullptr) {
+        return nullptr;
+    }
+    uintptr_t data = (uintptr_t)(block + sizeof(AllocationHeader));
+    data = (data + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    auto header = (AllocationHeader*)data - 1;
+    header->offset = (uint8_t*)header - block;
+    header->size = size;
+    header->magic = ALLOCATION_MAGIC;
+    header->tag = MemoryAccounting::CurrentTag();
+    header->psram = esp_ptr_external_ram(header);
+    MemoryAccounting::OnAllocate((MemoryTag)header->tag, header->psram, size);
+    return header + 1;
+}
+
+static void TrackedFree(void* ptr) noexcept {
+    if (ptr == nullptr) {
+        return;
+    }
+    auto header = (AllocationHeader*)ptr - 1;
+    assert(header->magic == ALLOCATION_MAGIC);
+    header->magic = 0;
+    MemoryAccounting::OnFree((MemoryTag)header->tag, header->psram, header->size);
+    free((uint8_t*)header - header->offset);
+}
+
+void* operator new(size_t size) {
+    void* ptr = TrackedAllocate(size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return TrackedAllocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return TrackedAllocate(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    TrackedFree(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    TrackedFree(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    TrackedFree(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    TrackedFree(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    TrackedFree(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    TrackedFree(ptr);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    void* ptr = TrackedAllocate(size, (size_t)alignment);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return operator new(size, alignment);
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return TrackedAllocate(size, (size_t)alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return TrackedAllocate(size, (size_t)alignment);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    TrackedFree(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    TrackedFree(ptr);
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+    TrackedFree(ptr);
+}
+
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+    TrackedFree(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    TrackedFree(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    TrackedFree(ptr);
+}
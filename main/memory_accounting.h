@@ -0,0 +1,125 @@
+#ifndef MEMORY_ACCOUNTING_H
+#define MEMORY_ACCOUNTING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+enum MemoryTag : uint8_t {
+    kMemoryTagOther,
+    kMemoryTagBoard,
+    kMemoryTagAudio,
+    kMemoryTagProtocol,
+    kMemoryTagDisplay,
+    kMemoryTagAfe,
+    kMemoryTagOta,
+    kMemoryTagIot,
+    kMemoryTagCount
+};
+
+struct MemoryTagStats {
+    size_t internal_bytes = 0;
+    size_t internal_peak = 0;
+    size_t psram_bytes = 0;
+    size_t psram_peak = 0;
+    // Part of the bytes above that was measured from heap deltas, see MemoryExternalScope
+    size_t external_internal_bytes = 0;
+    size_t external_psram_bytes = 0;
+    uint32_t allocations = 0;
+};
+
+// With CONFIG_USE_MEMORY_ACCOUNTING the global operator new / delete put a small header
+// in front of every allocation, recording the tag of the calling task and whether the
+// block landed in PSRAM. C libraries (opus, esp-sr, LVGL, esp-mqtt) allocate with malloc
+// and are only attributed by comparing the free heap around their initialization.
+class MemoryAccounting {
+public:
+    struct Snapshot {
+        size_t free_internal;
+        size_t free_psram;
+        size_t tracked_internal;
+        size_t tracked_psram;
+    };
+
+    static MemoryTag CurrentTag() { return current_tag_; }
+    static void SetCurrentTag(MemoryTag tag) { current_tag_ = tag; }
+
+    static void OnAllocate(MemoryTag tag, bool psram, size_t size);
+    static void OnFree(MemoryTag tag, bool psram, size_t size);
+
+    static Snapshot TakeSnapshot();
+    // Charges the heap consumed since the snapshot, minus what operator new already counted, to the tag
+    static void AddExternal(MemoryTag tag, const Snapshot& before);
+
+    static MemoryTagStats GetStats(MemoryTag tag);
+    static void PrintStats();
+    static const char* TagName(MemoryTag tag);
+
+private:
+    struct Counters {
+        std::atomic<size_t> internal_bytes{0};
+        std::atomic<size_t> internal_peak{0};
+        std::atomic<size_t> psram_bytes{0};
+        std::atomic<size_t> psram_peak{0};
+        std::atomic<size_t> external_internal_bytes{0};
+        std::atomic<size_t> external_psram_bytes{0};
+        std::atomic<uint32_t> allocations{0};
+    };
+
+    static thread_local MemoryTag current_tag_;
+    static Counters counters_[kMemoryTagCount];
+    static std::atomic<size_t> tracked_internal_;
+    static std::atomic<size_t> tracked_psram_;
+
+    static void Add(Counters& counters, bool psram, size_t size);
+};
+
+// Tags the allocations made by the current task until the scope ends
+class MemoryTagScope {
+public:
+#if CONFIG_USE_MEMORY_ACCOUNTING
+    explicit MemoryTagScope(MemoryTag tag) : previous_(MemoryAccounting::CurrentTag()) {
+        MemoryAccounting::SetCurrentTag(tag);
+    }
+    ~MemoryTagScope() {
+        MemoryAccounting::SetCurrentTag(previous_);
+    }
+#else
+    explicit MemoryTagScope(MemoryTag) {}
+    ~MemoryTagScope() {}
+#endif
+    MemoryTagScope(const MemoryTagScope&) = delete;
+    MemoryTagScope& operator=(const MemoryTagScope&) = delete;
+
+#if CONFIG_USE_MEMORY_ACCOUNTING
+private:
+    MemoryTag previous_;
+#endif
+};
+
+// Like MemoryTagScope, and also charges whatever the heap lost inside the scope to the tag.
+// Only meant for one-off initialization, other tasks allocating at the same time are charged too.
+class MemoryExternalScope {
+public:
+#if CONFIG_USE_MEMORY_ACCOUNTING
+    explicit MemoryExternalScope(MemoryTag tag)
+        : tag_(tag), tag_scope_(tag), before_(MemoryAccounting::TakeSnapshot()) {}
+    ~MemoryExternalScope() {
+        MemoryAccounting::AddExternal(tag_, before_);
+    }
+#else
+    explicit MemoryExternalScope(MemoryTag) {}
+    ~MemoryExternalScope() {}
+#endif
+    MemoryExternalScope(const MemoryExternalScope&) = delete;
+    MemoryExternalScope& operator=(const MemoryExternalScope&) = delete;
+
+#if CONFIG_USE_MEMORY_ACCOUNTING
+private:
+    MemoryTag tag_;
+    MemoryTagScope tag_scope_;
+    MemoryAccounting::Snapshot before_;
+#endif
+};
+
+#endif // MEMORY_ACCOUNTING_H
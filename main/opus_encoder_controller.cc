@@ -0,0 +1,142 @@
+#include "opus_encoder_controller.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <algorithm>
+
+#define TAG "OpusEncoderController"
+
+#define CONTROLLER_WINDOW_MS 1000
+// Encode time in percent of the frame duration, averaged over the window and at the worst frame
+#define LOAD_HIGH_PERCENT 40
+#define LOAD_LOW_PERCENT 15
+#define PEAK_HIGH_PERCENT 80
+// Idle time of the encoding core
+#define IDLE_LOW_PERCENT 15
+#define IDLE_HIGH_PERCENT 50
+// Failed sends and lost packets in percent of the packets of the window
+#define LOSS_HIGH_PERCENT 5
+#define RAISE_AFTER_WINDOWS 3
+#define BITRATE_STEP 2000
+
+void OpusEncoderController::Configure(const OpusEncoderLimits& limits, int frame_duration_ms) {
+    SetFrameDuration(frame_duration_ms);
+    std::lock_guard<std::mutex> lock(mutex_);
+    limits_ = limits;
+    complexity_ = std::clamp(limits.complexity, limits.min_complexity, limits.max_complexity);
+    bitrate_ = std::clamp(limits.bitrate, limits.min_bitrate, limits.max_bitrate);
+    ESP_LOGI(TAG, "Complexity %d (%d-%d), bitrate %d (%d-%d)", complexity_, limits.min_complexity,
+        limits.max_complexity, bitrate_, limits.min_bitrate, limits.max_bitrate);
+}
+
+void OpusEncoderController::SetFrameDuration(int frame_duration_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    frame_duration_ms_ = frame_duration_ms;
+    frames_ = 0;
+    encode_time_sum_us_ = 0;
+    encode_time_max_us_ = 0;
+}
+
+void OpusEncoderController::OnFrameEncoded(int64_t encode_time_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    frames_++;
+    encode_time_sum_us_ += encode_time_us;
+    encode_time_max_us_ = std::max(encode_time_max_us_, encode_time_us);
+}
+
+int OpusEncoderController::GetIdlePercent() {
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS && !CONFIG_IDF_TARGET_LINUX
+    uint32_t idle_time = ulTaskGetIdleRunTimeCounter();
+    uint32_t run_time = portGET_RUN_TIME_COUNTER_VALUE();
+    uint32_t idle_delta = idle_time - last_idle_time_;
+    uint32_t run_delta = run_time - last_run_time_;
+    bool valid = idle_valid_;
+    last_idle_time_ = idle_time;
+    last_run_time_ = run_time;
+    idle_valid_ = true;
+    if (!valid || run_delta == 0) {
+        return -1;
+    }
+    return (int)((uint64_t)idle_delta * 100 / run_delta);
+#else
+    return -1;
+#endif
+}
+
+int OpusEncoderController::complexity() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return complexity_;
+}
+
+int OpusEncoderController::bitrate() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bitrate_;
+}
+
+bool OpusEncoderController::Update(const AudioLinkStats& link) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int window_frames = std::max(1, CONTROLLER_WINDOW_MS / frame_duration_ms_);
+    if (frames_ < window_frames) {
+        return false;
+    }
+
+    int64_t frame_us = frame_duration_ms_ * 1000;
+    int load = encode_time_sum_us_ * 100 / (frames_ * frame_us);
+    int peak = encode_time_max_us_ * 100 / frame_us;
+    int idle = GetIdlePercent();
+    frames_ = 0;
+    encode_time_sum_us_ = 0;
+    encode_time_max_us_ = 0;
+
+    int complexity = complexity_;
+    if (load > LOAD_HIGH_PERCENT || peak > PEAK_HIGH_PERCENT || (idle >= 0 && idle < IDLE_LOW_PERCENT)) {
+        complexity--;
+        calm_windows_ = 0;
+    } else if (load < LOAD_LOW_PERCENT && (idle < 0 || idle > IDLE_HIGH_PERCENT)) {
+        if (++calm_windows_ >= RAISE_AFTER_WINDOWS) {
+            complexity++;
+            calm_windows_ = 0;
+        }
+    } else {
+        calm_windows_ = 0;
+    }
+    complexity = std::clamp(complexity, limits_.min_complexity, limits_.max_complexity);
+
+    // Downlink gaps are counted while speaking and show up in the first window of the next turn
+    int loss = -1;
+    if (link_valid_) {
+        uint32_t good = (link.sent_packets - last_link_.sent_packets) + (link.received_packets - last_link_.received_packets);
+        // Packets counted as lost are taken back when they arrive late, the count may go down
+        int32_t lost = (int32_t)(link.lost_packets - last_link_.lost_packets);
+        uint32_t bad = (link.send_failures - last_link_.send_failures) + std::max<int32_t>(lost, 0);
+        if (good + bad > 0) {
+            loss = bad * 100 / (good + bad);
+        }
+    }
+    last_link_ = link;
+    link_valid_ = true;
+
+    int bitrate = bitrate_;
+    if (loss >= LOSS_HIGH_PERCENT) {
+        bitrate = bitrate * 3 / 4;
+        clean_windows_ = 0;
+    } else if (loss == 0) {
+        if (++clean_windows_ >= RAISE_AFTER_WINDOWS) {
+            bitrate += BITRATE_STEP;
+            clean_windows_ = 0;
+        }
+    } else if (loss > 0) {
+        clean_windows_ = 0;
+    }
+    bitrate = std::clamp(bitrate, limits_.min_bitrate, limits_.max_bitrate);
+
+    if (complexity == complexity_ && bitrate == bitrate_) {
+        return false;
+    }
+    ESP_LOGI(TAG, "Load %d%% (peak %d%%), idle %d%%, loss %d%%: complexity %d -> %d, bitrate %d -> %d",
+        load, peak, idle, loss, complexity_, complexity, bitrate_, bitrate);
+    complexity_ = complexity;
+    bitrate_ = bitrate;
+    return true;
+}
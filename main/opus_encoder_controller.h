@@ -0,0 +1,51 @@
+#ifndef OPUS_ENCODER_CONTROLLER_H
+#define OPUS_ENCODER_CONTROLLER_H
+
+#include "board.h"
+#include "protocol.h"
+
+#include <cstdint>
+#include <mutex>
+
+// Adapts the uplink encoder once per second of encoded audio. The complexity follows the
+// CPU: it steps down at once when encoding takes too much of a frame or the encoding core
+// has little idle time left, and steps up after a few calm windows. The bitrate follows the
+// link: send failures and UDP sequence gaps cut it by a quarter, a few clean windows raise it
+// again. Both stay within the board's OpusEncoderLimits. The encoding task feeds and updates
+// it while the main loop reads it and changes the frame duration, so every call locks.
+class OpusEncoderController {
+public:
+    void Configure(const OpusEncoderLimits& limits, int frame_duration_ms);
+    void SetFrameDuration(int frame_duration_ms);
+
+    // After every frame the encoder completed
+    void OnFrameEncoded(int64_t encode_time_us);
+    // Returns true when complexity() or bitrate() changed
+    bool Update(const AudioLinkStats& link);
+
+    int complexity() const;
+    int bitrate() const;
+
+private:
+    mutable std::mutex mutex_;
+    OpusEncoderLimits limits_ = {};
+    int complexity_ = 0;
+    int bitrate_ = 0;
+    int frame_duration_ms_ = 60;
+
+    int frames_ = 0;
+    int64_t encode_time_sum_us_ = 0;
+    int64_t encode_time_max_us_ = 0;
+    int calm_windows_ = 0;
+    int clean_windows_ = 0;
+    AudioLinkStats last_link_;
+    bool link_valid_ = false;
+    uint32_t last_idle_time_ = 0;
+    uint32_t last_run_time_ = 0;
+    bool idle_valid_ = false;
+
+    // Idle share of the calling core since the last call, or -1 without run time stats
+    int GetIdlePercent();
+};
+
+#endif // OPUS_ENCODER_CONTROLLER_H
@@ -2,6 +2,7 @@
 #include "system_info.h"
 #include "board.h"
 #include "settings.h"
+#include "memory_accounting.h"
 
 #include <cJSON.h>
 #include <esp_log.h>
@@ -36,6 +37,7 @@ void Ota::SetPostData(const std::string& post_data) {
 }
 
 bool Ota::CheckVersion() {
+    MemoryTagScope memory_tag_scope(kMemoryTagOta);
     current_version_ = esp_app_get_description()->version;
     ESP_LOGI(TAG, "Current version: %s", current_version_.c_str());
 
@@ -177,6 +179,7 @@ void Ota::MarkCurrentVersionValid() {
 }
 
 void Ota::Upgrade(const std::string& firmware_url) {
+    MemoryTagScope memory_tag_scope(kMemoryTagOta);
     ESP_LOGI(TAG, "Upgrading firmware from %s", firmware_url.c_str());
     esp_ota_handle_t update_handle = 0;
     auto update_partition = esp_ota_get_next_update_partition(NULL);
@@ -2,12 +2,14 @@
 #include "board.h"
 #include "application.h"
 #include "settings.h"
+#include "trace.h"
+#include "memory_accounting.h"
 
 #include <esp_log.h>
-#include <ml307_mqtt.h>
-#include <ml307_udp.h>
 #include <cstring>
+#include <algorithm>
 #include <arpa/inet.h>
+#include <cinttypes>
 #include "assets/lang_config.h"
 
 #define TAG "MQTT"
@@ -28,6 +30,7 @@ MqttProtocol::~MqttProtocol() {
 }
 
 void MqttProtocol::Start() {
+    MemoryExternalScope memory_scope(kMemoryTagProtocol);
     StartMqttClient(false);
 }
 
@@ -60,6 +63,7 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     });
 
     mqtt_->OnMessage([this](const std::string& topic, const std::string& payload) {
+        MemoryTagScope memory_tag_scope(kMemoryTagProtocol);
         cJSON* root = cJSON_Parse(payload.c_str());
         if (root == nullptr) {
             ESP_LOGE(TAG, "Failed to parse json message %s", payload.c_str());
@@ -131,7 +135,11 @@ void MqttProtocol::SendAudio(const std::vector<uint8_t>& data) {
         ESP_LOGE(TAG, "Failed to encrypt audio data");
         return;
     }
-    udp_->Send(encrypted);
+    if (udp_->Send(encrypted) < 0) {
+        audio_send_failures_++;
+    } else {
+        sent_audio_packets_++;
+    }
 }
 
 void MqttProtocol::CloseAudioChannel() {
@@ -142,6 +150,9 @@ void MqttProtocol::CloseAudioChannel() {
             udp_ = nullptr;
         }
     }
+    if (lost_packets_ > 0 || old_packets_ > 0) {
+        ESP_LOGW(TAG, "Audio packets lost: %" PRIu32 ", out of order: %" PRIu32, lost_packets_, old_packets_);
+    }
 
     std::string message = "{";
     message += "\"session_id\":\"" + session_id_ + "\",";
@@ -155,6 +166,7 @@ void MqttProtocol::CloseAudioChannel() {
 }
 
 bool MqttProtocol::OpenAudioChannel() {
+    MemoryTagScope memory_tag_scope(kMemoryTagProtocol);
     if (mqtt_ == nullptr || !mqtt_->IsConnected()) {
         ESP_LOGI(TAG, "MQTT is not connected, try to connect now");
         if (!StartMqttClient(true)) {
@@ -171,9 +183,9 @@ bool MqttProtocol::OpenAudioChannel() {
     message += "\"type\":\"hello\",";
     message += "\"version\": 3,";
     message += "\"transport\":\"udp\",";
-    message += "\"audio_params\":{";
-    message += "\"format\":\"opus\", \"sample_rate\":16000, \"channels\":1, \"frame_duration\":" + std::to_string(OPUS_FRAME_DURATION_MS);
-    message += "}}";
+    // UDP loses packets, the server may add in-band FEC for the decoder to recover them
+    message += GetHelloAudioParams(true);
+    message += "}";
     SendText(message);
 
     // 等待服务器响应
@@ -190,6 +202,7 @@ bool MqttProtocol::OpenAudioChannel() {
     }
     udp_ = Board::GetInstance().CreateUdp();
     udp_->OnMessage([this](const std::string& data) {
+        MemoryTagScope memory_tag_scope(kMemoryTagProtocol);
         if (data.size() < sizeof(aes_nonce_)) {
             ESP_LOGE(TAG, "Invalid audio packet size: %zu", data.size());
             return;
@@ -199,13 +212,24 @@ bool MqttProtocol::OpenAudioChannel() {
             return;
         }
         uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
-        if (sequence < remote_sequence_) {
-            ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, remote_sequence_);
-            return;
-        }
-        if (sequence != remote_sequence_ + 1) {
-            ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
+        // Packets behind the newest are still passed on, the jitter buffer reorders them
+        // or drops them if their turn has passed
+        if (sequence <= remote_sequence_) {
+            TRACE_INSTANT(kTraceSequenceError, sequence, remote_sequence_);
+            old_packets_++;
+            // A late packet from a gap that was counted as lost is only reordered
+            uint32_t behind = remote_sequence_ - sequence;
+            if (behind > 0 && behind <= 32 && (received_mask_ & (1u << (behind - 1))) == 0) {
+                received_mask_ |= 1u << (behind - 1);
+                lost_packets_--;
+                lost_audio_packets_--;
+            }
+        } else if (sequence != remote_sequence_ + 1) {
+            TRACE_INSTANT(kTraceSequenceError, sequence, remote_sequence_ + 1);
+            lost_packets_ += sequence - remote_sequence_ - 1;
+            lost_audio_packets_ += sequence - remote_sequence_ - 1;
         }
+        received_audio_packets_++;
 
         std::vector<uint8_t> decrypted;
         size_t decrypted_size = data.size() - aes_nonce_.size();
@@ -220,9 +244,16 @@ bool MqttProtocol::OpenAudioChannel() {
             return;
         }
         if (on_incoming_audio_ != nullptr) {
-            on_incoming_audio_(std::move(decrypted));
+            on_incoming_audio_(std::move(decrypted), sequence);
+        }
+        if (sequence > remote_sequence_) {
+            uint32_t advance = sequence - remote_sequence_;
+            received_mask_ = advance >= 32 ? 0 : received_mask_ << advance;
+            if (remote_sequence_ != 0 && advance <= 32) {
+                received_mask_ |= 1u << (advance - 1);
+            }
+            remote_sequence_ = sequence;
         }
-        remote_sequence_ = sequence;
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
@@ -247,14 +278,8 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
 
-    // Get sample rate from hello message
-    auto audio_params = cJSON_GetObjectItem(root, "audio_params");
-    if (audio_params != NULL) {
-        auto sample_rate = cJSON_GetObjectItem(audio_params, "sample_rate");
-        if (sample_rate != NULL) {
-            server_sample_rate_ = sample_rate->valueint;
-        }
-    }
+    // Get sample rate and frame duration from hello message
+    ParseServerAudioParams(cJSON_GetObjectItem(root, "audio_params"));
 
     auto udp = cJSON_GetObjectItem(root, "udp");
     if (udp == nullptr) {
@@ -273,6 +298,9 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
     mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(key).c_str(), 128);
     local_sequence_ = 0;
     remote_sequence_ = 0;
+    received_mask_ = 0;
+    old_packets_ = 0;
+    lost_packets_ = 0;
     xEventGroupSetBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 }
 
@@ -49,6 +49,11 @@ private:
     int udp_port_;
     uint32_t local_sequence_;
     uint32_t remote_sequence_;
+    // Bit n is set once remote_sequence_ - 1 - n has arrived, so a late packet is not counted as lost
+    uint32_t received_mask_ = 0;
+    // Counted instead of logged per packet, reported when the channel closes
+    uint32_t old_packets_ = 0;
+    uint32_t lost_packets_ = 0;
 
     bool StartMqttClient(bool report_error=false);
     void ParseServerHello(const cJSON* root);
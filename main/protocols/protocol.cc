@@ -8,7 +8,7 @@ void Protocol::OnIncomingJson(std::function<void(const cJSON* root)> callback) {
     on_incoming_json_ = callback;
 }
 
-void Protocol::OnIncomingAudio(std::function<void(std::vector<uint8_t>&& data)> callback) {
+void Protocol::OnIncomingAudio(std::function<void(std::vector<uint8_t>&& data, uint32_t sequence)> callback) {
     on_incoming_audio_ = callback;
 }
 
@@ -24,6 +24,47 @@ void Protocol::OnNetworkError(std::function<void(const std::string& message)> ca
     on_network_error_ = callback;
 }
 
+AudioLinkStats Protocol::GetAudioLinkStats() const {
+    AudioLinkStats stats;
+    stats.sent_packets = sent_audio_packets_.load(std::memory_order_relaxed);
+    stats.send_failures = audio_send_failures_.load(std::memory_order_relaxed);
+    stats.received_packets = received_audio_packets_.load(std::memory_order_relaxed);
+    stats.lost_packets = lost_audio_packets_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void Protocol::SetPreferredFrameDuration(int duration_ms) {
+    preferred_frame_duration_ = duration_ms;
+}
+
+std::string Protocol::GetHelloAudioParams(bool fec) const {
+    return "\"audio_params\":{\"format\":\"opus\", \"sample_rate\":16000, \"channels\":1, \"frame_duration\":"
+        + std::to_string(preferred_frame_duration_) + (fec ? ", \"fec\":true}" : "}");
+}
+
+void Protocol::ParseServerAudioParams(const cJSON* audio_params) {
+    // Servers that do not answer the frame duration use the requested one
+    frame_duration_ = preferred_frame_duration_;
+    if (audio_params == nullptr) {
+        return;
+    }
+
+    auto sample_rate = cJSON_GetObjectItem(audio_params, "sample_rate");
+    if (sample_rate != nullptr) {
+        server_sample_rate_ = sample_rate->valueint;
+    }
+
+    auto frame_duration = cJSON_GetObjectItem(audio_params, "frame_duration");
+    if (cJSON_IsNumber(frame_duration)) {
+        int duration = frame_duration->valueint;
+        if (duration == 20 || duration == 40 || duration == 60) {
+            frame_duration_ = duration;
+        } else {
+            ESP_LOGW(TAG, "Unsupported frame duration %d ms, keep %d ms", duration, frame_duration_);
+        }
+    }
+}
+
 void Protocol::SetError(const std::string& message) {
     error_occurred_ = true;
     if (on_network_error_ != nullptr) {
@@ -5,6 +5,7 @@
 #include <string>
 #include <functional>
 #include <chrono>
+#include <atomic>
 
 struct BinaryProtocol3 {
     uint8_t type;
@@ -13,6 +14,15 @@ struct BinaryProtocol3 {
     uint8_t payload[];
 } __attribute__((packed));
 
+// Cumulative counters of the audio channel, used to adapt the uplink encoder
+struct AudioLinkStats {
+    uint32_t sent_packets = 0;
+    uint32_t send_failures = 0;
+    uint32_t received_packets = 0;
+    // Gaps in the incoming sequence, only known for UDP
+    uint32_t lost_packets = 0;
+};
+
 enum AbortReason {
     kAbortReasonNone,
     kAbortReasonWakeWordDetected
@@ -31,15 +41,24 @@ public:
     inline int server_sample_rate() const {
         return server_sample_rate_;
     }
+    // Opus frame duration of the current session, as answered by the server hello
+    inline int frame_duration() const {
+        return frame_duration_;
+    }
     inline const std::string& session_id() const {
         return session_id_;
     }
+    // Safe to call from any task
+    AudioLinkStats GetAudioLinkStats() const;
 
-    void OnIncomingAudio(std::function<void(std::vector<uint8_t>&& data)> callback);
+    // sequence increases by one per packet sent by the server, packets may arrive out of order
+    void OnIncomingAudio(std::function<void(std::vector<uint8_t>&& data, uint32_t sequence)> callback);
     void OnIncomingJson(std::function<void(const cJSON* root)> callback);
     void OnAudioChannelOpened(std::function<void()> callback);
     void OnAudioChannelClosed(std::function<void()> callback);
     void OnNetworkError(std::function<void(const std::string& message)> callback);
+    // Frame duration requested by the next hello message
+    void SetPreferredFrameDuration(int duration_ms);
 
     virtual void Start() = 0;
     virtual bool OpenAudioChannel() = 0;
@@ -55,17 +74,26 @@ public:
 
 protected:
     std::function<void(const cJSON* root)> on_incoming_json_;
-    std::function<void(std::vector<uint8_t>&& data)> on_incoming_audio_;
+    std::function<void(std::vector<uint8_t>&& data, uint32_t sequence)> on_incoming_audio_;
     std::function<void()> on_audio_channel_opened_;
     std::function<void()> on_audio_channel_closed_;
     std::function<void(const std::string& message)> on_network_error_;
 
     int server_sample_rate_ = 16000;
+    std::atomic<uint32_t> sent_audio_packets_{0};
+    std::atomic<uint32_t> audio_send_failures_{0};
+    std::atomic<uint32_t> received_audio_packets_{0};
+    std::atomic<uint32_t> lost_audio_packets_{0};
+    int preferred_frame_duration_ = 60;
+    int frame_duration_ = 60;
     bool error_occurred_ = false;
     std::string session_id_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
 
     virtual void SendText(const std::string& text) = 0;
+    // fec announces that lost packets can be recovered from the in-band FEC of the next one
+    std::string GetHelloAudioParams(bool fec = false) const;
+    void ParseServerAudioParams(const cJSON* audio_params);
     virtual void SetError(const std::string& message);
     virtual bool IsTimeout() const;
 };
@@ -2,6 +2,7 @@
 #include "board.h"
 #include "system_info.h"
 #include "application.h"
+#include "memory_accounting.h"
 
 #include <cstring>
 #include <cJSON.h>
@@ -30,7 +31,11 @@ void WebsocketProtocol::SendAudio(const std::vector<uint8_t>& data) {
         return;
     }
 
-    websocket_->Send(data.data(), data.size(), true);
+    if (websocket_->Send(data.data(), data.size(), true)) {
+        sent_audio_packets_++;
+    } else {
+        audio_send_failures_++;
+    }
 }
 
 void WebsocketProtocol::SendText(const std::string& text) {
@@ -56,11 +61,13 @@ void WebsocketProtocol::CloseAudioChannel() {
 }
 
 bool WebsocketProtocol::OpenAudioChannel() {
+    MemoryTagScope memory_tag_scope(kMemoryTagProtocol);
     if (websocket_ != nullptr) {
         delete websocket_;
     }
 
     error_occurred_ = false;
+    remote_sequence_ = 0;
     std::string url = CONFIG_WEBSOCKET_URL;
     std::string token = "Bearer " + std::string(CONFIG_WEBSOCKET_ACCESS_TOKEN);
     websocket_ = Board::GetInstance().CreateWebSocket();
@@ -70,9 +77,11 @@ bool WebsocketProtocol::OpenAudioChannel() {
     websocket_->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
 
     websocket_->OnData([this](const char* data, size_t len, bool binary) {
+        MemoryTagScope memory_tag_scope(kMemoryTagProtocol);
         if (binary) {
+            received_audio_packets_++;
             if (on_incoming_audio_ != nullptr) {
-                on_incoming_audio_(std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + len));
+                on_incoming_audio_(std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + len), ++remote_sequence_);
             }
         } else {
             // Parse JSON data
@@ -108,14 +117,13 @@ bool WebsocketProtocol::OpenAudioChannel() {
     }
 
     // Send hello message to describe the client
-    // keys: message type, version, audio_params (format, sample_rate, channels)
+    // keys: message type, version, audio_params (format, sample_rate, channels, frame_duration)
     std::string message = "{";
     message += "\"type\":\"hello\",";
     message += "\"version\": 1,";
     message += "\"transport\":\"websocket\",";
-    message += "\"audio_params\":{";
-    message += "\"format\":\"opus\", \"sample_rate\":16000, \"channels\":1, \"frame_duration\":" + std::to_string(OPUS_FRAME_DURATION_MS);
-    message += "}}";
+    message += GetHelloAudioParams();
+    message += "}";
     websocket_->Send(message);
 
     // Wait for server hello
@@ -140,13 +148,7 @@ void WebsocketProtocol::ParseServerHello(const cJSON* root) {
         return;
     }
 
-    auto audio_params = cJSON_GetObjectItem(root, "audio_params");
-    if (audio_params != NULL) {
-        auto sample_rate = cJSON_GetObjectItem(audio_params, "sample_rate");
-        if (sample_rate != NULL) {
-            server_sample_rate_ = sample_rate->valueint;
-        }
-    }
+    ParseServerAudioParams(cJSON_GetObjectItem(root, "audio_params"));
 
     xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
 }
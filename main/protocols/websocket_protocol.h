@@ -24,6 +24,8 @@ public:
 private:
     EventGroupHandle_t event_group_handle_;
     WebSocket* websocket_ = nullptr;
+    // Websocket frames arrive complete and in order, they are numbered on arrival
+    uint32_t remote_sequence_ = 0;
 
     void ParseServerHello(const cJSON* root);
     void SendText(const std::string& text) override;
@@ -0,0 +1,222 @@
+#ifndef TASK_QUEUE_H
+#define TASK_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// A move-only void() callable with inline storage.
+// Callables that fit in kInlineSize bytes are stored in place, so scheduling a
+// small lambda does not touch the heap. Larger callables fall back to new/delete.
+template <size_t kInlineSize = 32>
+class InlineTask {
+public:
+    InlineTask() = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, InlineTask>>>
+    InlineTask(F&& callable) {
+        using Callable = std::decay_t<F>;
+        if constexpr (kFitsInline<Callable>) {
+            new (storage_) Callable(std::forward<F>(callable));
+            ops_ = &InlineOps<Callable>::kOps;
+        } else {
+            new (storage_) Callable*(new Callable(std::forward<F>(callable)));
+            ops_ = &HeapOps<Callable>::kOps;
+        }
+    }
+
+    InlineTask(InlineTask&& other) noexcept {
+        MoveFrom(other);
+    }
+
+    InlineTask& operator=(InlineTask&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            MoveFrom(other);
+        }
+        return *this;
+    }
+
+    InlineTask(const InlineTask&) = delete;
+    InlineTask& operator=(const InlineTask&) = delete;
+
+    ~InlineTask() {
+        Reset();
+    }
+
+    void operator()() {
+        ops_->invoke(storage_);
+    }
+
+    explicit operator bool() const { return ops_ != nullptr; }
+    bool is_inline() const { return ops_ != nullptr && ops_->is_inline; }
+
+    void Reset() {
+        if (ops_ != nullptr) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+        }
+    }
+
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void* storage);
+        bool is_inline;
+    };
+
+    template <typename F>
+    static constexpr bool kFitsInline = sizeof(F) <= kInlineSize &&
+        alignof(F) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<F>;
+
+    template <typename F>
+    struct InlineOps {
+        static void Invoke(void* storage) { (*static_cast<F*>(storage))(); }
+        static void Move(void* dst, void* src) {
+            new (dst) F(std::move(*static_cast<F*>(src)));
+            static_cast<F*>(src)->~F();
+        }
+        static void Destroy(void* storage) { static_cast<F*>(storage)->~F(); }
+        static constexpr Ops kOps = { Invoke, Move, Destroy, true };
+    };
+
+    template <typename F>
+    struct HeapOps {
+        static F* Get(void* storage) { return *static_cast<F**>(storage); }
+        static void Invoke(void* storage) { (*Get(storage))(); }
+        static void Move(void* dst, void* src) { new (dst) F*(Get(src)); }
+        static void Destroy(void* storage) { delete Get(storage); }
+        static constexpr Ops kOps = { Invoke, Move, Destroy, false };
+    };
+
+    const Ops* ops_ = nullptr;
+    alignas(std::max_align_t) unsigned char storage_[kInlineSize];
+
+    void MoveFrom(InlineTask& other) {
+        if (other.ops_ != nullptr) {
+            other.ops_->move(storage_, other.storage_);
+            ops_ = other.ops_;
+            other.ops_ = nullptr;
+        }
+    }
+};
+
+// Bounded multi-producer single-consumer ring (Vyukov sequence cells).
+// Producers never block: TryPush returns false when the ring is full and the
+// caller decides how to handle the overflow. Only one task may call TryPop.
+template <typename T, size_t kCapacity>
+class MpscQueue {
+    static_assert(kCapacity >= 2 && (kCapacity & (kCapacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    MpscQueue() {
+        for (size_t i = 0; i < kCapacity; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    bool TryPush(T&& value) {
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells_[pos & (kCapacity - 1)];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool TryPop(T& value) {
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        Cell& cell = cells_[pos & (kCapacity - 1)];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        if ((intptr_t)sequence - (intptr_t)(pos + 1) < 0) {
+            // Empty, or a producer has claimed the cell but not published it yet
+            return false;
+        }
+        value = std::move(cell.value);
+        cell.sequence.store(pos + kCapacity, std::memory_order_release);
+        dequeue_pos_.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Approximate number of queued items, for statistics only
+    size_t size() const {
+        size_t enqueued = enqueue_pos_.load(std::memory_order_relaxed);
+        size_t dequeued = dequeue_pos_.load(std::memory_order_relaxed);
+        return enqueued > dequeued ? enqueued - dequeued : 0;
+    }
+
+    static constexpr size_t capacity() { return kCapacity; }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    Cell cells_[kCapacity];
+    std::atomic<size_t> enqueue_pos_{0};
+    std::atomic<size_t> dequeue_pos_{0};
+};
+
+// Bounded single-producer single-consumer ring. Cheaper than MpscQueue when
+// exactly one task pushes and exactly one task pops.
+template <typename T, size_t kCapacity>
+class SpscQueue {
+    static_assert(kCapacity >= 2 && (kCapacity & (kCapacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    SpscQueue() = default;
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    bool TryPush(T&& value) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) == kCapacity) {
+            return false;
+        }
+        slots_[head & (kCapacity - 1)] = std::move(value);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool TryPop(T& value) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = std::move(slots_[tail & (kCapacity - 1)]);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+    }
+
+    static constexpr size_t capacity() { return kCapacity; }
+
+private:
+    T slots_[kCapacity];
+    std::atomic<size_t> head_{0};
+    std::atomic<size_t> tail_{0};
+};
+
+#endif // TASK_QUEUE_H
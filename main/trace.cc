@@ -0,0 +1,233 @@
+#include "trace.h"
+#include "board.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <mbedtls/base64.h>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#define TAG "Trace"
+
+#define TRACE_MAGIC "XZTR"
+#define TRACE_VERSION 1
+// 57 bytes become one 76 character base64 line
+#define TRACE_SERIAL_CHUNK_SIZE 57
+
+static const char* const EVENT_NAMES[] = {
+    "state_change",
+    "main_loop",
+    "main_tasks",
+    "audio_input_isr",
+    "audio_output_isr",
+    "audio_input",
+    "encode",
+    "encoded_frame",
+    "decode",
+    "output_write",
+    "send_audio",
+    "incoming_audio",
+    "decode_queue",
+    "sequence_error",
+};
+static_assert(sizeof(EVENT_NAMES) / sizeof(EVENT_NAMES[0]) == kTraceEventCount, "EVENT_NAMES must match TraceEventId");
+
+struct TraceDumpHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint16_t core_count;
+    uint16_t event_count;
+    uint16_t task_count;
+    uint16_t reserved;
+    uint64_t dump_time_us;
+} __attribute__((packed));
+
+struct TraceDumpCore {
+    uint16_t core;
+    uint16_t reserved;
+    uint32_t record_count;
+} __attribute__((packed));
+
+std::atomic<bool> Trace::enabled_{false};
+Trace::Ring Trace::rings_[portNUM_PROCESSORS];
+uint32_t Trace::mask_ = 0;
+
+void Trace::Initialize(size_t events_per_core) {
+    if (mask_ != 0) {
+        return;
+    }
+    size_t capacity = 1;
+    while (capacity < events_per_core) {
+        capacity <<= 1;
+    }
+
+    for (auto& ring : rings_) {
+        // The I2S ISRs write here and must keep running while the cache is off for a flash
+        // write, so the rings stay in internal RAM, not PSRAM
+        ring.records = (TraceRecord*)heap_caps_calloc(capacity, sizeof(TraceRecord), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        if (ring.records == nullptr) {
+            ESP_LOGE(TAG, "Failed to allocate %u trace records", capacity);
+            for (auto& r : rings_) {
+                heap_caps_free(r.records);
+                r.records = nullptr;
+            }
+            return;
+        }
+    }
+    mask_ = capacity - 1;
+    enabled_ = true;
+    ESP_LOGI(TAG, "Trace enabled, %u events per core", capacity);
+}
+
+void Trace::SetEnabled(bool enabled) {
+    enabled_ = enabled && mask_ != 0;
+}
+
+IRAM_ATTR void Trace::RecordFromIsr(TraceEventId event, TracePhase phase, uint32_t arg0, uint32_t arg1) {
+    if (IsEnabled()) {
+        Write(event, phase, TRACE_FLAG_ISR, 0, arg0, arg1);
+    }
+}
+
+IRAM_ATTR void Trace::Write(TraceEventId event, TracePhase phase, uint8_t flags, uint32_t task, uint32_t arg0, uint32_t arg1) {
+    // Take the time before claiming the slot. An interrupt between the two can still put neighbouring
+    // records slightly out of order, trace_to_perfetto.py allows for that
+    uint32_t timestamp = (uint32_t)esp_timer_get_time();
+    auto& ring = rings_[xPortGetCoreID()];
+    uint32_t index = ring.head.fetch_add(1, std::memory_order_relaxed);
+    auto& record = ring.records[index & mask_];
+    record.timestamp = timestamp;
+    record.event = event;
+    record.phase = phase;
+    record.flags = flags;
+    record.task = task;
+    record.arg0 = arg0;
+    record.arg1 = arg1;
+}
+
+void Trace::Serialize(std::function<void(const void* data, size_t size)> writer) {
+    if (mask_ == 0) {
+        return;
+    }
+    bool was_enabled = IsEnabled();
+    enabled_ = false;
+    // Let writers that already passed the enabled check finish their record
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    // Names of the tasks that are still alive, the decoder falls back to the handle for the others
+    std::vector<TaskStatus_t> tasks(uxTaskGetNumberOfTasks() + 4);
+    tasks.resize(uxTaskGetSystemState(tasks.data(), tasks.size(), nullptr));
+
+    TraceDumpHeader header = {};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(TraceRecord);
+    header.core_count = portNUM_PROCESSORS;
+    header.event_count = kTraceEventCount;
+    header.task_count = tasks.size();
+    header.dump_time_us = esp_timer_get_time();
+    writer(&header, sizeof(header));
+
+    for (int i = 0; i < kTraceEventCount; ++i) {
+        uint16_t id = i;
+        uint8_t length = strlen(EVENT_NAMES[i]);
+        writer(&id, sizeof(id));
+        writer(&length, sizeof(length));
+        writer(EVENT_NAMES[i], length);
+    }
+
+    for (auto& task : tasks) {
+        uint32_t handle = (uint32_t)(uintptr_t)task.xHandle;
+        uint8_t length = strnlen(task.pcTaskName, configMAX_TASK_NAME_LEN);
+        writer(&handle, sizeof(handle));
+        writer(&length, sizeof(length));
+        writer(task.pcTaskName, length);
+    }
+
+    for (int core = 0; core < portNUM_PROCESSORS; ++core) {
+        auto& ring = rings_[core];
+        uint32_t head = ring.head.load(std::memory_order_relaxed);
+        uint32_t count = std::min(head, mask_ + 1);
+        TraceDumpCore core_header = { (uint16_t)core, 0, count };
+        writer(&core_header, sizeof(core_header));
+        // Oldest first
+        for (uint32_t index = head - count; index != head; ++index) {
+            writer(&ring.records[index & mask_], sizeof(TraceRecord));
+        }
+    }
+
+    enabled_ = was_enabled;
+}
+
+void Trace::DumpToSerial() {
+    uint8_t chunk[TRACE_SERIAL_CHUNK_SIZE];
+    size_t chunk_size = 0;
+    char line[TRACE_SERIAL_CHUNK_SIZE / 3 * 4 + 1];
+
+    auto flush = [&]() {
+        size_t line_size = 0;
+        mbedtls_base64_encode((unsigned char*)line, sizeof(line), &line_size, chunk, chunk_size);
+        line[line_size] = '\0';
+        printf("XZTRACE %s\n", line);
+        chunk_size = 0;
+    };
+
+    printf("XZTRACE BEGIN\n");
+    Serialize([&](const void* data, size_t size) {
+        auto bytes = (const uint8_t*)data;
+        while (size > 0) {
+            size_t n = std::min(size, sizeof(chunk) - chunk_size);
+            memcpy(chunk + chunk_size, bytes, n);
+            chunk_size += n;
+            bytes += n;
+            size -= n;
+            if (chunk_size == sizeof(chunk)) {
+                flush();
+            }
+        }
+    });
+    if (chunk_size > 0) {
+        flush();
+    }
+    printf("XZTRACE END\n");
+}
+
+bool Trace::Upload(const std::string& url) {
+    std::string body;
+    Serialize([&body](const void* data, size_t size) {
+        body.append((const char*)data, size);
+    });
+
+    auto http = Board::GetInstance().CreateHttp();
+    http->SetHeader("Content-Type", "application/octet-stream");
+    bool success = http->Open("POST", url, body);
+    if (success) {
+        success = http->GetStatusCode() == 200;
+        http->Close();
+    }
+    delete http;
+
+    if (success) {
+        ESP_LOGI(TAG, "Uploaded %u bytes of trace to %s", body.size(), url.c_str());
+    } else {
+        ESP_LOGE(TAG, "Failed to upload trace to %s", url.c_str());
+    }
+    return success;
+}
+
+void Trace::DumpAsync(const std::string& url) {
+    auto arg = new std::string(url);
+    xTaskCreate([](void* arg) {
+        auto url = (std::string*)arg;
+        if (url->empty()) {
+            DumpToSerial();
+        } else {
+            Upload(*url);
+        }
+        delete url;
+        vTaskDelete(NULL);
+    }, "trace_dump", 4096, arg, 1, nullptr);
+}
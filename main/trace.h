@@ -0,0 +1,121 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_attr.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <functional>
+
+// Event ids, the names are in trace.cc and written into every dump
+enum TraceEventId : uint16_t {
+    kTraceStateChange,          // instant: old state, new state
+    kTraceMainLoop,             // begin: event bits
+    kTraceMainTasks,            // begin: queued tasks
+    kTraceAudioInputIsr,        // instant, from on_recv
+    kTraceAudioOutputIsr,       // instant, from on_sent
+    kTraceAudioInput,           // begin / end: samples read
+    kTraceEncode,               // begin: PCM samples
+    kTraceEncodedFrame,         // instant: Opus bytes
+    kTraceDecode,               // begin: Opus bytes, end: PCM samples
+    kTraceOutputWrite,          // begin: PCM samples
+    kTraceSendAudio,            // instant: bytes
+    kTraceIncomingAudio,        // instant: bytes
+    kTraceDecodeQueue,          // counter: queued packets
+    kTraceSequenceError,        // instant: received sequence, expected sequence
+    kTraceEventCount
+};
+
+enum TracePhase : uint8_t {
+    kTracePhaseBegin = 'B',
+    kTracePhaseEnd = 'E',
+    kTracePhaseInstant = 'i',
+    kTracePhaseCounter = 'C',
+};
+
+#define TRACE_FLAG_ISR 0x01
+
+struct TraceRecord {
+    uint32_t timestamp;         // Low 32 bits of esp_timer_get_time(), the decoder unwraps it
+    uint16_t event;
+    uint8_t phase;
+    uint8_t flags;
+    uint32_t task;              // Task handle, 0 in ISR context
+    uint32_t arg0;
+    uint32_t arg1;
+};
+
+// Fixed size ring per core. Writers only claim a slot with one atomic add, so recording
+// works from tasks and ISRs alike. Old records are overwritten, a dump pauses recording
+// while it reads the rings.
+class Trace {
+public:
+    static void Initialize(size_t events_per_core);
+    static bool IsEnabled() { return enabled_.load(std::memory_order_relaxed); }
+    static void SetEnabled(bool enabled);
+
+    static void Record(TraceEventId event, TracePhase phase, uint32_t arg0, uint32_t arg1) {
+        if (IsEnabled()) {
+            Write(event, phase, 0, (uint32_t)(uintptr_t)xTaskGetCurrentTaskHandle(), arg0, arg1);
+        }
+    }
+    static IRAM_ATTR void RecordFromIsr(TraceEventId event, TracePhase phase, uint32_t arg0, uint32_t arg1);
+
+    // Binary dump, see scripts/trace_to_perfetto.py for the format
+    static void Serialize(std::function<void(const void* data, size_t size)> writer);
+    // Prints the dump as base64 lines between "XZTRACE BEGIN" and "XZTRACE END"
+    static void DumpToSerial();
+    static bool Upload(const std::string& url);
+    // Dumps from a separate task, to the url if it is not empty, otherwise to the serial port
+    static void DumpAsync(const std::string& url);
+
+private:
+    struct Ring {
+        std::atomic<uint32_t> head{0};
+        TraceRecord* records = nullptr;
+    };
+
+    static std::atomic<bool> enabled_;
+    static Ring rings_[portNUM_PROCESSORS];
+    static uint32_t mask_;
+
+    static IRAM_ATTR void Write(TraceEventId event, TracePhase phase, uint8_t flags, uint32_t task, uint32_t arg0, uint32_t arg1);
+};
+
+#if CONFIG_USE_TRACE
+class TraceScope {
+public:
+    TraceScope(TraceEventId event, uint32_t arg0) : event_(event) {
+        Trace::Record(event_, kTracePhaseBegin, arg0, 0);
+    }
+    ~TraceScope() {
+        Trace::Record(event_, kTracePhaseEnd, 0, 0);
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    TraceEventId event_;
+};
+
+#define TRACE_INSTANT(event, arg0, arg1) Trace::Record(event, kTracePhaseInstant, arg0, arg1)
+#define TRACE_BEGIN(event, arg0) Trace::Record(event, kTracePhaseBegin, arg0, 0)
+#define TRACE_END(event, arg0) Trace::Record(event, kTracePhaseEnd, arg0, 0)
+#define TRACE_COUNTER(event, value) Trace::Record(event, kTracePhaseCounter, value, 0)
+#define TRACE_ISR(event, arg0, arg1) Trace::RecordFromIsr(event, kTracePhaseInstant, arg0, arg1)
+#define TRACE_SCOPE_CONCAT_(a, b) a##b
+#define TRACE_SCOPE_CONCAT(a, b) TRACE_SCOPE_CONCAT_(a, b)
+#define TRACE_SCOPE(event, arg0) TraceScope TRACE_SCOPE_CONCAT(trace_scope_, __LINE__)(event, arg0)
+#else
+#define TRACE_INSTANT(event, arg0, arg1) ((void)0)
+#define TRACE_BEGIN(event, arg0) ((void)0)
+#define TRACE_END(event, arg0) ((void)0)
+#define TRACE_COUNTER(event, value) ((void)0)
+#define TRACE_ISR(event, arg0, arg1) ((void)0)
+#define TRACE_SCOPE(event, arg0) ((void)0)
+#endif
+
+#endif // TRACE_H
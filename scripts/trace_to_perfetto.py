@@ -0,0 +1,195 @@
+#!/usr/bin/env python3
+# 将设备导出的事件跟踪 (CONFIG_USE_TRACE) 转换为 Chrome / Perfetto 的 trace JSON
+#
+# 输入可以是 HTTP 上传的二进制文件，也可以是包含 "XZTRACE" 行的串口日志：
+#   idf.py monitor | tee monitor.log
+#   python scripts/trace_to_perfetto.py monitor.log -o trace.json
+# 然后在 https://ui.perfetto.dev 或 chrome://tracing 中打开 trace.json
+import argparse
+import base64
+import json
+import re
+import struct
+import sys
+
+MAGIC = b"XZTR"
+HEADER = struct.Struct("<4sHHHHHHQ")
+CORE_HEADER = struct.Struct("<HHI")
+RECORD = struct.Struct("<IHBBIII")
+FLAG_ISR = 0x01
+PID = 1
+
+# 与 main/trace.h 中 TraceEventId 的注释保持一致
+ARG_NAMES = {
+    "state_change": ("from", "to"),
+    "main_loop": ("bits",),
+    "main_tasks": ("queued",),
+    "audio_input": ("samples",),
+    "encode": ("samples",),
+    "encoded_frame": ("bytes",),
+    "decode": ("bytes_or_samples",),
+    "output_write": ("samples",),
+    "send_audio": ("bytes",),
+    "incoming_audio": ("bytes",),
+    "sequence_error": ("sequence", "expected"),
+}
+
+DEVICE_STATES = ["unknown", "starting", "configuring", "idle", "connecting",
+                 "listening", "speaking", "upgrading", "activating", "fatal_error"]
+
+
+def read_dump(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if data.startswith(MAGIC):
+        return data
+
+    # 串口日志：取 BEGIN 与 END 之间的 base64 行，日志前缀和颜色码会被忽略
+    chunks = []
+    inside = False
+    for line in data.decode("utf-8", errors="ignore").splitlines():
+        match = re.search(r"XZTRACE (\S+)", line)
+        if match is None:
+            continue
+        token = match.group(1)
+        if token == "BEGIN":
+            chunks = []
+            inside = True
+        elif token == "END":
+            inside = False
+        elif inside:
+            chunks.append(base64.b64decode(token))
+    if not chunks:
+        raise ValueError("No XZTRACE dump found in %s" % path)
+    return b"".join(chunks)
+
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.offset = 0
+
+    def unpack(self, fmt):
+        values = fmt.unpack_from(self.data, self.offset)
+        self.offset += fmt.size
+        return values
+
+    def string(self, length):
+        value = self.data[self.offset:self.offset + length].decode("utf-8", errors="replace")
+        self.offset += length
+        return value
+
+
+def unwrap_timestamps(records, dump_time):
+    # 记录只保存了 32 位微秒时间戳，从导出时间往前推出完整的 64 位时间
+    # 中断或抢占可能让相邻记录的时间稍有倒序，取与前一条模 2^32 最接近的值，
+    # 只有跳变超过半个范围才算作回绕
+    result = []
+    current = dump_time
+    for record in reversed(records):
+        delta = (record[0] - current) & 0xFFFFFFFF
+        if delta >= 1 << 31:
+            delta -= 1 << 32
+        current += delta
+        result.append(current)
+    result.reverse()
+    return result
+
+
+def parse(data):
+    reader = Reader(data)
+    magic, version, record_size, core_count, event_count, task_count, _, dump_time = reader.unpack(HEADER)
+    if magic != MAGIC:
+        raise ValueError("Bad magic")
+    if version != 1 or record_size != RECORD.size:
+        raise ValueError("Unsupported trace version %d, record size %d" % (version, record_size))
+
+    events = {}
+    for _ in range(event_count):
+        event_id, length = reader.unpack(struct.Struct("<HB"))
+        events[event_id] = reader.string(length)
+
+    tasks = {}
+    for _ in range(task_count):
+        handle, length = reader.unpack(struct.Struct("<IB"))
+        tasks[handle] = reader.string(length)
+
+    cores = []
+    for _ in range(core_count):
+        core, _, count = reader.unpack(CORE_HEADER)
+        records = [reader.unpack(RECORD) for _ in range(count)]
+        cores.append((core, records))
+    return dump_time, events, tasks, cores
+
+
+def format_args(name, arg0, arg1):
+    names = ARG_NAMES.get(name, ("arg0", "arg1"))
+    args = {}
+    for key, value in zip(names, (arg0, arg1)):
+        args[key] = value
+    if name == "state_change":
+        args = {key: DEVICE_STATES[value] if value < len(DEVICE_STATES) else value for key, value in args.items()}
+    return args
+
+
+def convert(data):
+    dump_time, events, tasks, cores = parse(data)
+    trace_events = []
+    seen_threads = set()
+    start_time = None
+
+    for core, records in cores:
+        timestamps = unwrap_timestamps(records, dump_time)
+        if timestamps:
+            start_time = timestamps[0] if start_time is None else min(start_time, timestamps[0])
+
+    # 任务可能在两个核之间迁移，所以按任务分轨道，核号放在参数里；每个核的 ISR 单独一个轨道
+    trace_events.append({"name": "process_name", "ph": "M", "pid": PID, "args": {"name": "xiaozhi"}})
+    for core, records in cores:
+        timestamps = unwrap_timestamps(records, dump_time)
+        for record, timestamp in zip(records, timestamps):
+            _, event_id, phase, flags, task, arg0, arg1 = record
+            name = events.get(event_id, "event_%d" % event_id)
+            # 任务句柄是内存地址，不会与这些小数字冲突
+            tid = core + 1 if flags & FLAG_ISR else task
+            if tid not in seen_threads:
+                seen_threads.add(tid)
+                thread_name = "ISR core %d" % core if flags & FLAG_ISR else tasks.get(task, "task 0x%08x" % task)
+                trace_events.append({"name": "thread_name", "ph": "M", "pid": PID, "tid": tid,
+                                     "args": {"name": thread_name}})
+
+            event = {"name": name, "ph": chr(phase), "ts": timestamp - start_time, "pid": PID, "tid": tid}
+            if chr(phase) == "C":
+                event["args"] = {name: arg0}
+            elif chr(phase) == "E":
+                event["args"] = {"result": arg0}
+            else:
+                event["args"] = format_args(name, arg0, arg1)
+            if chr(phase) == "i":
+                event["s"] = "t"
+            event["args"]["core"] = core
+            trace_events.append(event)
+
+    trace_events.sort(key=lambda event: event.get("ts", -1))
+    return {"traceEvents": trace_events, "displayTimeUnit": "ms"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert a xiaozhi trace dump to Chrome / Perfetto trace JSON")
+    parser.add_argument("input", help="binary dump, or a serial log containing XZTRACE lines")
+    parser.add_argument("-o", "--output", default="trace.json", help="output JSON file")
+    args = parser.parse_args()
+
+    try:
+        result = convert(read_dump(args.input))
+    except (ValueError, struct.error) as e:
+        print("Error: %s" % e, file=sys.stderr)
+        sys.exit(1)
+
+    with open(args.output, "w", encoding="utf-8") as f:
+        json.dump(result, f)
+    print("Wrote %d events to %s" % (len(result["traceEvents"]), args.output))
+
+
+if __name__ == "__main__":
+    main()